@@ -27,6 +27,7 @@
 #include "spimage/image_filter_cuda.h"
 #include "spimage/image_io.h"
 #include "spimage/image_filter.h"
+#include "spimage/morphology.h"
 #include "spimage/find_center.h"
 #endif
 
@@ -21,19 +21,40 @@ extern "C"
 /* #define FFTW2 */
 
 #if defined FFTW3 && !defined __CUDACC__
+/* _SP_NO_FFTW is defined when spimage is built with USE_FFTW3 off.
+   The functions keep their names but use the builtin FFT. */
+#ifndef _SP_NO_FFTW
 #include <fftw3.h>
+#endif
 #define sp_image_ifft(a) sp_image_ifftw3(a)
 #define sp_image_fft(a) sp_image_fftw3(a) 
 #define sp_image_ifft_fast(a,b) sp_image_ifftw3_fast(a,b)
 #define sp_image_fft_fast(a,b) sp_image_fftw3_fast(a,b) 
+#define sp_image_ifft_fast_threads(a,b,c) sp_image_ifftw3_fast_threads(a,b,c)
+#define sp_image_fft_fast_threads(a,b,c) sp_image_fftw3_fast_threads(a,b,c)
   //#define sp_cmatrix_ifft(a) sp_cmatrix_ifftw3(a)
 #define sp_image_1d_fft(a,b) sp_image_1d_fftw3(a,b)
 #define sp_image_1d_ifft(a,b) sp_image_1d_fftw3(a,b)
 //#define sp_cmatrix_fft(a) sp_cmatrix_fftw3(a) 
 #define sp_c3matrix_ifft(a) sp_c3matrix_ifftw3(a)
 #define sp_c3matrix_fft(a) sp_c3matrix_fftw3(a)
+#define sp_image_rfft(a) sp_image_rfftw3(a)
+#define sp_image_irfft(a,b) sp_image_irfftw3(a,b)
+#define sp_image_rfft_fast(a,b) sp_image_rfftw3_fast(a,b)
+#define sp_image_irfft_fast(a,b) sp_image_irfftw3_fast(a,b)
+#define sp_image_fft_centered(a) sp_image_fftw3_centered(a)
+#define sp_image_ifft_centered(a) sp_image_ifftw3_centered(a)
+#define sp_image_fft_padded(a,b,c,d) sp_image_fftw3_padded(a,b,c,d)
+#define sp_image_ifft_padded(a,b,c,d) sp_image_ifftw3_padded(a,b,c,d)
+#define sp_image_fft_many(a,b) sp_image_fftw3_many(a,b)
+#define sp_image_ifft_many(a,b) sp_image_ifftw3_many(a,b)
+#define sp_fft_stack(a,b,c,d,e,f) sp_fftw3_stack(a,b,c,d,e,f)
+#define sp_ifft_stack(a,b,c,d,e,f) sp_ifftw3_stack(a,b,c,d,e,f)
+#define sp_rfft_array(a,b,c,d,e,f) sp_rfftw3_array(a,b,c,d,e,f)
+#define sp_irfft_array(a,b,c,d,e,f) sp_irfftw3_array(a,b,c,d,e,f)
 
 
+#ifndef _SP_NO_FFTW
 #ifdef _SP_DOUBLE_PRECISION
   typedef fftw_complex fftwr_complex;
   typedef fftw_plan fftwr_plan;
@@ -45,10 +66,17 @@ extern "C"
   #define fftwr_plan_dft_r2c_2d(a,b,c,d,e) fftw_plan_dft_r2c_2d(a,b,c,d,e)
   #define fftwr_plan_dft_3d(a,b,c,d,e,f,g) fftw_plan_dft_3d(a,b,c,d,e,f,g)
   #define fftwr_plan_dft_r2c_3d(a,b,c,d,e,f) fftw_plan_dft_r2c_3d(a,b,c,d,e,f)
+  #define fftwr_plan_dft_c2r_3d(a,b,c,d,e,f) fftw_plan_dft_c2r_3d(a,b,c,d,e,f)
   #define fftwr_plan_guru_split_dft(a,b,c,d,e,f,g,h,i) fftw_plan_guru_split_dft(a,b,c,d,e,f,g,h,i)
   #define fftwr_init_threads() fftw_init_threads()
   #define fftwr_plan_with_nthreads(a) fftw_plan_with_nthreads(a)
   #define fftwr_plan_many_dft(a,b,c,d,e,f,g,h,i,j,k,l,m) fftw_plan_many_dft(a,b,c,d,e,f,g,h,i,j,k,l,m)
+  #define fftwr_execute_dft(a,b,c) fftw_execute_dft(a,b,c)
+  #define fftwr_execute_dft_r2c(a,b,c) fftw_execute_dft_r2c(a,b,c)
+  #define fftwr_execute_dft_c2r(a,b,c) fftw_execute_dft_c2r(a,b,c)
+  #define fftwr_alignment_of(a) fftw_alignment_of(a)
+  #define fftwr_import_wisdom_from_filename(a) fftw_import_wisdom_from_filename(a)
+  #define fftwr_export_wisdom_to_filename(a) fftw_export_wisdom_to_filename(a)
 #else
   typedef fftwf_complex fftwr_complex;
   typedef fftwf_plan fftwr_plan;
@@ -59,12 +87,20 @@ extern "C"
   #define fftwr_plan_dft_2d(a,b,c,d,e,f) fftwf_plan_dft_2d(a,b,c,d,e,f) 
   #define fftwr_plan_dft_r2c_2d(a,b,c,d,e) fftwf_plan_dft_r2c_2d(a,b,c,d,e) 
   #define fftwr_plan_dft_3d(a,b,c,d,e,f,g) fftwf_plan_dft_3d(a,b,c,d,e,f,g)
-  #define fftwf_plan_dft_r2c_3d(a,b,c,d,e,f) fftwf_plan_dft_r2c_3d(a,b,c,d,e,f)
+  #define fftwr_plan_dft_r2c_3d(a,b,c,d,e,f) fftwf_plan_dft_r2c_3d(a,b,c,d,e,f)
+  #define fftwr_plan_dft_c2r_3d(a,b,c,d,e,f) fftwf_plan_dft_c2r_3d(a,b,c,d,e,f)
   #define fftwr_plan_guru_split_dft(a,b,c,d,e,f,g,h,i) fftwf_plan_guru_split_dft(a,b,c,d,e,f,g,h,i)
   #define fftwr_init_threads() fftwf_init_threads()
   #define fftwr_plan_with_nthreads(a) fftwf_plan_with_nthreads(a)
   #define fftwr_plan_many_dft(a,b,c,d,e,f,g,h,i,j,k,l,m) fftwf_plan_many_dft(a,b,c,d,e,f,g,h,i,j,k,l,m)
+  #define fftwr_execute_dft(a,b,c) fftwf_execute_dft(a,b,c)
+  #define fftwr_execute_dft_r2c(a,b,c) fftwf_execute_dft_r2c(a,b,c)
+  #define fftwr_execute_dft_c2r(a,b,c) fftwf_execute_dft_c2r(a,b,c)
+  #define fftwr_alignment_of(a) fftwf_alignment_of(a)
+  #define fftwr_import_wisdom_from_filename(a) fftwf_import_wisdom_from_filename(a)
+  #define fftwr_export_wisdom_to_filename(a) fftwf_export_wisdom_to_filename(a)
 #endif
+#endif /* _SP_NO_FFTW */
 
 #endif
 #ifdef FFTW2
@@ -89,15 +125,22 @@ spimage_EXPORT Image * sp_image_fft(const Image * img);
 /*! Simply does the fft of the input data and puts it into out */
 spimage_EXPORT void sp_image_fft_fast(const Image * in, Image * out);
 
+/*! Same as sp_image_fft_fast() but using nthreads FFTW threads.
+ *
+ * If nthreads is 0 the number given to sp_init_fft() is used.
+ * This allows, for example, each phaser to use its own number of threads.
+ */
+spimage_EXPORT void sp_image_fft_fast_threads(const Image * in, Image * out, int nthreads);
+
   /*!Returns the 1d fourier transform of img along the specified axis. 
-   * axis = 0,1,2 corresponds to x,y,z respectively. (axis = 1 only
-   * works for 2d images.
+   * axis = 0,1,2 corresponds to x,y,z respectively.
+   * Returns NULL for any other axis.
    */
 spimage_EXPORT Image * sp_image_1d_fft(const Image *img,int axis);
 
   /*!Returns the 1d back fourier transform of img along the specified axis. 
-   * axis = 0,1,2 corresponds to x,y,z respectively. (axis = 1 only
-   * works for 2d images.
+   * axis = 0,1,2 corresponds to x,y,z respectively.
+   * Returns NULL for any other axis.
    */
 spimage_EXPORT Image * sp_image_1d_ifft(const Image *img,int axis);
 /*! Returns the forward FFT of m.
@@ -114,6 +157,12 @@ spimage_EXPORT Image * sp_image_ifft(const Image * img);
 /*! Simply does the ifft of the input data and puts it into out */
 spimage_EXPORT void sp_image_ifft_fast(const Image * in, Image * out);
 
+/*! Same as sp_image_ifft_fast() but using nthreads FFTW threads.
+ *
+ * If nthreads is 0 the number given to sp_init_fft() is used.
+ */
+spimage_EXPORT void sp_image_ifft_fast_threads(const Image * in, Image * out, int nthreads);
+
 
 /*! Returns the backward FFT of m.
  */
@@ -121,11 +170,249 @@ spimage_EXPORT void sp_image_ifft_fast(const Image * in, Image * out);
 /*! Returns the backward FFT of m.
  */
 spimage_EXPORT sp_c3matrix * sp_c3matrix_ifft(const sp_c3matrix * img);
+
+/*! Returns the forward FFT of the centered image img, centered.
+ *
+ * This gives the same result as sp_image_shift(sp_image_fft(sp_image_shift(img)))
+ * without the intermediate images. When every dimension is even (or 1) and
+ * the image center is in the middle, the shifts are done as a (-1)^(x+y+z)
+ * modulation of the input and output. Otherwise it falls back to sp_image_shift().
+ * The result is not shifted and its center is in the middle of the image.
+ */
+spimage_EXPORT Image * sp_image_fft_centered(const Image * img);
+
+/*! Returns the backward FFT of the centered image img, centered.
+ *
+ * See sp_image_fft_centered().
+ */
+spimage_EXPORT Image * sp_image_ifft_centered(const Image * img);
+
+/*! Returns the forward FFT of img zero padded to x*y*z.
+ *
+ * The padding is done like zero_pad_image() does it, so this gives the
+ * same result as sp_image_fft(zero_pad_image(img,x,y,z,0)) but the
+ * transform is done with one pass of 1D FFTs per axis, skipping the
+ * lines which contain only padding. A 3D image padded 4 times along
+ * each axis needs about half the work of a full transform.
+ * Returns NULL if img is bigger than x*y*z.
+ */
+spimage_EXPORT Image * sp_image_fft_padded(const Image * img, int x, int y, int z);
+
+/*! Returns the backward FFT of img zero padded to x*y*z.
+ *
+ * See sp_image_fft_padded(). As img must be shifted the padding goes
+ * to the high frequencies, which is useful for Fourier interpolation.
+ */
+spimage_EXPORT Image * sp_image_ifft_padded(const Image * img, int x, int y, int z);
+
+/*! Returns an array with the forward FFTs of the n images in list.
+ *
+ * All images must have the same size. The transforms are done in batches
+ * with a single FFTW plan, which is faster than transforming the images
+ * one by one. Each result is the same as the one from sp_image_fft().
+ * The returned array should be freed with sp_free() after freeing the images.
+ * Returns NULL if the sizes don't match.
+ */
+spimage_EXPORT Image ** sp_image_fft_many(Image ** list, int n);
+
+/*! Returns an array with the backward FFTs of the n images in list.
+ *
+ * See sp_image_fft_many() and sp_image_ifft().
+ */
+spimage_EXPORT Image ** sp_image_ifft_many(Image ** list, int n);
+
+/*! Does the forward FFT of n contiguous x*y*z arrays from in into out.
+ *
+ * in and out can be the same array.
+ */
+spimage_EXPORT void sp_fft_stack(const Complex * in, Complex * out, int x, int y, int z, int n);
+
+/*! Does the backward FFT of n contiguous x*y*z arrays from in into out.
+ *
+ * in and out can be the same array.
+ */
+spimage_EXPORT void sp_ifft_stack(const Complex * in, Complex * out, int x, int y, int z, int n);
+
+/*! Returns the forward FFT of the real part of img as a half spectrum.
+ *
+ * As the FFT of real data is Hermitian only the first sp_image_x(img)/2+1
+ * columns are calculated and returned, the rest can be obtained from
+ * F(-k) = conj(F(k)) or with sp_image_rfft_expand().
+ * The imaginary part of img is ignored.
+ * The result is phased and shifted and the mask is zero.
+ */
+spimage_EXPORT Image * sp_image_rfft(const Image * img);
+
+/*! Simply does the real to complex fft of the input data and puts it into out.
+ *
+ * out must be sp_image_x(in)/2+1 wide and have the same y and z size as in.
+ */
+spimage_EXPORT void sp_image_rfft_fast(const Image * in, Image * out);
+
+/*! Returns the backward FFT of the half spectrum img.
+ *
+ * nx is the x size of the result and must satisfy nx/2+1 == sp_image_x(img).
+ * The spectrum is assumed to be Hermitian so the result is real and
+ * unphased. Just like sp_image_ifft() the result is not scaled.
+ * Returns NULL if nx does not match.
+ */
+spimage_EXPORT Image * sp_image_irfft(const Image * img, int nx);
+
+/*! Simply does the complex to real ifft of the input data and puts it into out.
+ *
+ * sp_image_x(out)/2+1 must be equal to sp_image_x(in).
+ */
+spimage_EXPORT void sp_image_irfft_fast(const Image * in, Image * out);
+
+/*! Returns the full spectrum corresponding to the half spectrum img.
+ *
+ * nx is the x size of the full spectrum and must satisfy nx/2+1 == sp_image_x(img).
+ * Returns NULL if nx does not match.
+ */
+spimage_EXPORT Image * sp_image_rfft_expand(const Image * img, int nx);
+
+/*! Does the real to complex forward FFT of the x*y*z array in into the
+ * half spectrum out, which has (x/2+1)*y*z elements.
+ *
+ * nthreads is the number of FFTW threads, 0 for the sp_init_fft() default.
+ * in and out must not overlap.
+ */
+spimage_EXPORT void sp_rfft_array(const real * in, Complex * out, int x, int y, int z, int nthreads);
+
+/*! Does the complex to real backward FFT of the half spectrum in into the
+ * x*y*z array out.
+ *
+ * The contents of in are destroyed. Just like sp_image_ifft() the result
+ * is not scaled. in and out must not overlap.
+ */
+spimage_EXPORT void sp_irfft_array(Complex * in, real * out, int x, int y, int z, int nthreads);
+/*! How much effort the FFT planner puts into finding fast plans.
+ *
+ * These map to the FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT,
+ * FFTW_EXHAUSTIVE and FFTW_WISDOM_ONLY planner flags.
+ */
+typedef enum{SpFFTEstimate=0,SpFFTMeasure,SpFFTPatient,SpFFTExhaustive,SpFFTWisdomOnly}SpFFTPlannerRigor;
+
+/*! Implementation used for complex to complex transforms.
+ *
+ * SpFFTBackendFFTW3 is the default. SpFFTBackendBuiltin is a self contained
+ * mixed radix FFT, slower than FFTW but without any dependency.
+ * SpFFTBackendAuto times every backend the first time a given transform
+ * is done and keeps using the fastest one.
+ * Real to complex transforms always use FFTW.
+ *
+ * When spimage is built with USE_FFTW3 off SpFFTBackendFFTW3 is not
+ * available, SpFFTBackendBuiltin is the default and all the transforms,
+ * real to complex ones included, use the builtin FFT.
+ */
+typedef enum{SpFFTBackendFFTW3=0,SpFFTBackendBuiltin,SpFFTBackendAuto}SpFFTBackend;
+
 /*! Initializes the fft routine and tells it to use 
  *   nthreads threads
+ *
+ * The following environment variables are also read:
+ *
+ * SPIMAGE_FFTW_WISDOM: name of a wisdom file. The wisdom is imported
+ * from it now, if it exists, and exported back to it by sp_finalize_fft().
+ *
+ * SPIMAGE_FFTW_PLANNER: planner rigor, one of "estimate", "measure",
+ * "patient", "exhaustive" or "wisdom_only".
+ *
+ * SPIMAGE_FFT_BACKEND: FFT backend, one of "fftw3", "builtin" or "auto".
+ *
+ * Thread safety: all the FFT functions can be called concurrently from
+ * several threads, on different images. Creating plans is serialized
+ * internally, as the FFTW planner is not thread safe, but transforms
+ * whose plan is already cached run without taking any lock.
+ * sp_finalize_fft() must not be called while other threads are
+ * still doing transforms.
  */
 spimage_EXPORT int sp_init_fft(int nthreads);
 
+/*! Saves the wisdom to the wisdom file, if one was given, and destroys
+ *  all cached plans.
+ *
+ * Returns 0 on success.
+ */
+spimage_EXPORT int sp_finalize_fft();
+
+/*! Sets the planner rigor used for all the plans created from now on.
+ *
+ * The default is SpFFTMeasure.
+ * With SpFFTWisdomOnly, plans which are not in the wisdom are created
+ * with SpFFTEstimate instead of failing.
+ */
+spimage_EXPORT void sp_fft_set_planner_rigor(SpFFTPlannerRigor rigor);
+
+/*! Returns the planner rigor currently in use */
+spimage_EXPORT SpFFTPlannerRigor sp_fft_planner_rigor();
+
+/*! Sets the backend used by the following complex to complex transforms.
+ *
+ * This takes precedence over the SPIMAGE_FFT_BACKEND environment variable.
+ * Plans already cached for another backend are kept.
+ * Returns 0 on success and -1 if backend is not valid or not available.
+ */
+spimage_EXPORT int sp_fft_set_backend(SpFFTBackend backend);
+
+/*! Returns the backend currently in use */
+spimage_EXPORT SpFFTBackend sp_fft_backend();
+
+/*! Returns the name of backend, as used in SPIMAGE_FFT_BACKEND, or
+ *  NULL if backend is not available */
+spimage_EXPORT const char * sp_fft_backend_name(SpFFTBackend backend);
+
+/*! Imports the wisdom from filename and remembers it so that
+ *  sp_finalize_fft() exports the accumulated wisdom back to it.
+ *
+ * It's not an error for filename not to exist yet.
+ * Returns 0 on success and -1 if the file exists but can't be read.
+ * Without FFTW there is no wisdom and filename is ignored.
+ */
+spimage_EXPORT int sp_fft_set_wisdom_file(const char * filename);
+
+/*! Imports the wisdom from filename. Returns 0 on success and -1 on
+ *  error or without FFTW. */
+spimage_EXPORT int sp_fft_import_wisdom(const char * filename);
+
+/*! Exports the wisdom accumulated so far to filename. Returns 0 on
+ *  success and -1 on error or without FFTW. */
+spimage_EXPORT int sp_fft_export_wisdom(const char * filename);
+
+/*! Statistics of the FFT plan cache.
+ *
+ *  All the transforms of sp_image_fft(), sp_image_ifft(), their _fast
+ *  variants and sp_c3matrix_fft()/sp_c3matrix_ifft() go through a cache
+ *  of plans keyed by the dimensions, direction, in-place/out-of-place and
+ *  alignment of the transform.
+ */
+typedef struct{
+  /*! Number of transforms that found their plan in the cache */
+  long long hits;
+  /*! Number of transforms that had to create a new plan */
+  long long misses;
+  /*! Number of plans destroyed to make room for new ones */
+  long long evictions;
+  /*! Number of plans currently in the cache */
+  int entries;
+  /*! Maximum number of plans kept in the cache */
+  int capacity;
+}SpFFTPlanCacheStats;
+
+/*! Fills stats with the current statistics of the FFT plan cache */
+spimage_EXPORT void sp_fft_plan_cache_stats(SpFFTPlanCacheStats * stats);
+
+/*! Sets the maximum number of plans kept in the FFT plan cache.
+ *
+ * When the cache is full the least recently used plan that is not being
+ * executed is destroyed. A capacity of 0 disables caching.
+ * Plans in excess of the new capacity are destroyed immediately.
+ */
+spimage_EXPORT void sp_fft_plan_cache_set_capacity(int capacity);
+
+/*! Destroys all the plans in the FFT plan cache and resets its statistics */
+spimage_EXPORT void sp_fft_plan_cache_clear();
+
 #ifdef _USE_CUDA
   spimage_EXPORT Image * sp_image_cuda_ifft(const Image * img);
   spimage_EXPORT Image * sp_image_cuda_fft(const Image * img);
@@ -38,8 +38,33 @@ extern "C"
  * The filter function is given by:
  * \f$ f(x,y) = (2 \pi \times radius)^{-0.5} \times \exp{\frac{-(x^2+y^2)}{(2 \times radius^2)}} \f$
  *  The mask will not be blurred.
+ *
+ *  Small radii are blurred by convolving each axis with a short sampled
+ *  gaussian instead of with FFTs, when that is expected to be faster.
+ *  See sp_gaussian_blur_is_spatial() and sp_gaussian_blur_set_fft_cost().
  */
 spimage_EXPORT Image * sp_gaussian_blur(Image * in, real radius);
+/*! Returns 1 if sp_gaussian_blur() blurs in with convolutions in real
+ *  space and 0 if it uses FFTs.
+ */
+spimage_EXPORT int sp_gaussian_blur_is_spatial(const Image * in, real radius);
+/*! Sets when sp_gaussian_blur() convolves in real space.
+ *
+ * cost is the time of a complex FFT pair per pixel and per log2(N),
+ * for an image of N pixels, in units of the time of one tap of the
+ * convolutions on one real. Complex images are convolved when the taps
+ * of all the axes times 2, the reals per pixel, are fewer than
+ * cost*log2(N). Real images go through real FFTs, whose cost is taken
+ * to be half of that.
+ *
+ * By default the costs of both kinds of FFTs are measured on a small
+ * volume the first time they are needed. A negative cost goes back to
+ * that. A cost of 0 always uses FFTs.
+ */
+spimage_EXPORT void sp_gaussian_blur_set_fft_cost(real cost);
+/*! Returns the cost of complex FFTs, as set by
+ *  sp_gaussian_blur_set_fft_cost() or measured */
+spimage_EXPORT real sp_gaussian_blur_fft_cost();
 spimage_EXPORT Image * sp_gaussian_blur_old(Image * in, real radius);
 
 /*! Multiplies the image with a gaussian centered in the image center of a given radius 
@@ -249,6 +274,45 @@ spimage_EXPORT Image * sp_image_local_variance(Image * img, Image * window);
  * \return The normalized gaussian kernel
  */
   spimage_EXPORT Image * sp_gaussian_kernel(real radius, int nx, int ny, int nz);
+
+/*! Statistics of the filter cache.
+ *
+ *  sp_gaussian_blur() and sp_gaussian_filter() multiply the spectrum by
+ *  transfer functions which are kept in a cache keyed by the image
+ *  dimensions, the filter and its parameter, so repeating a filter costs
+ *  only the transforms and one multiply per pixel. The kernels of the
+ *  spatial path of sp_gaussian_blur() are kept there too.
+ */
+typedef struct{
+  /*! Number of filters that found their transfer function in the cache */
+  long long hits;
+  /*! Number of filters that had to build their transfer function */
+  long long misses;
+  /*! Number of transfer functions freed to make room for new ones */
+  long long evictions;
+  /*! Number of transfer functions currently in the cache */
+  int entries;
+  /*! Bytes used by the transfer functions in the cache */
+  size_t bytes;
+  /*! Maximum number of bytes used by the cache */
+  size_t capacity;
+}SpFilterCacheStats;
+
+/*! Fills stats with the current statistics of the filter cache */
+spimage_EXPORT void sp_filter_cache_stats(SpFilterCacheStats * stats);
+
+/*! Sets the maximum number of bytes used by the filter cache.
+ *
+ * When it's full the least recently used transfer functions that are not
+ * in use are freed. Transfer functions larger than the capacity are built
+ * every time they are needed, so a capacity of 0 disables caching. They
+ * are stored as one table per axis, so each takes a few KiB. The
+ * default is 1 MiB.
+ */
+spimage_EXPORT void sp_filter_cache_set_capacity(size_t bytes);
+
+/*! Frees all the transfer functions in the filter cache and resets its statistics */
+spimage_EXPORT void sp_filter_cache_clear();
 /*@}*/
 
 #ifdef __cplusplus
@@ -0,0 +1,81 @@
+#ifndef _MORPHOLOGY_H_
+#define _MORPHOLOGY_H_ 1
+
+#include "image.h"
+#include "linear_alg.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/** @defgroup Morphology Binary Morphology
+ *  Dilation, erosion, opening and closing of masks and pixel flags
+ *  @{
+ */
+
+/*! Shape of the structuring element */
+typedef enum{
+  /*! Pixels whose euclidean distance to the center is at most the radius */
+  SpMorphologyBall=0,
+  /*! Pixels no further than the radius from the center along every axis */
+  SpMorphologyBox,
+  /*! Pixels whose summed distance along the axes to the center is at
+   *  most the radius. Same as repeating a dilation with the 6 nearest
+   *  neighbours radius times. */
+  SpMorphologyDiamond
+}SpMorphologyElement;
+
+typedef enum{
+  SpMorphologyDilate=0,
+  SpMorphologyErode,
+  /*! Erosion followed by dilation */
+  SpMorphologyOpen,
+  /*! Dilation followed by erosion */
+  SpMorphologyClose
+}SpMorphologyOperation;
+
+/*! Returns the number of bytes of scratch memory sp_i3matrix_morphology()
+ *  needs for a nx*ny*nz matrix.
+ */
+spimage_EXPORT size_t sp_morphology_scratch_size(int nx, int ny, int nz);
+
+/*! Applies a morphological operation to the pixels of m which have any
+ *  of bits set, in place.
+ *
+ *  Pixels in the result get all of bits set and the others get them
+ *  cleared. The other bits are left alone. Pixels outside of m count
+ *  as unset for a dilation and as set for an erosion, so neither grows
+ *  anything in from the edges.
+ *
+ *  The operations are computed from distance transforms, so their cost
+ *  is linear in the size of m and does not depend on the radius.
+ *
+ * \param m matrix to change
+ * \param bits bits which mark the pixels of the set
+ * \param op operation to apply
+ * \param element shape of the structuring element
+ * \param radius size of the structuring element, 0 leaves m unchanged
+ * \param scratch sp_morphology_scratch_size() bytes of memory, or NULL
+ *  to allocate it internally
+ * \return 0 on success or a negative value on error
+ */
+spimage_EXPORT int sp_i3matrix_morphology(sp_i3matrix * m, int bits, SpMorphologyOperation op,
+					  SpMorphologyElement element, real radius, void * scratch);
+
+/*! Applies a morphological operation to the mask of in, in place.
+ *
+ *  Pixels with a non zero mask are part of the set. Pixels in the result
+ *  get a mask of 1 and the others a mask of 0.
+ *
+ * \return 0 on success or a negative value on error
+ */
+spimage_EXPORT int sp_image_mask_morphology(Image * in, SpMorphologyOperation op,
+					    SpMorphologyElement element, real radius);
+/*@}*/
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif /* __cplusplus */
+
+#endif
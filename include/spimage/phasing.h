@@ -13,11 +13,13 @@ extern "C"
 
 typedef enum{SpModelRandomPhases=1,SpModelZeroPhases=2,SpModelRandomValues=4,SpModelMaskedOutZeroed=256}SpModelInitialization;
 typedef enum{SpSupportFromPatterson=1}SpSupportInitialization;
-typedef enum{SpHIO=1,SpRAAR,SpDiffMap,SpER}SpPhasingAlgorithmType;
+typedef enum{SpHIO=1,SpRAAR,SpDiffMap,SpER,SpRRR,SpAcceleratedER}SpPhasingAlgorithmType;
 typedef enum{SpNoConstraints=0,SpRealObject=1,SpPositiveRealObject=2,SpPositiveComplexObject=4,SpPositivityFlipping=8,SpCentrosymmetricObject=16,SpAmplitudeErrorMargin=32}SpPhasingConstraints;
-typedef enum{SpEngineAutomatic=0,SpEngineCPU=1,SpEngineCUDA=2}SpPhasingEngine;
+typedef enum{SpEngineAutomatic=0,SpEngineCPU=1,SpEngineCUDA=2,SpEngineCPUThreaded=3}SpPhasingEngine;
 typedef enum{SpPixelInsideSupport=1,SpPixelMeasuredAmplitude=2}SpPhasingPixelFlags;
 typedef enum{SpRecoverPhases=0,SpRecoverAmplitudes=1}SpPhasingObjective;
+typedef enum{SpPlateauNone=0,SpPlateauFourierError,SpPlateauModelChange}SpPlateauMetric;
+typedef enum{SpStopMaxIterations=1,SpStopTimeBudget,SpStopPlateau}SpPhaserStopReason;
 /*! This structure is private */
 typedef struct{
   sp_smap * beta;
@@ -30,6 +32,9 @@ typedef struct{
 
 
 typedef SpPhasingHIOParameters SpPhasingRAARParameters;
+typedef SpPhasingHIOParameters SpPhasingRRRParameters;
+/* beta holds the momentum */
+typedef SpPhasingHIOParameters SpPhasingAcceleratedERParameters;
 
 /*! This structure is private */
 typedef struct{
@@ -45,6 +50,82 @@ typedef struct{
   void * params;
 }SpPhasingAlgorithm;
 
+/*! Scratch memory of a phaser, reused by every iteration.
+ *
+ * This structure is private
+ */
+typedef struct{
+  char * data;
+  size_t size;
+  size_t used;
+  /* upper bound of the memory requested since the last reset */
+  size_t requested;
+  /* largest value of requested so far */
+  size_t peak;
+  /* requests which did not fit, freed on the next reset */
+  void ** overflow;
+  int noverflow;
+  int overflow_allocated;
+  /* number of heap allocations done by the workspace */
+  long long heap_allocations;
+}SpPhaserWorkspace;
+
+/*! Maximal runs of consecutive pixels with a given flag.
+ *
+ * This structure is private
+ */
+typedef struct{
+  /* span k covers the pixels [bounds[2*k],bounds[2*k+1]) */
+  int * bounds;
+  int nspans;
+  int allocated;
+}SpPixelSpans;
+
+/*! Convergence metrics of one iteration, see sp_phaser_metrics() */
+typedef struct{
+  /*! Value of the iteration counter after the iteration */
+  int iteration;
+  /*! Real space error of the model before the projection, as given by
+    sp_phaser_ereal() right after the iteration */
+  real ereal;
+  /*! Fourier error of the model the iteration started from, as given by
+    sp_phaser_efourier() right before the iteration */
+  real efourier;
+  /*! Number of pixels inside the support */
+  int support_size;
+  /*! Norm of the change of the model relative to the norm of the new model */
+  real model_change;
+}SpPhaserMetrics;
+
+/*! When sp_phaser_iterate_until() stops. Limits set to 0 are not used. */
+typedef struct{
+  /*! Maximum number of iterations */
+  int max_iterations;
+  /*! Maximum wall clock time, in seconds */
+  double max_seconds;
+  /*! Metric watched for a plateau */
+  SpPlateauMetric plateau_metric;
+  /*! The metric is on a plateau when it decreased by at most
+   * plateau_tolerance times its value over the last plateau_window
+   * recorded iterations */
+  int plateau_window;
+  real plateau_tolerance;
+  /*! Number of iterations run between checks, 0 for 10 */
+  int check_period;
+}SpPhaserStopPolicy;
+
+/*! One level of sp_phaser_iterate_multires() */
+typedef struct{
+  /*! Size of the level relative to the phaser, in (0,1] */
+  real scale;
+  int iterations;
+  /*! Phasing algorithm of the level, NULL for the one of the phaser */
+  SpPhasingAlgorithm * algorithm;
+  /*! Support update of the level, NULL to keep the support fixed. Its
+   * radii are in pixels of the level. */
+  SpSupportArray * sup_algorithm;
+}SpMultiresLevel;
+
 /*! This structure is private */
 typedef struct{
   /* amplitudes are used for phase recovery */
@@ -56,6 +137,12 @@ typedef struct{
   sp_c3matrix * phased_amplitudes;
 
   sp_i3matrix * pixel_flags;
+  /* the pixels of pixel_flags inside the support and with measured
+     amplitudes, used by the loops of the CPU engines. They are rebuilt
+     when spans_valid is 0, which is set whenever pixel_flags changes. */
+  SpPixelSpans support_spans;
+  SpPixelSpans measured_spans;
+  int spans_valid;
   SpPhasingObjective phasing_objective;
   SpPhasingAlgorithm * algorithm;
   //SpSupportAlgorithm * sup_algorithm;
@@ -80,14 +167,56 @@ typedef struct{
   Image * amplitudes_image;
   Image * fmodel;
   int fmodel_iteration;
+  /* sp_phaser_efourier() of efourier_iteration */
+  real efourier;
+  int efourier_iteration;
   Image * model_before_projection;
   int model_before_projection_iteration;
+  /* Views of the model and of the Fourier model with masks of their own,
+     returned by sp_phaser_model_with_support() and
+     sp_phaser_fmodel_with_mask() in the low memory mode */
+  Image * model_with_support;
+  Image * fmodel_with_mask;
 
   SpPhasingEngine engine;
+  /* number of FFTW threads used by the CPU engine, 0 for the sp_init_fft() default */
+  int fft_nthreads;
+  /* number of threads of SpEngineCPUThreaded, 0 for one per processor */
+  int nthreads;
+  struct SpThreadPool * thread_pool;
+  /* ph->iteration after the last SpAcceleratedER iteration, when g1
+     still holds the previous model which the momentum needs */
+  int momentum_iteration;
+  /* pixel kernels specialized for the constraints and the objective,
+     picked by sp_phaser_init() and when either changes */
+  struct PhaserKernels * kernels;
 
   Image * g0;
   Image * g1;
   Image * gp;
+  /* In the real object mode r0, r1 and rp replace g0, g1 and gp and
+     the Fourier space is the half spectrum of x size nx/2+1 */
+  int real_object;
+  real * r0;
+  real * r1;
+  real * rp;
+  int half_size;
+  /* set by sp_phaser_set_low_memory() */
+  int low_memory;
+  /* amplitudes and flags in the half spectrum, built by the first
+     iteration after the amplitudes change */
+  sp_3matrix * half_amplitudes;
+  sp_3matrix * half_amplitudes_min;
+  sp_3matrix * half_amplitudes_max;
+  int * half_flags;
+  SpPixelSpans half_measured_spans;
+  /* scratch buffers of the iterations and the support updates */
+  SpPhaserWorkspace workspace;
+  /* ring buffer with the metrics of the last iterations */
+  SpPhaserMetrics * metrics;
+  int metrics_capacity;
+  /* number of iterations recorded so far */
+  int metrics_count;
 
 #ifdef _USE_CUDA
   cufftHandle cufft_plan;
@@ -104,11 +233,43 @@ typedef struct{
 #endif
 }SpPhaser;
 
+/*! A set of phasers which reconstruct the same pattern from different
+ * starting models.
+ *
+ * The amplitudes, their margins and, when the support is not updated,
+ * the pixel flags are stored only once and shared by all phasers. The
+ * iterates of all models are kept in contiguous stacks so that they can
+ * be transformed with a single batched FFT.
+ *
+ * This structure is private
+ */
+typedef struct{
+  int nmodels;
+  SpPhaser ** phasers;
+  /* nmodels*image_size arrays backing g0, g1 and gp of the phasers */
+  Complex * g0;
+  Complex * g1;
+  Complex * gp;
+}SpPhaserBatch;
+
 
   spimage_EXPORT SpPhasingAlgorithm * sp_phasing_hio_alloc(sp_smap * beta, SpPhasingConstraints constraints);
   spimage_EXPORT SpPhasingAlgorithm * sp_phasing_raar_alloc(sp_smap * beta, SpPhasingConstraints constraints);
   spimage_EXPORT SpPhasingAlgorithm * sp_phasing_diff_map_alloc(sp_smap * beta,real gamma1,real gamma2, SpPhasingConstraints constraints);
   spimage_EXPORT SpPhasingAlgorithm * sp_phasing_er_alloc(SpPhasingConstraints constraints);
+  /*! Relax-reflect-reflect, x' = x + beta*(Ps(2*Pm(x)-x)-Pm(x)).
+   *
+   * Like HIO it needs a single pair of FFTs per iteration, but it
+   * doesn't stagnate as easily. Only the CPU engines support it.
+   */
+  spimage_EXPORT SpPhasingAlgorithm * sp_phasing_rrr_alloc(sp_smap * beta, SpPhasingConstraints constraints);
+  /*! Error reduction with Nesterov momentum, x' = Ps(Pm(y)) with
+   * y = x + momentum*(x-x_prev).
+   *
+   * The momentum restarts from 0 after support updates and whenever
+   * another algorithm ran in between. Only the CPU engines support it.
+   */
+  spimage_EXPORT SpPhasingAlgorithm * sp_phasing_accelerated_er_alloc(sp_smap * momentum, SpPhasingConstraints constraints);
 
   spimage_EXPORT SpPhaser * sp_phaser_alloc();
   spimage_EXPORT void sp_phaser_free(SpPhaser * ph);
@@ -135,7 +296,147 @@ typedef struct{
   spimage_EXPORT int sp_phaser_init_model(SpPhaser * ph,const Image * model, int flags);
   spimage_EXPORT int sp_phaser_init_support(SpPhaser * ph,const Image * support, int flags, real value);
   spimage_EXPORT int sp_phaser_iterate(SpPhaser * ph, int iterations);
+  /*! Iterates until one of the limits of policy is reached.
+   *
+   * The phaser runs uninterrupted between checks, which happen every
+   * check_period iterations, and sooner when the time budget is about
+   * to run out. The plateau detection reads the metrics recorded by the
+   * iterations, enlarging the buffer set by
+   * sp_phaser_set_metrics_capacity() if needed, which keeps the records
+   * already there. As the CUDA engine does not record metrics, policies
+   * with a plateau_metric are an error there.
+   *
+   * Returns the SpPhaserStopReason, or a negative value on error.
+   */
+  spimage_EXPORT int sp_phaser_iterate_until(SpPhaser * ph, const SpPhaserStopPolicy * policy);
+  /*! Iterates from coarse to fine resolution.
+   *
+   * The levels with a scale below 1 run on a temporary phaser whose
+   * amplitudes are the central scale*size part of the ones of ph, so
+   * their iterations are much cheaper. Each level starts from the model
+   * and support of the previous one, or of ph for the first, resampled
+   * to its size: the model by cropping or zero padding its transform and
+   * the support by nearest neighbour. When the levels are done ph gets
+   * the last model and support, and the levels with a scale of 1 iterate
+   * ph itself. The scales must not decrease. Only ph->iteration counts
+   * the iterations at full size.
+   *
+   * ph must be initialized with amplitudes, model and support and use
+   * the SpRecoverPhases objective. Returns 0 on success, -1 for invalid
+   * levels and the error of sp_phaser_iterate() if a level fails.
+   */
+  spimage_EXPORT int sp_phaser_iterate_multires(SpPhaser * ph, const SpMultiresLevel * levels, int nlevels);
   spimage_EXPORT void sp_phaser_set_objective(SpPhaser * ph, SpPhasingObjective obj);
+  /*! Sets the number of FFTW threads used by the phaser.
+   *
+   * 0, the default, uses the number given to sp_init_fft(). Several
+   * phasers can be iterated concurrently from different threads, each
+   * with its own number of FFT threads.
+   */
+  spimage_EXPORT void sp_phaser_set_fft_threads(SpPhaser * ph, int nthreads);
+  /*! Sets the number of threads used by the SpEngineCPUThreaded engine
+   * for the per pixel loops and the error reductions.
+   *
+   * 0, the default, uses one thread per processor. Each loop is split
+   * in nthreads equal parts, so results only depend on nthreads and not
+   * on the scheduling of the threads.
+   */
+  spimage_EXPORT void sp_phaser_set_threads(SpPhaser * ph, int nthreads);
+  /*! Turns the real object mode of the CPU engines on or off.
+   *
+   * In this mode the model is stored as a real array and the transforms
+   * are real to complex ones on the half spectrum, which roughly halves
+   * the memory and the FFT time of the iterations. The measured amplitudes
+   * are made Friedel symmetric by averaging each pixel with its mirror
+   * when both are measured. The model is also kept real outside the
+   * support, so the results differ slightly from the ones of the complex
+   * iterations. Only the ER, HIO and RAAR algorithms with SpRealObject or
+   * SpPositiveRealObject constraints and the SpRecoverPhases objective
+   * can be iterated in this mode, and it can't be used with the phasers
+   * of a SpPhaserBatch.
+   *
+   * Must be called after sp_phaser_init() and before
+   * sp_phaser_init_model(). Returns 0 on success and -1 if the engine
+   * does not support it or the model is already initialized.
+   */
+  spimage_EXPORT int sp_phaser_set_real_object(SpPhaser * ph, int enable);
+  /*! Returns the number of heap allocations done so far by the
+   * iterations and the support updates of the phaser.
+   *
+   * Their scratch buffers come from a workspace owned by the phaser,
+   * sized by sp_phaser_init_model() and grown to the largest amount
+   * ever needed, so once every step has run at least once the count
+   * stops changing. Meant for debugging.
+   */
+  spimage_EXPORT long long sp_phaser_heap_allocations(const SpPhaser * ph);
+  /*! Returns the number of bytes of host memory held by the phaser.
+   *
+   * This covers the amplitudes, the flags, the iterates, the images
+   * returned so far by the getters and the workspace. Data shared by the
+   * phasers of a SpPhaserBatch is counted once for every phaser and the
+   * memory of the graphics card is not counted.
+   */
+  spimage_EXPORT size_t sp_phaser_memory_usage(const SpPhaser * ph);
+  /*! Turns the low memory mode of the complex CPU engines on or off.
+   *
+   * In this mode sp_phaser_model(), sp_phaser_old_model() and
+   * sp_phaser_model_before_projection() return views of the iterates
+   * instead of copies, so they are only valid until the next iteration
+   * and writing to them changes the iterates. All the images of the
+   * phaser except sp_phaser_amplitudes(), sp_phaser_model_with_support()
+   * and sp_phaser_fmodel_with_mask() share one mask, the model change is only allocated when asked for and the workspace only grows
+   * to what the algorithms use, which saves both the memory and the
+   * time of the copies done by the getters. The real object mode
+   * already keeps no copies and is not affected. The phasers of a
+   * SpPhaserBatch can't use this mode.
+   *
+   * Must be called after sp_phaser_init() and before
+   * sp_phaser_init_model(). Returns 0 on success and -1 if the engine
+   * does not support it or the model is already initialized.
+   */
+  spimage_EXPORT int sp_phaser_set_low_memory(SpPhaser * ph, int enable);
+  /*! Makes the phaser record the metrics of its last capacity iterations.
+   *
+   * The CPU engines accumulate them in the same sweeps that update the
+   * model, so recording them needs no extra pass over the data. Resizing
+   * keeps the most recent records that fit and a capacity of 0, the
+   * default, turns the recording off and drops them.
+   */
+  spimage_EXPORT void sp_phaser_set_metrics_capacity(SpPhaser * ph, int capacity);
+  /*! Copies the metrics of up to the last n recorded iterations to
+   * metrics, oldest first, and returns how many were copied.
+   */
+  spimage_EXPORT int sp_phaser_metrics(const SpPhaser * ph, SpPhaserMetrics * metrics, int n);
+
+  /*! Allocates a batch of nmodels phasers.
+   *
+   * A batch is set up like a single phaser, with sp_phaser_batch_init(),
+   * sp_phaser_batch_set_amplitudes(), sp_phaser_batch_init_model() and
+   * sp_phaser_batch_init_support(), and then advanced with
+   * sp_phaser_batch_iterate(). Each step of ER, HIO and RAAR transforms
+   * all models with one batched FFT and projects them in one sweep, giving
+   * the same models as nmodels separate calls to sp_phaser_iterate().
+   * The other algorithms, the CUDA engine and batches with a phaser set to
+   * sp_phaser_set_real_object() iterate the phasers one after the other.
+   *
+   * The individual phasers, returned by sp_phaser_batch_phaser(), can be
+   * inspected with the usual functions but must only be iterated and
+   * changed through the batch. Metrics are accumulated for all phasers
+   * when the first one records them.
+   */
+  spimage_EXPORT SpPhaserBatch * sp_phaser_batch_alloc(int nmodels);
+  spimage_EXPORT void sp_phaser_batch_free(SpPhaserBatch * b);
+  spimage_EXPORT SpPhaser * sp_phaser_batch_phaser(SpPhaserBatch * b, int i);
+  spimage_EXPORT int sp_phaser_batch_init(SpPhaserBatch * b, SpPhasingAlgorithm * alg, SpSupportArray * sup_alg, SpPhasingEngine engine);
+  spimage_EXPORT void sp_phaser_batch_set_amplitudes(SpPhaserBatch * b, const Image * amplitudes);
+  spimage_EXPORT void sp_phaser_batch_set_amplitudes_margins(SpPhaserBatch * b, const Image * amplitudes_min, const Image * amplitudes_max);
+  /*! Initializes every model of the batch as sp_phaser_init_model().
+   *
+   * With a random starting model each phaser gets a different one.
+   */
+  spimage_EXPORT int sp_phaser_batch_init_model(SpPhaserBatch * b, const Image * model, int flags);
+  spimage_EXPORT int sp_phaser_batch_init_support(SpPhaserBatch * b, const Image * support, int flags, real value);
+  spimage_EXPORT int sp_phaser_batch_iterate(SpPhaserBatch * b, int iterations);
 #ifdef _USE_CUDA
   int phaser_iterate_hio_cuda(SpPhaser * ph,int iterations);  
   int phaser_iterate_raar_cuda(SpPhaser * ph,int iterations);  
@@ -156,6 +457,8 @@ typedef struct{
   int sp_support_threshold_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * ph);
   int sp_support_template_update_support(SpSupportAlgorithm *alg, SpPhaser * ph);
   int sp_support_template_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * ph);
+  /* absolute threshold of a template support update at the current iteration */
+  real sp_support_template_threshold(SpSupportAlgorithm *alg, SpPhaser * ph);
   int sp_support_static_update_support(SpSupportAlgorithm *alg, SpPhaser * ph);
   int sp_support_close_update_support(SpSupportAlgorithm *alg, SpPhaser * ph);
   int sp_support_close_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * ph);
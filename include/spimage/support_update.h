@@ -28,7 +28,6 @@ typedef struct{
 typedef struct{
   //real blur_radius;
   Image *blured;
-  Image *sorted;
   sp_smap *area;
   real original_area;
 }SpSupportTemplateParameters;
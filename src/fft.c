@@ -1,13 +1,21 @@
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
 /* #include <sys/time.h>*/
 #include <time.h>
 #include <limits.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #ifdef _USE_DMALLOC
 #include <dmalloc.h>
 #endif
 
 #include "spimage.h"
-
+#include "fft_private.h"
 
 
 real * sp_image_fft_shift(real * fftout, Image * a){
@@ -31,29 +39,1278 @@ real * sp_image_fft_shift(real * fftout, Image * a){
   return img_d;
 }
 
+/* Number of threads used by new FFTW plans */
+static int fft_nthreads = 1;
+
+/* Allocates an image of size nx,ny,nz with the same detector as img */
+static Image * fft_image_alloc_resized(const Image * img, int nx, int ny, int nz){
+  Image * res = sp_image_alloc(nx,ny,nz);
+  memcpy(res->detector,img->detector,sizeof(Detector));
+  res->scaled = img->scaled;
+  res->num_dimensions = img->num_dimensions;
+  return res;
+}
+
+#ifdef _SP_NO_FFTW
+/* Without FFTW everything goes through the builtin backend, which uses
+   the same sign convention */
+#define FFTW_FORWARD (-1)
+#define FFTW_BACKWARD (+1)
+#define fft_malloc(size) sp_malloc(size)
+#define fft_free(p) sp_free(p)
+#define fft_is_aligned(p) 1
+#else
+#define fft_malloc(size) fftwr_malloc(size)
+#define fft_free(p) fftwr_free(p)
+#define fft_is_aligned(p) (fftwr_alignment_of((real *)(p)) == 0)
+#endif
+
+#ifdef FFTW3
+
+/* FFTW plan cache.
+
+   Creating a plan with FFTW_MEASURE is often more expensive than the
+   transform itself, so plans are kept in a small table and reused through
+   fftwr_execute_dft(). A plan can only be reused on arrays with the same
+   in-place/out-of-place layout and alignment as the ones it was created
+   for, so these are part of the key. Plans are created on scratch arrays
+   so that the planner never overwrites the user data.
+
+   Thread safety: the FFTW planner is not re-entrant, so everything which
+   creates or destroys plans, or touches the planner configuration and the
+   wisdom, holds the planner lock. Executing a plan on new arrays is thread
+   safe in FFTW, so cached plans are looked up with only a shared lock on
+   the table and executed without any lock. The table is only locked
+   exclusively, with the planner lock held, to insert or evict plans, and
+   entries being executed are never evicted.
+
+   Complex to complex transforms can also use the builtin backend, chosen
+   with sp_fft_set_backend() or SPIMAGE_FFT_BACKEND. With SpFFTBackendAuto
+   every backend is planned and timed once for each new key and the
+   fastest one is kept in the cache. Everything else always uses FFTW.
+
+   When built without FFTW (_SP_NO_FFTW) the builtin backend does all the
+   transforms, the planner rigor and the wisdom are ignored and all plans
+   are single threaded. The locking is the same. */
+
+/* A plan together with the backend which made it */
+typedef struct{
+  const FFTBackend * backend;
+  void * plan;
+}FFTPlan;
+
+typedef struct{
+  PlanKey key;
+  FFTPlan plan;
+  /* number of threads currently executing the plan */
+  int in_use;
+  /* value of the cache clock when the plan was last used */
+  long long last_used;
+}PlanCacheEntry;
+
+/* Atomic operations on the counters that are updated under the shared lock */
+#if defined(_WIN32)
+#define fft_atomic_add_int(p,v) InterlockedExchangeAdd((volatile LONG *)(p),(v))
+#define fft_atomic_set_int(p,v) InterlockedExchange((volatile LONG *)(p),(v))
+#define fft_atomic_add_ll(p,v) InterlockedExchangeAdd64((volatile LONG64 *)(p),(v))
+#define fft_atomic_set_ll(p,v) InterlockedExchange64((volatile LONG64 *)(p),(v))
+#else
+#define fft_atomic_add_int(p,v) __sync_fetch_and_add((p),(v))
+#define fft_atomic_set_int(p,v) __sync_lock_test_and_set((p),(v))
+#define fft_atomic_add_ll(p,v) __sync_fetch_and_add((p),(v))
+#define fft_atomic_set_ll(p,v) __sync_lock_test_and_set((p),(v))
+#endif
+#define fft_atomic_get_int(p) fft_atomic_add_int(p,0)
+#define fft_atomic_get_ll(p) fft_atomic_add_ll(p,0)
+
+static PlanCacheEntry * plan_cache = NULL;
+static int plan_cache_entries = 0;
+static int plan_cache_allocated = 0;
+static int plan_cache_capacity = 16;
+static long long plan_cache_clock = 0;
+static long long plan_cache_hits = 0;
+static long long plan_cache_misses = 0;
+static long long plan_cache_evictions = 0;
+
+#if defined(_WIN32)
+static SRWLOCK planner_mutex = SRWLOCK_INIT;
+static SRWLOCK plan_cache_rwlock = SRWLOCK_INIT;
+static void planner_lock(){
+  AcquireSRWLockExclusive(&planner_mutex);
+}
+static void planner_unlock(){
+  ReleaseSRWLockExclusive(&planner_mutex);
+}
+static void plan_cache_read_lock(){
+  AcquireSRWLockShared(&plan_cache_rwlock);
+}
+static void plan_cache_read_unlock(){
+  ReleaseSRWLockShared(&plan_cache_rwlock);
+}
+static void plan_cache_write_lock(){
+  AcquireSRWLockExclusive(&plan_cache_rwlock);
+}
+static void plan_cache_write_unlock(){
+  ReleaseSRWLockExclusive(&plan_cache_rwlock);
+}
+#else
+static pthread_mutex_t planner_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t plan_cache_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static void planner_lock(){
+  pthread_mutex_lock(&planner_mutex);
+}
+static void planner_unlock(){
+  pthread_mutex_unlock(&planner_mutex);
+}
+static void plan_cache_read_lock(){
+  pthread_rwlock_rdlock(&plan_cache_rwlock);
+}
+static void plan_cache_read_unlock(){
+  pthread_rwlock_unlock(&plan_cache_rwlock);
+}
+static void plan_cache_write_lock(){
+  pthread_rwlock_wrlock(&plan_cache_rwlock);
+}
+static void plan_cache_write_unlock(){
+  pthread_rwlock_unlock(&plan_cache_rwlock);
+}
+#endif
+
+/* Planner configuration. The environment is only read once, either
+   by sp_init_fft() or when the first plan is created. Everything here
+   is protected by the planner lock, but planner_rigor and fft_env_read
+   are also read atomically when looking up plans. */
+
+static int planner_rigor = SpFFTMeasure;
+#ifdef _SP_NO_FFTW
+static int fft_backend = SpFFTBackendBuiltin;
+#else
+static int fft_backend = SpFFTBackendFFTW3;
+#endif
+static char * wisdom_file = NULL;
+static int fft_env_read = 0;
+/* Whether fftwr_init_threads() was called successfully */
+static int fft_threads_initialized = 0;
+
+static int fft_import_wisdom(const char * filename){
+#ifdef _SP_NO_FFTW
+  fprintf(stderr,"Error: Built without FFTW, can't import wisdom from %s\n",filename);
+  return -1;
+#else
+  if(!fftwr_import_wisdom_from_filename(filename)){
+    fprintf(stderr,"Error: Could not import FFTW wisdom from %s\n",filename);
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+static int fft_export_wisdom(const char * filename){
+#ifdef _SP_NO_FFTW
+  fprintf(stderr,"Error: Built without FFTW, can't export wisdom to %s\n",filename);
+  return -1;
+#else
+  if(!fftwr_export_wisdom_to_filename(filename)){
+    fprintf(stderr,"Error: Could not export FFTW wisdom to %s\n",filename);
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+static int fft_set_wisdom_file(const char * filename){
+  FILE * fp;
+  if(wisdom_file){
+    sp_free(wisdom_file);
+    wisdom_file = NULL;
+  }
+  if(!filename || !filename[0]){
+    return 0;
+  }
+#ifdef _SP_NO_FFTW
+  fprintf(stderr,"Warning: Built without FFTW, ignoring the wisdom file %s\n",filename);
+  return 0;
+#endif
+  wisdom_file = sp_malloc(strlen(filename)+1);
+  strcpy(wisdom_file,filename);
+  /* The file is created by sp_finalize_fft() if it doesn't exist yet */
+  fp = fopen(filename,"r");
+  if(!fp){
+    return 0;
+  }
+  fclose(fp);
+  return fft_import_wisdom(filename);
+}
+
+static void fft_read_env(){
+  const char * env;
+  int rigor = planner_rigor;
+  if(fft_env_read){
+    return;
+  }
+  env = getenv("SPIMAGE_FFTW_PLANNER");
+  if(env){
+    if(strcmp(env,"estimate") == 0){
+      rigor = SpFFTEstimate;
+    }else if(strcmp(env,"measure") == 0){
+      rigor = SpFFTMeasure;
+    }else if(strcmp(env,"patient") == 0){
+      rigor = SpFFTPatient;
+    }else if(strcmp(env,"exhaustive") == 0){
+      rigor = SpFFTExhaustive;
+    }else if(strcmp(env,"wisdom_only") == 0){
+      rigor = SpFFTWisdomOnly;
+    }else{
+      fprintf(stderr,"Warning: Unknown SPIMAGE_FFTW_PLANNER value \"%s\"\n",env);
+    }
+  }
+  fft_atomic_set_int(&planner_rigor,rigor);
+  env = getenv("SPIMAGE_FFT_BACKEND");
+  if(env){
+    if(strcmp(env,"fftw3") == 0){
+#ifdef _SP_NO_FFTW
+      fprintf(stderr,"Warning: Built without FFTW, ignoring SPIMAGE_FFT_BACKEND\n");
+#else
+      fft_atomic_set_int(&fft_backend,SpFFTBackendFFTW3);
+#endif
+    }else if(strcmp(env,"builtin") == 0){
+      fft_atomic_set_int(&fft_backend,SpFFTBackendBuiltin);
+    }else if(strcmp(env,"auto") == 0){
+      fft_atomic_set_int(&fft_backend,SpFFTBackendAuto);
+    }else{
+      fprintf(stderr,"Warning: Unknown SPIMAGE_FFT_BACKEND value \"%s\"\n",env);
+    }
+  }
+  env = getenv("SPIMAGE_FFTW_WISDOM");
+  if(env){
+    fft_set_wisdom_file(env);
+  }
+  fft_atomic_set_int(&fft_env_read,1);
+}
+
+/* Can be called without holding the planner lock */
+static void fft_ensure_env_read(){
+  if(!fft_atomic_get_int(&fft_env_read)){
+    planner_lock();
+    fft_read_env();
+    planner_unlock();
+  }
+}
+
+/* Can be called without holding the planner lock */
+static unsigned fft_planner_flags(){
+  fft_ensure_env_read();
+#ifdef _SP_NO_FFTW
+  return 0;
+#else
+  switch(fft_atomic_get_int(&planner_rigor)){
+  case SpFFTEstimate:
+    return FFTW_ESTIMATE;
+  case SpFFTPatient:
+    return FFTW_PATIENT;
+  case SpFFTExhaustive:
+    return FFTW_EXHAUSTIVE;
+  case SpFFTWisdomOnly:
+    return FFTW_WISDOM_ONLY;
+  default:
+    return FFTW_MEASURE;
+  }
+#endif
+}
+
+/* Makes the next plans use nthreads threads. Needs the planner lock. */
+static void fft_plan_with_nthreads(int nthreads){
+#ifndef _SP_NO_FFTW
+  if(nthreads > 1 && !fft_threads_initialized){
+    if(!fftwr_init_threads()){
+      fprintf(stderr,"Error initializing parallel fftw!\n");
+      return;
+    }
+    fft_threads_initialized = 1;
+  }
+  if(fft_threads_initialized){
+    fftwr_plan_with_nthreads(nthreads > 1 ? nthreads : 1);
+  }
+#endif
+}
+
+#ifndef _SP_NO_FFTW
+
+static fftwr_plan plan_cache_plan_dft(const PlanKey * key, void * in, void * out, unsigned flags){
+  /* It is very important to have z,y,x as the plan order as FFTW is row-major! */
+  if(key->type == PlanR2C){
+    return fftwr_plan_dft_r2c_3d(key->nz,key->ny,key->nx,(real *)in,(fftwr_complex *)out,flags);
+  }else if(key->type == PlanC2R){
+    return fftwr_plan_dft_c2r_3d(key->nz,key->ny,key->nx,(fftwr_complex *)in,(real *)out,flags);
+  }else if(key->howmany > 1){
+    int n[3] = {key->nz,key->ny,key->nx};
+    int dist = key->nx*key->ny*key->nz;
+    return fftwr_plan_many_dft(3,n,key->howmany,(fftwr_complex *)in,NULL,1,dist,
+			       (fftwr_complex *)out,NULL,1,dist,key->sign,flags);
+  }
+  return fftwr_plan_dft_3d(key->nz,key->ny,key->nx,(fftwr_complex *)in,(fftwr_complex *)out,key->sign,flags);
+}
+
+static void * plan_cache_create_plan(const PlanKey * key){
+  /* Plan on scratch arrays as FFTW_MEASURE overwrites them */
+  size_t size = (size_t)key->nx*key->ny*key->nz*(key->howmany > 1 ? key->howmany : 1);
+  size_t half_size = (size_t)(key->nx/2+1)*key->ny*key->nz;
+  size_t in_size = sizeof(fftwr_complex)*size;
+  size_t out_size = in_size;
+  if(key->type == PlanR2C){
+    in_size = sizeof(real)*size;
+    out_size = sizeof(fftwr_complex)*half_size;
+  }else if(key->type == PlanC2R){
+    in_size = sizeof(fftwr_complex)*half_size;
+    out_size = sizeof(real)*size;
+  }
+  void * in = fftwr_malloc(in_size);
+  void * out = in;
+  unsigned flags = key->flags;
+  if(!key->in_place){
+    out = fftwr_malloc(out_size);
+  }
+  if(!key->aligned){
+    flags |= FFTW_UNALIGNED;
+  }
+  fft_plan_with_nthreads(key->nthreads);
+  fftwr_plan plan = plan_cache_plan_dft(key,in,out,flags);
+  if(out != in){
+    fftwr_free(out);
+  }
+  fftwr_free(in);
+  return plan;
+}
+
+static void fftw3_backend_execute(void * plan, const Complex * in, Complex * out){
+  /* Rely on binary compatibility of the Complex type */
+  fftwr_execute_dft((fftwr_plan)plan,(fftwr_complex *)in,(fftwr_complex *)out);
+}
+
+static void fftw3_backend_execute_r2c(void * plan, const real * in, Complex * out){
+  /* Out of place r2c transforms leave their input alone */
+  fftwr_execute_dft_r2c((fftwr_plan)plan,(real *)in,(fftwr_complex *)out);
+}
+
+static void fftw3_backend_execute_c2r(void * plan, Complex * in, real * out){
+  fftwr_execute_dft_c2r((fftwr_plan)plan,(fftwr_complex *)in,out);
+}
+
+static void fftw3_backend_destroy(void * plan){
+  fftwr_destroy_plan((fftwr_plan)plan);
+}
+
+static const FFTBackend fftw3_backend = {"fftw3",plan_cache_create_plan,fftw3_backend_execute,
+					 fftw3_backend_execute_r2c,fftw3_backend_execute_c2r,
+					 fftw3_backend_destroy};
+#endif
+
+/* Indexed by SpFFTBackend, NULL for the ones not built in */
+#ifdef _SP_NO_FFTW
+static const FFTBackend * fft_backends[] = {NULL,&fft_builtin_backend};
+#else
+static const FFTBackend * fft_backends[] = {&fftw3_backend,&fft_builtin_backend};
+#endif
+#define FFT_NBACKENDS 2
+
+/* Number of timed transforms per backend in fft_benchmark_backends(),
+   after an untimed one which warms up the caches and the twiddles */
+#define FFT_BENCHMARK_RUNS 3
+
+/* Fills the n elements of data with a fixed pattern of non zero values,
+   so that the timings don't depend on special cases like zeros */
+static void fft_benchmark_fill(Complex * data, size_t n){
+  for(size_t i = 0;i<n;i++){
+    data[i] = sp_cinit((real)(i%7)-3,(real)(i%5)-2);
+  }
+}
+
+/* Plans key with every backend, times it on scratch arrays and returns
+   the fastest. Each backend is timed by the best of FFT_BENCHMARK_RUNS
+   transforms, so that a single slow run doesn't decide. Needs the
+   planner lock. */
+static FFTPlan fft_benchmark_backends(const PlanKey * key){
+  FFTPlan best = {NULL,NULL};
+  long long best_time = 0;
+  size_t size = (size_t)key->nx*key->ny*key->nz*(key->howmany > 1 ? key->howmany : 1);
+  Complex * in = fft_malloc(sizeof(Complex)*size);
+  Complex * out = in;
+  if(!key->in_place){
+    out = fft_malloc(sizeof(Complex)*size);
+  }
+  for(int b = 0;b<FFT_NBACKENDS;b++){
+    if(!fft_backends[b]){
+      continue;
+    }
+    void * plan = fft_backends[b]->plan(key);
+    if(!plan){
+      continue;
+    }
+    long long t = -1;
+    for(int run = 0;run<=FFT_BENCHMARK_RUNS;run++){
+      /* In place transforms would otherwise keep growing the data */
+      fft_benchmark_fill(in,size);
+      long long start = sp_gettime();
+      fft_backends[b]->execute(plan,in,out);
+      long long elapsed = sp_gettime()-start;
+      if(run > 0 && (t < 0 || elapsed < t)){
+	t = elapsed;
+      }
+    }
+    if(!best.plan || t < best_time){
+      if(best.plan){
+	best.backend->destroy(best.plan);
+      }
+      best.backend = fft_backends[b];
+      best.plan = plan;
+      best_time = t;
+    }else{
+      fft_backends[b]->destroy(plan);
+    }
+  }
+  if(out != in){
+    fft_free(out);
+  }
+  fft_free(in);
+  return best;
+}
+
+/* Creates a plan for key with the requested backend. Needs the planner lock. */
+static FFTPlan fft_create_plan(const PlanKey * key){
+  FFTPlan ret;
+  if(key->type == PlanC2C && key->backend == SpFFTBackendAuto){
+    return fft_benchmark_backends(key);
+  }
+  ret.backend = fft_backends[SpFFTBackendFFTW3];
+  if(!ret.backend || (key->type == PlanC2C && key->backend == SpFFTBackendBuiltin)){
+    ret.backend = &fft_builtin_backend;
+  }
+  ret.plan = ret.backend->plan(key);
+  return ret;
+}
+
+/* Removes the least recently used plan which is not being executed.
+   Returns 0 if there was no such plan. Needs the planner lock and the
+   table locked exclusively. */
+static int plan_cache_evict(){
+  int lru = -1;
+  for(int i = 0;i<plan_cache_entries;i++){
+    if(plan_cache[i].in_use == 0 && (lru < 0 || plan_cache[i].last_used < plan_cache[lru].last_used)){
+      lru = i;
+    }
+  }
+  if(lru < 0){
+    return 0;
+  }
+  plan_cache[lru].plan.backend->destroy(plan_cache[lru].plan.plan);
+  plan_cache[lru] = plan_cache[plan_cache_entries-1];
+  plan_cache_entries--;
+  plan_cache_evictions++;
+  return 1;
+}
+
+/* Looks key up in the table and marks the plan as being executed.
+   Returns a NULL plan if it's not there. */
+static FFTPlan plan_cache_lookup(const PlanKey * key){
+  FFTPlan plan = {NULL,NULL};
+  plan_cache_read_lock();
+  for(int i = 0;i<plan_cache_entries;i++){
+    if(memcmp(&plan_cache[i].key,key,sizeof(PlanKey)) == 0){
+      fft_atomic_add_int(&plan_cache[i].in_use,1);
+      fft_atomic_set_ll(&plan_cache[i].last_used,fft_atomic_add_ll(&plan_cache_clock,1)+1);
+      fft_atomic_add_ll(&plan_cache_hits,1);
+      plan = plan_cache[i].plan;
+      break;
+    }
+  }
+  plan_cache_read_unlock();
+  return plan;
+}
+
+/* Returns a plan for key. If the plan could not be stored in the cache
+   cached is set to 0 and plan_cache_release() destroys the plan. If no
+   plan could be created at all the plan returned is NULL. */
+static FFTPlan plan_cache_acquire(const PlanKey * key, int * cached){
+  FFTPlan plan;
+  PlanKey k = *key;
+  k.flags = fft_planner_flags();
+  if(k.nthreads < 1){
+    k.nthreads = fft_atomic_get_int(&fft_nthreads);
+  }
+  key = &k;
+  *cached = 1;
+  plan = plan_cache_lookup(key);
+  if(plan.plan){
+    return plan;
+  }
+  planner_lock();
+  /* Someone else might have created it while we waited for the planner */
+  plan = plan_cache_lookup(key);
+  if(plan.plan){
+    planner_unlock();
+    return plan;
+  }
+  fft_atomic_add_ll(&plan_cache_misses,1);
+  plan = fft_create_plan(key);
+#ifndef _SP_NO_FFTW
+  if(!plan.plan && key->flags != FFTW_ESTIMATE){
+    /* With FFTW_WISDOM_ONLY a plan not in the wisdom fails, so fall back
+       to the cheapest planning possible */
+    PlanKey estimate = *key;
+    estimate.flags = FFTW_ESTIMATE;
+    plan = fft_create_plan(&estimate);
+  }
+#endif
+  if(!plan.plan){
+    fprintf(stderr,"Error: Could not create a plan for a %dx%dx%d transform\n",key->nx,key->ny,key->nz);
+    *cached = 0;
+    planner_unlock();
+    return plan;
+  }
+  plan_cache_write_lock();
+  while(plan_cache_entries >= plan_cache_capacity && plan_cache_evict());
+  *cached = 0;
+  if(plan_cache_entries < plan_cache_capacity){
+    if(plan_cache_entries >= plan_cache_allocated){
+      plan_cache_allocated = plan_cache_capacity;
+      plan_cache = sp_realloc(plan_cache,sizeof(PlanCacheEntry)*plan_cache_allocated);
+    }
+    plan_cache[plan_cache_entries].key = *key;
+    plan_cache[plan_cache_entries].plan = plan;
+    plan_cache[plan_cache_entries].in_use = 1;
+    plan_cache[plan_cache_entries].last_used = ++plan_cache_clock;
+    plan_cache_entries++;
+    *cached = 1;
+  }
+  plan_cache_write_unlock();
+  planner_unlock();
+  return plan;
+}
+
+static void plan_cache_release(FFTPlan plan, int cached){
+  if(!plan.plan){
+    return;
+  }
+  if(!cached){
+    planner_lock();
+    plan.backend->destroy(plan.plan);
+    planner_unlock();
+    return;
+  }
+  plan_cache_read_lock();
+  /* entries move around when others are evicted */
+  for(int i = 0;i<plan_cache_entries;i++){
+    if(plan_cache[i].plan.plan == plan.plan){
+      fft_atomic_add_int(&plan_cache[i].in_use,-1);
+      break;
+    }
+  }
+  plan_cache_read_unlock();
+}
+
+/* Transforms howmany contiguous nx*ny*nz arrays with a single plan
+   using nthreads FFTW threads, or the sp_init_fft() default if 0 */
+static void fftw3_execute_c2c_many(const Complex * c_in, Complex * c_out, int nx, int ny, int nz,
+				   int howmany, int sign, int nthreads){
+  int cached;
+  PlanKey key;
+  memset(&key,0,sizeof(PlanKey));
+  key.nx = nx;
+  key.ny = ny;
+  key.nz = nz;
+  if(howmany > 1){
+    key.howmany = howmany;
+  }
+  key.sign = sign;
+  key.in_place = (c_in == c_out);
+  key.aligned = (fft_is_aligned(c_in) && fft_is_aligned(c_out));
+  key.nthreads = nthreads;
+  fft_ensure_env_read();
+  key.backend = fft_atomic_get_int(&fft_backend);
+  FFTPlan plan = plan_cache_acquire(&key,&cached);
+  if(plan.plan){
+    plan.backend->execute(plan.plan,c_in,c_out);
+  }
+  plan_cache_release(plan,cached);
+}
+
+static void fftw3_execute_c2c(const sp_c3matrix * m_in, sp_c3matrix * m_out, int sign, int nthreads){
+  fftw3_execute_c2c_many(m_in->data,m_out->data,sp_c3matrix_x(m_in),sp_c3matrix_y(m_in),
+			 sp_c3matrix_z(m_in),1,sign,nthreads);
+}
+
+/* Transforms the images in list in groups of at most FFT_MANY_BATCH,
+   going through a contiguous stack. This bounds the extra memory used
+   and the number of different plans needed. */
+#define FFT_MANY_BATCH 16
+
+static void fftw3_execute_image_many(Image ** in, Image ** out, int n, int sign){
+  int nx = sp_image_x(in[0]);
+  int ny = sp_image_y(in[0]);
+  int nz = sp_image_z(in[0]);
+  int size = nx*ny*nz;
+  int batch = n < FFT_MANY_BATCH ? n : FFT_MANY_BATCH;
+  Complex * stack = (Complex *)fft_malloc(sizeof(Complex)*size*batch);
+  for(int first = 0;first<n;first += batch){
+    int howmany = n-first < batch ? n-first : batch;
+    for(int i = 0;i<howmany;i++){
+      memcpy(&stack[i*size],in[first+i]->image->data,sizeof(Complex)*size);
+    }
+    fftw3_execute_c2c_many(stack,stack,nx,ny,nz,howmany,sign,0);
+    for(int i = 0;i<howmany;i++){
+      memcpy(out[first+i]->image->data,&stack[i*size],sizeof(Complex)*size);
+    }
+  }
+  fft_free(stack);
+}
+
+static int fft_many_check_sizes(Image ** list, int n){
+  for(int i = 1;i<n;i++){
+    if(sp_image_x(list[0]) != sp_image_x(list[i]) ||
+       sp_image_y(list[0]) != sp_image_y(list[i]) ||
+       sp_image_z(list[0]) != sp_image_z(list[i])){
+      fprintf(stderr,"Error: All images must have the same size for a batched fft!\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+Image ** sp_image_fftw3_many(Image ** list, int n){
+  Image ** res;
+  if(n < 1 || fft_many_check_sizes(list,n)){
+    return NULL;
+  }
+  res = sp_malloc(sizeof(Image *)*n);
+  for(int i = 0;i<n;i++){
+    res[i] = sp_image_duplicate(list[i],SP_COPY_DETECTOR);
+    sp_image_rephase(res[i],SP_ZERO_PHASE);
+    res[i]->shifted = 1;
+    res[i]->detector->image_center[0] = (sp_c3matrix_x(res[i]->image))/2.0;
+    res[i]->detector->image_center[1] = (sp_c3matrix_y(res[i]->image))/2.0;
+    res[i]->detector->image_center[2] = (sp_c3matrix_z(res[i]->image))/2.0;
+  }
+  fftw3_execute_image_many(list,res,n,FFTW_FORWARD);
+  return res;
+}
+
+Image ** sp_image_ifftw3_many(Image ** list, int n){
+  Image ** res;
+  if(n < 1 || fft_many_check_sizes(list,n)){
+    return NULL;
+  }
+  for(int i = 0;i<n;i++){
+    if(!list[i]->phased){
+      fprintf(stderr,"Error: Trying reverse fft an unphased image!\n");
+      abort();
+    }
+    if(!list[i]->shifted){
+      fprintf(stderr,"Error: Trying to rev_fft an unshifted image!\n");
+      abort();
+    }
+  }
+  res = sp_malloc(sizeof(Image *)*n);
+  for(int i = 0;i<n;i++){
+    res[i] = sp_image_duplicate(list[i],SP_COPY_DETECTOR);
+    res[i]->shifted = 0;
+  }
+  fftw3_execute_image_many(list,res,n,FFTW_BACKWARD);
+  return res;
+}
+
+/* Returns 1 if the quadrant swap done by sp_image_shift() on img is a
+   plain cyclic shift by half the size on every axis. In that case the
+   shift can be folded into the transform as a (-1)^(x+y+z) modulation. */
+static int fft_centered_is_modulation(const Image * img){
+  for(int axis = 0;axis<3;axis++){
+    int n = (axis == 0) ? sp_image_x(img) : ((axis == 1) ? sp_image_y(img) : sp_image_z(img));
+    if(n == 1){
+      continue;
+    }
+    if(n % 2 || ceil(img->detector->image_center[axis]) != n/2){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* out = (-1)^(x+y+z+offset) * in */
+static void fft_checkerboard(const sp_c3matrix * in, sp_c3matrix * out, int offset){
+  int nx = sp_c3matrix_x(in);
+  int ny = sp_c3matrix_y(in);
+  int nz = sp_c3matrix_z(in);
+  int i = 0;
+  for(int z = 0;z<nz;z++){
+    for(int y = 0;y<ny;y++){
+      /* sign of the first pixel of the row */
+      int odd = (z+y+offset) & 1;
+      for(int x = 0;x<nx;x++){
+	out->data[i] = odd ? sp_cscale(in->data[i],-1) : in->data[i];
+	odd = !odd;
+	i++;
+      }
+    }
+  }
+}
+
+/* Transforms a centered image into a centered image */
+static Image * fftw3_centered(const Image * img, int sign){
+  Image * res = sp_image_duplicate(img,SP_COPY_DETECTOR);
+  /* The modulation picks up a (-1)^(n/2) factor from each axis */
+  int offset = sp_image_x(img)/2+sp_image_y(img)/2+sp_image_z(img)/2;
+  fft_checkerboard(img->image,res->image,0);
+  fftw3_execute_c2c(res->image,res->image,sign,0);
+  fft_checkerboard(res->image,res->image,offset);
+  res->phased = 1;
+  res->shifted = 0;
+  return res;
+}
+
+Image * sp_image_fftw3_centered(const Image * img){
+  Image * res;
+  if(img->shifted){
+    fprintf(stderr,"Error: Trying to do a centered fft of a shifted image!\n");
+    abort();
+  }
+  if(fft_centered_is_modulation(img)){
+    res = fftw3_centered(img,FFTW_FORWARD);
+  }else{
+    Image * tmp = sp_image_shift((Image *)img);
+    Image * ft = sp_image_fftw3(tmp);
+    sp_image_free(tmp);
+    res = sp_image_shift(ft);
+    sp_image_free(ft);
+  }
+  res->shifted = 0;
+  res->detector->image_center[0] = (sp_image_x(res)-1.0)/2.0;
+  res->detector->image_center[1] = (sp_image_y(res)-1.0)/2.0;
+  res->detector->image_center[2] = (sp_image_z(res)-1.0)/2.0;
+  return res;
+}
+
+Image * sp_image_ifftw3_centered(const Image * img){
+  Image * res;
+  if(!img->phased){
+    fprintf(stderr,"Error: Trying reverse fft an unphased image!\n");
+    abort();
+  }
+  if(img->shifted){
+    fprintf(stderr,"Error: Trying to do a centered rev_fft of a shifted image!\n");
+    abort();
+  }
+  if(fft_centered_is_modulation(img)){
+    res = fftw3_centered(img,FFTW_BACKWARD);
+  }else{
+    Image * tmp = sp_image_shift((Image *)img);
+    Image * ft = sp_image_ifftw3(tmp);
+    sp_image_free(tmp);
+    /* the origin of ft is still in the corner */
+    ft->shifted = 1;
+    res = sp_image_shift(ft);
+    sp_image_free(ft);
+  }
+  res->shifted = 0;
+  res->detector->image_center[0] = (sp_image_x(res)-1.0)/2.0;
+  res->detector->image_center[1] = (sp_image_y(res)-1.0)/2.0;
+  res->detector->image_center[2] = (sp_image_z(res)-1.0)/2.0;
+  return res;
+}
+
+/* Transforms in place the nlines lines of length n and stride stride
+   which start at data+offset[i]. Each line goes through a contiguous
+   buffer so that a single plan serves all of them. */
+static void fftw3_execute_lines(Complex * data, int n, int stride, const long long * offset, int nlines, int sign){
+  int cached;
+  PlanKey key;
+  Complex * buffer = (Complex *)fft_malloc(sizeof(Complex)*n);
+  memset(&key,0,sizeof(PlanKey));
+  key.nx = n;
+  key.ny = 1;
+  key.nz = 1;
+  key.sign = sign;
+  key.in_place = 1;
+  key.aligned = 1;
+  /* 0 uses the default number of threads */
+  key.nthreads = 0;
+  fft_ensure_env_read();
+  key.backend = fft_atomic_get_int(&fft_backend);
+  FFTPlan plan = plan_cache_acquire(&key,&cached);
+  for(int l = 0;plan.plan && l<nlines;l++){
+    Complex * p = &data[offset[l]];
+    if(stride == 1){
+      memcpy(buffer,p,sizeof(Complex)*n);
+    }else{
+      for(int i = 0;i<n;i++){
+	buffer[i] = p[i*stride];
+      }
+    }
+    plan.backend->execute(plan.plan,buffer,buffer);
+    if(stride == 1){
+      memcpy(p,buffer,sizeof(Complex)*n);
+    }else{
+      for(int i = 0;i<n;i++){
+	p[i*stride] = buffer[i];
+      }
+    }
+  }
+  plan_cache_release(plan,cached);
+  fft_free(buffer);
+}
+
+/* Transforms m in place with one pass of 1D transforms per axis.
+   used[axis][i] is 0 when the input is zero everywhere at index i of
+   that axis, so the lines which are still all zeros are skipped:
+   the x pass only does the lines with used y and z and the y pass
+   only the lines with used z. */
+static void fftw3_execute_pruned(sp_c3matrix * m, int * used[3], int sign){
+  int nx = sp_c3matrix_x(m);
+  int ny = sp_c3matrix_y(m);
+  int nz = sp_c3matrix_z(m);
+  int nlines;
+  long long * offset = sp_malloc(sizeof(long long)*MAX(ny*nz,MAX(nx*nz,nx*ny)));
+  if(nx > 1){
+    nlines = 0;
+    for(int z = 0;z<nz;z++){
+      for(int y = 0;y<ny;y++){
+	if(used[1][y] && used[2][z]){
+	  offset[nlines++] = ((long long)z*ny+y)*nx;
+	}
+      }
+    }
+    fftw3_execute_lines(m->data,nx,1,offset,nlines,sign);
+  }
+  if(ny > 1){
+    nlines = 0;
+    for(int z = 0;z<nz;z++){
+      if(used[2][z]){
+	for(int x = 0;x<nx;x++){
+	  offset[nlines++] = (long long)z*ny*nx+x;
+	}
+      }
+    }
+    fftw3_execute_lines(m->data,ny,nx,offset,nlines,sign);
+  }
+  if(nz > 1){
+    nlines = 0;
+    for(int y = 0;y<ny;y++){
+      for(int x = 0;x<nx;x++){
+	offset[nlines++] = (long long)y*nx+x;
+      }
+    }
+    fftw3_execute_lines(m->data,nz,nx*ny,offset,nlines,sign);
+  }
+  sp_free(offset);
+}
+
+/* Returns img zero padded to nx,ny,nz as zero_pad_image() does it
+   and marks in used[] which indices along each axis hold the input */
+static Image * fft_zero_pad(const Image * img, int nx, int ny, int nz, int * used[3]){
+  int size[3] = {nx,ny,nz};
+  int in_size[3] = {sp_image_x(img),sp_image_y(img),sp_image_z(img)};
+  int * map[3];
+  Image * res = fft_image_alloc_resized(img,nx,ny,nz);
+  res->phased = img->phased;
+  res->shifted = img->shifted;
+  for(int axis = 0;axis<3;axis++){
+    map[axis] = sp_malloc(sizeof(int)*in_size[axis]);
+    used[axis] = sp_malloc(sizeof(int)*size[axis]);
+    for(int i = 0;i<size[axis];i++){
+      used[axis][i] = 0;
+    }
+    for(int i = 0;i<in_size[axis];i++){
+      /* shifted images are split through the middle */
+      if(!img->shifted || i < in_size[axis]/2.0){
+	map[axis][i] = i;
+      }else{
+	map[axis][i] = size[axis]-in_size[axis]+i;
+      }
+      used[axis][map[axis][i]] = 1;
+    }
+  }
+  /* sp_image_alloc() zeroes the data */
+  for(int z = 0;z<in_size[2];z++){
+    for(int y = 0;y<in_size[1];y++){
+      for(int x = 0;x<in_size[0];x++){
+	res->image->data[((long long)map[2][z]*ny+map[1][y])*nx+map[0][x]] =
+	  img->image->data[((long long)z*in_size[1]+y)*in_size[0]+x];
+      }
+    }
+  }
+  for(int axis = 0;axis<3;axis++){
+    sp_free(map[axis]);
+  }
+  return res;
+}
+
+/* Returns -1 for negative padding, 0 for no padding and 1 otherwise */
+static int fft_padded_check_size(const Image * img, int x, int y, int z){
+  if(x < sp_image_x(img) || y < sp_image_y(img) || z < sp_image_z(img)){
+    fprintf(stderr,"Error: Negative padding!\n");
+    return -1;
+  }
+  if(x == sp_image_x(img) && y == sp_image_y(img) && z == sp_image_z(img)){
+    return 0;
+  }
+  return 1;
+}
+
+Image * sp_image_fftw3_padded(const Image * img, int x, int y, int z){
+  int * used[3];
+  Image * res;
+  switch(fft_padded_check_size(img,x,y,z)){
+  case -1:
+    return NULL;
+  case 0:
+    /* nothing to prune */
+    return sp_image_fftw3(img);
+  }
+  res = fft_zero_pad(img,x,y,z,used);
+  fftw3_execute_pruned(res->image,used,FFTW_FORWARD);
+  for(int axis = 0;axis<3;axis++){
+    sp_free(used[axis]);
+  }
+  res->phased = 1;
+  res->shifted = 1;
+  res->detector->image_center[0] = x/2.0;
+  res->detector->image_center[1] = y/2.0;
+  res->detector->image_center[2] = z/2.0;
+  return res;
+}
+
+Image * sp_image_ifftw3_padded(const Image * img, int x, int y, int z){
+  int * used[3];
+  Image * res;
+  if(!img->phased){
+    fprintf(stderr,"Error: Trying reverse fft an unphased image!\n");
+    abort();
+  }
+  if(!img->shifted){
+    fprintf(stderr,"Error: Trying to rev_fft an unshifted image!\n");
+    abort();
+  }
+  switch(fft_padded_check_size(img,x,y,z)){
+  case -1:
+    return NULL;
+  case 0:
+    return sp_image_ifftw3(img);
+  }
+  res = fft_zero_pad(img,x,y,z,used);
+  fftw3_execute_pruned(res->image,used,FFTW_BACKWARD);
+  for(int axis = 0;axis<3;axis++){
+    sp_free(used[axis]);
+  }
+  res->shifted = 0;
+  return res;
+}
+
+void sp_fftw3_stack(const Complex * in, Complex * out, int x, int y, int z, int n){
+  fftw3_execute_c2c_many(in,out,x,y,z,n,FFTW_FORWARD,0);
+}
+
+void sp_ifftw3_stack(const Complex * in, Complex * out, int x, int y, int z, int n){
+  fftw3_execute_c2c_many(in,out,x,y,z,n,FFTW_BACKWARD,0);
+}
+
+/* Real to complex transform of the nx*ny*nz array in into the half spectrum out */
+static void fftw3_execute_r2c_array(const real * in, Complex * out, int nx, int ny, int nz, int nthreads){
+  int cached;
+  PlanKey key;
+  memset(&key,0,sizeof(PlanKey));
+  key.type = PlanR2C;
+  key.nx = nx;
+  key.ny = ny;
+  key.nz = nz;
+  key.sign = FFTW_FORWARD;
+  key.aligned = (fft_is_aligned(in) && fft_is_aligned(out));
+  key.nthreads = nthreads;
+  FFTPlan plan = plan_cache_acquire(&key,&cached);
+  if(plan.plan){
+    plan.backend->execute_r2c(plan.plan,in,out);
+  }
+  plan_cache_release(plan,cached);
+}
+
+/* Complex to real transform of the half spectrum in, which is destroyed,
+   into the nx*ny*nz array out */
+static void fftw3_execute_c2r_array(Complex * in, real * out, int nx, int ny, int nz, int nthreads){
+  int cached;
+  PlanKey key;
+  memset(&key,0,sizeof(PlanKey));
+  key.type = PlanC2R;
+  key.nx = nx;
+  key.ny = ny;
+  key.nz = nz;
+  key.sign = FFTW_BACKWARD;
+  key.aligned = (fft_is_aligned(in) && fft_is_aligned(out));
+  key.nthreads = nthreads;
+  FFTPlan plan = plan_cache_acquire(&key,&cached);
+  if(plan.plan){
+    plan.backend->execute_c2r(plan.plan,in,out);
+  }
+  plan_cache_release(plan,cached);
+}
+
+/* Transforms the real part of m_in into the half spectrum m_out */
+static void fftw3_execute_r2c(const sp_c3matrix * m_in, sp_c3matrix * m_out){
+  int size = sp_c3matrix_size(m_in);
+  real * in = (real *)fft_malloc(sizeof(real)*size);
+  for(int i = 0;i<size;i++){
+    in[i] = sp_real(m_in->data[i]);
+  }
+  /* 0 uses the default number of threads */
+  fftw3_execute_r2c_array(in,m_out->data,sp_c3matrix_x(m_in),sp_c3matrix_y(m_in),sp_c3matrix_z(m_in),0);
+  fft_free(in);
+}
+
+/* Transforms the half spectrum m_in into the real m_out */
+static void fftw3_execute_c2r(const sp_c3matrix * m_in, sp_c3matrix * m_out){
+  int size = sp_c3matrix_size(m_out);
+  /* c2r transforms destroy their input */
+  Complex * in = (Complex *)fft_malloc(sizeof(Complex)*sp_c3matrix_size(m_in));
+  real * out = (real *)fft_malloc(sizeof(real)*size);
+  memcpy(in,m_in->data,sizeof(Complex)*sp_c3matrix_size(m_in));
+  /* 0 uses the default number of threads */
+  fftw3_execute_c2r_array(in,out,sp_c3matrix_x(m_out),sp_c3matrix_y(m_out),sp_c3matrix_z(m_out),0);
+  for(int i = 0;i<size;i++){
+    m_out->data[i] = sp_cinit(out[i],0);
+  }
+  fft_free(out);
+  fft_free(in);
+}
+
+void sp_rfftw3_array(const real * in, Complex * out, int x, int y, int z, int nthreads){
+  fftw3_execute_r2c_array(in,out,x,y,z,nthreads);
+}
+
+void sp_irfftw3_array(Complex * in, real * out, int x, int y, int z, int nthreads){
+  fftw3_execute_c2r_array(in,out,x,y,z,nthreads);
+}
+
+Image * sp_image_rfftw3(const Image * img){
+  Image * res = fft_image_alloc_resized(img,sp_image_x(img)/2+1,sp_image_y(img),sp_image_z(img));
+  fftw3_execute_r2c(img->image,res->image);
+  res->phased = 1;
+  res->shifted = 1;
+  /* Same center as the full transform from sp_image_fftw3() */
+  res->detector->image_center[0] = (sp_image_x(img))/2.0;
+  res->detector->image_center[1] = (sp_image_y(img))/2.0;
+  res->detector->image_center[2] = (sp_image_z(img))/2.0;
+  return res;
+}
+
+void sp_image_rfftw3_fast(const Image * img_in, Image * img_out){
+  if(sp_image_x(img_out) != sp_image_x(img_in)/2+1 ||
+     sp_image_y(img_out) != sp_image_y(img_in) ||
+     sp_image_z(img_out) != sp_image_z(img_in)){
+    fprintf(stderr,"Error: Output of sp_image_rfft_fast has the wrong dimensions!\n");
+    return;
+  }
+  fftw3_execute_r2c(img_in->image,img_out->image);
+}
+
+Image * sp_image_irfftw3(const Image * img, int nx){
+  Image * res;
+  if(nx/2+1 != sp_image_x(img)){
+    fprintf(stderr,"Error: x size %d does not match the half spectrum!\n",nx);
+    return NULL;
+  }
+  if(!img->shifted){
+    fprintf(stderr,"Error: Trying to rev_fft an unshifted image!\n");
+    abort();
+  }
+  res = fft_image_alloc_resized(img,nx,sp_image_y(img),sp_image_z(img));
+  fftw3_execute_c2r(img->image,res->image);
+  res->phased = 0;
+  res->shifted = 0;
+  return res;
+}
+
+void sp_image_irfftw3_fast(const Image * img_in, Image * img_out){
+  if(sp_image_x(img_out)/2+1 != sp_image_x(img_in) ||
+     sp_image_y(img_out) != sp_image_y(img_in) ||
+     sp_image_z(img_out) != sp_image_z(img_in)){
+    fprintf(stderr,"Error: Output of sp_image_irfft_fast has the wrong dimensions!\n");
+    return;
+  }
+  fftw3_execute_c2r(img_in->image,img_out->image);
+}
+
+#endif
+
+Image * sp_image_rfft_expand(const Image * img, int nx){
+  int hx = sp_image_x(img);
+  int ny = sp_image_y(img);
+  int nz = sp_image_z(img);
+  Image * res;
+  if(nx/2+1 != hx){
+    fprintf(stderr,"Error: x size %d does not match the half spectrum!\n",nx);
+    return NULL;
+  }
+  res = fft_image_alloc_resized(img,nx,sp_image_y(img),sp_image_z(img));
+  res->phased = img->phased;
+  res->shifted = img->shifted;
+  for(int z = 0;z<nz;z++){
+    for(int y = 0;y<ny;y++){
+      for(int x = 0;x<nx;x++){
+	if(x < hx){
+	  res->image->data[(z*ny+y)*nx+x] = img->image->data[(z*ny+y)*hx+x];
+	}else{
+	  /* F(-k) = conj(F(k)) */
+	  res->image->data[(z*ny+y)*nx+x] = sp_cconj(img->image->data[(((nz-z)%nz)*ny+(ny-y)%ny)*hx+nx-x]);
+	}
+      }
+    }
+  }
+  return res;
+}
+
+#ifdef FFTW3
+
+void sp_fft_plan_cache_stats(SpFFTPlanCacheStats * stats){
+  plan_cache_read_lock();
+  stats->hits = fft_atomic_get_ll(&plan_cache_hits);
+  stats->misses = fft_atomic_get_ll(&plan_cache_misses);
+  stats->evictions = plan_cache_evictions;
+  stats->entries = plan_cache_entries;
+  stats->capacity = plan_cache_capacity;
+  plan_cache_read_unlock();
+}
+
+void sp_fft_plan_cache_set_capacity(int capacity){
+  if(capacity < 0){
+    capacity = 0;
+  }
+  planner_lock();
+  plan_cache_write_lock();
+  while(plan_cache_entries > capacity && plan_cache_evict());
+  plan_cache_capacity = capacity;
+  plan_cache_write_unlock();
+  planner_unlock();
+}
+
 int sp_init_fft(int nthreads){
-  int ret = -1; 
+  int ret = 1;
+  planner_lock();
+  fft_read_env();
+  if(nthreads > 1){
+    fft_plan_with_nthreads(nthreads);
+    ret = fft_threads_initialized;
+    if(ret){
+      fft_atomic_set_int(&fft_nthreads,nthreads);
+    }
+  }
+  planner_unlock();
   if(nthreads == 1){
     /* No need to do anything*/
     return 0;
   }
-#ifdef FFTW3
-  ret = fftwr_init_threads();  
-  if(!ret){
-    perror("Error initializing parallel fftw!\n");
-  }else{
-    fftwr_plan_with_nthreads(nthreads);
-  }  
-#endif
   return ret;
 }
 
+int sp_finalize_fft(){
+  int ret = 0;
+  planner_lock();
+  if(wisdom_file && fft_export_wisdom(wisdom_file)){
+    ret = -1;
+  }
+  plan_cache_write_lock();
+  while(plan_cache_entries && plan_cache_evict());
+  plan_cache_write_unlock();
+  planner_unlock();
+  return ret;
+}
+
+void sp_fft_set_planner_rigor(SpFFTPlannerRigor rigor){
+  planner_lock();
+  /* An explicit setting always wins over the environment */
+  fft_read_env();
+  fft_atomic_set_int(&planner_rigor,rigor);
+  planner_unlock();
+}
+
+SpFFTPlannerRigor sp_fft_planner_rigor(){
+  SpFFTPlannerRigor ret;
+  planner_lock();
+  fft_read_env();
+  ret = (SpFFTPlannerRigor)planner_rigor;
+  planner_unlock();
+  return ret;
+}
+
+int sp_fft_set_backend(SpFFTBackend backend){
+  if(backend < SpFFTBackendFFTW3 || backend > SpFFTBackendAuto){
+    fprintf(stderr,"Error: Unknown FFT backend %d\n",backend);
+    return -1;
+  }
+  if(backend != SpFFTBackendAuto && !fft_backends[backend]){
+    fprintf(stderr,"Error: FFT backend %d is not built in\n",backend);
+    return -1;
+  }
+  planner_lock();
+  /* An explicit setting always wins over the environment */
+  fft_read_env();
+  fft_atomic_set_int(&fft_backend,backend);
+  planner_unlock();
+  return 0;
+}
+
+SpFFTBackend sp_fft_backend(){
+  fft_ensure_env_read();
+  return (SpFFTBackend)fft_atomic_get_int(&fft_backend);
+}
+
+const char * sp_fft_backend_name(SpFFTBackend backend){
+  switch(backend){
+  case SpFFTBackendFFTW3:
+  case SpFFTBackendBuiltin:
+    return fft_backends[backend] ? fft_backends[backend]->name : NULL;
+  case SpFFTBackendAuto:
+    return "auto";
+  }
+  return NULL;
+}
+
+int sp_fft_set_wisdom_file(const char * filename){
+  int ret;
+  planner_lock();
+  fft_read_env();
+  ret = fft_set_wisdom_file(filename);
+  planner_unlock();
+  return ret;
+}
+
+int sp_fft_import_wisdom(const char * filename){
+  int ret;
+  planner_lock();
+  ret = fft_import_wisdom(filename);
+  planner_unlock();
+  return ret;
+}
+
+int sp_fft_export_wisdom(const char * filename){
+  int ret;
+  planner_lock();
+  ret = fft_export_wisdom(filename);
+  planner_unlock();
+  return ret;
+}
+
+void sp_fft_plan_cache_clear(){
+  planner_lock();
+  plan_cache_write_lock();
+  while(plan_cache_entries && plan_cache_evict());
+  plan_cache_hits = 0;
+  plan_cache_misses = 0;
+  plan_cache_evictions = 0;
+  plan_cache_write_unlock();
+  planner_unlock();
+}
+
+#endif
+
 #ifdef FFTW3
 
 Image * sp_image_ifftw3(const Image * img){
-  fftwr_complex *out; 
-  fftwr_complex *in; 
-  fftwr_plan plan;
   Image * res;
   if(!img->phased){
     fprintf(stderr,"Error: Trying reverse fft an unphased image!\n");
@@ -65,51 +1322,23 @@ Image * sp_image_ifftw3(const Image * img){
   }
 
   res = sp_image_duplicate(img,SP_COPY_DETECTOR);
-  /* We're gonna rely on the binary compatibility between fftwr_complex and Complex type */
-  /*
-  in = (fftwr_complex*) fftwr_malloc(sizeof(fftwr_complex) * (sp_cmatrix_rows(img->image))*(sp_cmatrix_cols(img->image)));  
-  out = (fftwr_complex*) fftwr_malloc(sizeof(fftwr_complex) * (sp_cmatrix_rows(img->image))*(sp_cmatrix_cols(img->image)));
-  */
-  
-  /* Kinda buggy FM: I'm gonna assume the compiler doesn't make strange things to our structure and everything is binary compatible */
-  in = (fftwr_complex *)img->image->data;
-  out = (fftwr_complex *)res->image->data;
-
-  /* It is very important to have z,y,x as the plan order as FFTW is row-major! */
-  plan = fftwr_plan_dft_3d(sp_c3matrix_z(img->image),sp_c3matrix_y(img->image),sp_c3matrix_x(img->image),in,out, FFTW_BACKWARD,FFTW_MEASURE);
-
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);
+  fftw3_execute_c2c(img->image,res->image,FFTW_BACKWARD,0);
   res->shifted = 0;
   return res;
 }
 
 void sp_image_ifftw3_fast(const Image * img_in, Image * img_out){
-  fftwr_complex *out; 
-  fftwr_complex *in; 
-  fftwr_plan plan;
-  /* Rely on binary compatibility of the Complex type */
-  in = (fftwr_complex *)img_in->image->data;
-  out = (fftwr_complex *)img_out->image->data;
-  /* It is very important to have z,y,x as the plan order as FFTW is row-major! */
-  plan = fftwr_plan_dft_3d(sp_c3matrix_z(img_in->image),sp_c3matrix_y(img_in->image),sp_c3matrix_x(img_in->image),in,out,FFTW_BACKWARD,FFTW_MEASURE);
+  fftw3_execute_c2c(img_in->image,img_out->image,FFTW_BACKWARD,0);
+}
 
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);  
+void sp_image_ifftw3_fast_threads(const Image * img_in, Image * img_out, int nthreads){
+  fftw3_execute_c2c(img_in->image,img_out->image,FFTW_BACKWARD,nthreads);
 }
 
 sp_c3matrix * sp_c3matrix_ifftw3(const sp_c3matrix * m){
-  fftwr_complex *out; 
-  fftwr_complex *in; 
-  fftwr_plan plan;
   sp_c3matrix * res;
   res = sp_c3matrix_alloc(sp_c3matrix_x(m),sp_c3matrix_y(m),sp_c3matrix_z(m));
-  in = (fftwr_complex *)m->data;
-  out = (fftwr_complex *)res->data;
-  plan = fftwr_plan_dft_3d(sp_c3matrix_z(m),sp_c3matrix_y(m),sp_c3matrix_x(m),in,out, FFTW_BACKWARD,FFTW_MEASURE);
-
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);
+  fftw3_execute_c2c(m,res,FFTW_BACKWARD,0);
   return res;
 }
 
@@ -150,20 +1379,10 @@ Image * sp_image_ifftw2(const Image * img){
 #ifdef FFTW3
 
 Image * sp_image_fftw3(const Image * img){
-  fftwr_complex *out; 
-  fftwr_complex *in; 
-  fftwr_plan plan;
   Image * res = sp_image_duplicate(img,SP_COPY_DETECTOR);
 
   sp_image_rephase(res,SP_ZERO_PHASE);
-  /* Rely on binary compatibility of the Complex type */
-  in = (fftwr_complex *)img->image->data;
-  out = (fftwr_complex *)res->image->data;
-  /* It is very important to have z,y,x as the plan order as FFTW is row-major! */
-  plan = fftwr_plan_dft_3d(sp_c3matrix_z(img->image),sp_c3matrix_y(img->image),sp_c3matrix_x(img->image),in,out,FFTW_FORWARD,FFTW_MEASURE);
-
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);
+  fftw3_execute_c2c(img->image,res->image,FFTW_FORWARD,0);
   res->shifted = 1;
   /*changed from
     res->detector->image_center[0] = (sp_c3matrix_x(res->image)-1)/2.0;
@@ -175,139 +1394,68 @@ Image * sp_image_fftw3(const Image * img){
 }
 
 void sp_image_fftw3_fast(const Image * img_in, Image * img_out){
-  fftwr_complex *out; 
-  fftwr_complex *in; 
-  fftwr_plan plan;
-  /* Rely on binary compatibility of the Complex type */
-  in = (fftwr_complex *)img_in->image->data;
-  out = (fftwr_complex *)img_out->image->data;
-  /* It is very important to have z,y,x as the plan order as FFTW is row-major! */
-  plan = fftwr_plan_dft_3d(sp_c3matrix_z(img_in->image),sp_c3matrix_y(img_in->image),sp_c3matrix_x(img_in->image),in,out,FFTW_FORWARD,FFTW_MEASURE);
-
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);  
+  fftw3_execute_c2c(img_in->image,img_out->image,FFTW_FORWARD,0);
 }
 
-Image * sp_image_1d_fftw3(const Image * img, int axis) {
-  fftwr_complex *out;
-  fftwr_complex *in;
-  fftwr_plan plan;
-  Image *res = sp_image_duplicate(img,SP_COPY_DETECTOR);
+void sp_image_fftw3_fast_threads(const Image * img_in, Image * img_out, int nthreads){
+  fftw3_execute_c2c(img_in->image,img_out->image,FFTW_FORWARD,nthreads);
+}
 
-  sp_image_rephase(res, SP_ZERO_PHASE);
-  in = (fftwr_complex *) img->image->data;
-  out = (fftwr_complex *) res->image->data;
-  int inembed[1], onembed[1];
-  inembed[0] = sp_image_size(img); onembed[0] = sp_image_size(img);
-  int idist, odist, istride, ostride;
-  int *n;
-  int howmany;
-  if (axis == 0) {
-    idist = sp_image_x(img);
-    istride = 1;
-    n = malloc(sp_image_y(img)*sp_image_z(img)*sizeof(int));
-    for (int i = 0; i < sp_image_y(img)*sp_image_z(img); i++) n[i] = sp_image_x(img);
-    howmany = sp_image_y(img)*sp_image_z(img);
-  } else if (axis == 1) {
-    if (sp_image_z(img) != 1) printf("trying to 1d fft along the second y-axis of a 3d image is not yet implemented");
-    idist = 1;
-    istride = sp_image_x(img);
-    n = malloc(sp_image_x(img)*sizeof(int));
-    for (int i = 0; i < sp_image_x(img); i++) n[i] = sp_image_y(img);
-    howmany = sp_image_x(img);
-  } else if (axis == 2) {
-    idist = 1;
-    istride = sp_image_x(img)*sp_image_y(img);
-    n = malloc(sp_image_x(img)*sp_image_y(img)*sizeof(int));
-    for (int i = 0; i < sp_image_x(img)*sp_image_y(img); i++) n[i] = sp_image_z(img);
-    howmany = sp_image_x(img)*sp_image_y(img);
+/* Transforms img along axis with one 1D transform per line */
+static Image * fft_image_1d(const Image * img, int axis, int sign){
+  int nx = sp_image_x(img);
+  int ny = sp_image_y(img);
+  int nz = sp_image_z(img);
+  int n;
+  int stride;
+  int nlines;
+  long long * offset;
+  if(axis == 0){
+    n = nx;
+    stride = 1;
+    nlines = ny*nz;
+  }else if(axis == 1){
+    n = ny;
+    stride = nx;
+    nlines = nx*nz;
+  }else if(axis == 2){
+    n = nz;
+    stride = nx*ny;
+    nlines = nx*ny;
   }else{
     return NULL;
   }
-  odist = idist;
-  ostride = istride;
-  /*
-  plan = fftwr_plan_many_dft(1, n, sp_image_y(img)*sp_image_z(img),
-			     in, inembed, istride, idist, out, onembed, ostride, odist,
-			     FFTW_FORWARD, FFTW_MEASURE);
-  */
-  plan = fftwr_plan_many_dft(1, n, howmany,
-			     in, inembed, istride, idist, out, onembed, ostride, odist,
-			     FFTW_FORWARD, FFTW_MEASURE);
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);
-  free(n);
-  return res;
-}
-
-Image * sp_image_1d_ifftw3(const Image * img, int axis) {
-  fftwr_complex *out;
-  fftwr_complex *in;
-  fftwr_plan plan;
   Image *res = sp_image_duplicate(img,SP_COPY_DETECTOR);
-
   sp_image_rephase(res, SP_ZERO_PHASE);
-  in = (fftwr_complex *) img->image->data;
-  out = (fftwr_complex *) res->image->data;
-  int inembed[1], onembed[1];
-  inembed[0] = sp_image_size(img); onembed[0] = sp_image_size(img);
-  int idist, odist, istride, ostride;
-  int *n;
-  int howmany;
-  if (axis == 0) {
-    idist = sp_image_x(img);
-    istride = 1;
-    n = malloc(sp_image_y(img)*sp_image_z(img)*sizeof(int));
-    for (int i = 0; i < sp_image_y(img)*sp_image_z(img); i++) n[i] = sp_image_x(img);
-    howmany = sp_image_y(img)*sp_image_z(img);
-  } else if (axis == 1) {
-    if (sp_image_z(img) != 1) printf("trying to 1d fft along the second y-axis of a 3d image is not yet implemented");
-    idist = 1;
-    istride = sp_image_x(img);
-    n = malloc(sp_image_x(img)*sizeof(int));
-    for (int i = 0; i < sp_image_x(img); i++) n[i] = sp_image_y(img);
-    howmany = sp_image_x(img);
-  } else if (axis == 2) {
-    idist = 1;
-    istride = sp_image_x(img)*sp_image_y(img);
-    n = malloc(sp_image_x(img)*sp_image_y(img)*sizeof(int));
-    for (int i = 0; i < sp_image_x(img)*sp_image_y(img); i++) n[i] = sp_image_z(img);
-    howmany = sp_image_x(img)*sp_image_y(img);
-  }else{
-    return NULL;
+  memcpy(res->image->data,img->image->data,sizeof(Complex)*sp_image_size(img));
+  offset = sp_malloc(sizeof(long long)*nlines);
+  for(int l = 0;l<nlines;l++){
+    if(axis == 0){
+      offset[l] = (long long)l*nx;
+    }else if(axis == 1){
+      /* l = z*nx+x */
+      offset[l] = (long long)(l/nx)*nx*ny+l%nx;
+    }else{
+      offset[l] = l;
+    }
   }
-  odist = idist;
-  ostride = istride;
-  /*
-  plan = fftwr_plan_many_dft(1, n, sp_image_y(img)*sp_image_z(img),
-			     in, inembed, istride, idist, out, onembed, ostride, odist,
-			     FFTW_BACKWARD, FFTW_MEASURE);
-  */
-  plan = fftwr_plan_many_dft(1, n, howmany,
-			     in, inembed, istride, idist, out, onembed, ostride, odist,
-			     FFTW_BACKWARD, FFTW_MEASURE);
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);
-  free(n);
+  fftw3_execute_lines(res->image->data,n,stride,offset,nlines,sign);
+  sp_free(offset);
   return res;
 }
 
+Image * sp_image_1d_fftw3(const Image * img, int axis) {
+  return fft_image_1d(img,axis,FFTW_FORWARD);
+}
+
+Image * sp_image_1d_ifftw3(const Image * img, int axis) {
+  return fft_image_1d(img,axis,FFTW_BACKWARD);
+}
 
 sp_c3matrix * sp_c3matrix_fftw3(const sp_c3matrix * m){
-  fftwr_complex *out; 
-  fftwr_complex *in; 
-  fftwr_plan plan;
   sp_c3matrix * res = sp_c3matrix_alloc(sp_c3matrix_x(m),sp_c3matrix_y(m),
 					sp_c3matrix_z(m));
-
-  /* Rely on binary compatibility of the Complex type */
-  in = (fftwr_complex *)m->data;
-  out = (fftwr_complex *)res->data;
-  /* It is very important to have z,y,x as the plan order as FFTW is row-major! */
-  plan = fftwr_plan_dft_3d(sp_c3matrix_z(m),sp_c3matrix_y(m),sp_c3matrix_x(m),in,out,FFTW_FORWARD,FFTW_MEASURE);
-
-  fftwr_execute(plan);
-  fftwr_destroy_plan(plan);
+  fftw3_execute_c2c(m,res,FFTW_FORWARD,0);
   return res;
 }
 
@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "spimage.h"
+#include "fft_private.h"
+
+/* Self contained FFT backend.
+
+   This is a mixed radix decimation in time FFT, which works for any size.
+   Multidimensional transforms are done one axis at a time by gathering each
+   line into a contiguous buffer. Radix 2 has its own butterfly, all other
+   factors use the generic one which is O(p) per output, so sizes with large
+   prime factors are slow. It is meant as a fallback and as a reference,
+   not to compete with FFTW. Plans are read-only after creation so they can
+   be executed concurrently.
+
+   Real to complex transforms are done as full complex transforms, and
+   complex to real ones first rebuild the full spectrum from its Hermitian
+   symmetry. This wastes half of the work but keeps them exact. */
+
+/* Enough for any size that fits in an int */
+#define BUILTIN_MAX_FACTORS 32
+
+typedef struct{
+  int n;
+  int nfactors;
+  int factors[BUILTIN_MAX_FACTORS];
+  int max_factor;
+  /* twiddles[j] = exp(sign*2*pi*i*j/n) */
+  Complex * twiddles;
+}BuiltinAxis;
+
+typedef struct{
+  int nx;
+  int ny;
+  int nz;
+  int howmany;
+  /* x, y and z */
+  BuiltinAxis axis[3];
+}BuiltinPlan;
+
+static void builtin_axis_init(BuiltinAxis * a, int n, int sign){
+  int p = 2;
+  int left = n;
+  a->n = n;
+  a->nfactors = 0;
+  a->max_factor = 1;
+  while(left > 1){
+    while(left % p){
+      /* 2, 3, 5, 7, 9, ... */
+      p = (p == 2) ? 3 : p+2;
+      if(p*p > left){
+	p = left;
+      }
+    }
+    a->factors[a->nfactors++] = p;
+    if(p > a->max_factor){
+      a->max_factor = p;
+    }
+    left /= p;
+  }
+  a->twiddles = sp_malloc(sizeof(Complex)*n);
+  for(int j = 0;j<n;j++){
+    double phi = 2*M_PI*j/n;
+    a->twiddles[j] = sp_cinit(cos(phi),sign*sin(phi));
+  }
+}
+
+/* Transforms the n elements of in, spaced by fstride*in_stride, into the
+   contiguous out. fstride is the product of the factors already used. */
+static void builtin_work(const BuiltinAxis * a, Complex * out, const Complex * in, int fstride,
+			 int in_stride, const int * factors, int n, Complex * scratch){
+  int radix = factors[0];
+  int m = n/radix;
+  const Complex * tw = a->twiddles;
+  if(m == 1){
+    for(int q = 0;q<radix;q++){
+      out[q] = in[q*fstride*in_stride];
+    }
+  }else{
+    for(int q = 0;q<radix;q++){
+      builtin_work(a,out+q*m,in+q*fstride*in_stride,fstride*radix,in_stride,factors+1,m,scratch);
+    }
+  }
+  if(radix == 2){
+    for(int u = 0;u<m;u++){
+      Complex t = sp_cmul(out[u+m],tw[u*fstride]);
+      out[u+m] = sp_csub(out[u],t);
+      out[u] = sp_cadd(out[u],t);
+    }
+    return;
+  }
+  for(int u = 0;u<m;u++){
+    for(int q = 0;q<radix;q++){
+      scratch[q] = out[u+q*m];
+    }
+    for(int q1 = 0;q1<radix;q1++){
+      int k = u+q1*m;
+      int twidx = 0;
+      Complex sum = scratch[0];
+      for(int q = 1;q<radix;q++){
+	twidx += fstride*k;
+	if(twidx >= a->n){
+	  twidx -= a->n;
+	}
+	sum = sp_cadd(sum,sp_cmul(scratch[q],tw[twidx]));
+      }
+      out[k] = sum;
+    }
+  }
+}
+
+static void * builtin_plan(const PlanKey * key){
+  int n[3] = {key->nx,key->ny,key->nz};
+  BuiltinPlan * p = sp_malloc(sizeof(BuiltinPlan));
+  p->nx = key->nx;
+  p->ny = key->ny;
+  p->nz = key->nz;
+  /* Only complex to complex transforms come in stacks */
+  p->howmany = (key->type == PlanC2C && key->howmany > 1) ? key->howmany : 1;
+  for(int i = 0;i<3;i++){
+    builtin_axis_init(&p->axis[i],n[i],key->sign);
+  }
+  return p;
+}
+
+static void builtin_destroy(void * plan){
+  BuiltinPlan * p = plan;
+  for(int i = 0;i<3;i++){
+    sp_free(p->axis[i].twiddles);
+  }
+  sp_free(p);
+}
+
+static void builtin_execute(void * plan, const Complex * in, Complex * out){
+  BuiltinPlan * p = plan;
+  int nx = p->nx;
+  int ny = p->ny;
+  int nz = p->nz;
+  int size = nx*ny*nz;
+  int nmax = nx > ny ? nx : ny;
+  int max_factor = 1;
+  nmax = nmax > nz ? nmax : nz;
+  for(int i = 0;i<3;i++){
+    if(p->axis[i].max_factor > max_factor){
+      max_factor = p->axis[i].max_factor;
+    }
+  }
+  /* Allocated per call so that plans can be shared between threads */
+  Complex * line = sp_malloc(sizeof(Complex)*(2*nmax+max_factor));
+  Complex * line_out = line+nmax;
+  Complex * scratch = line+2*nmax;
+  for(int h = 0;h<p->howmany;h++){
+    const Complex * src = &in[h*size];
+    Complex * dst = &out[h*size];
+    /* x lines are contiguous. Go through line as in and out might overlap. */
+    for(int l = 0;l<ny*nz;l++){
+      if(nx > 1){
+	memcpy(line,&src[l*nx],sizeof(Complex)*nx);
+	builtin_work(&p->axis[0],&dst[l*nx],line,1,1,p->axis[0].factors,nx,scratch);
+      }else if(dst != src){
+	dst[l] = src[l];
+      }
+    }
+    if(ny > 1){
+      for(int z = 0;z<nz;z++){
+	for(int x = 0;x<nx;x++){
+	  Complex * base = &dst[z*ny*nx+x];
+	  builtin_work(&p->axis[1],line_out,base,1,nx,p->axis[1].factors,ny,scratch);
+	  for(int y = 0;y<ny;y++){
+	    base[y*nx] = line_out[y];
+	  }
+	}
+      }
+    }
+    if(nz > 1){
+      for(int y = 0;y<ny;y++){
+	for(int x = 0;x<nx;x++){
+	  Complex * base = &dst[y*nx+x];
+	  builtin_work(&p->axis[2],line_out,base,1,nx*ny,p->axis[2].factors,nz,scratch);
+	  for(int z = 0;z<nz;z++){
+	    base[z*nx*ny] = line_out[z];
+	  }
+	}
+      }
+    }
+  }
+  sp_free(line);
+}
+
+static void builtin_execute_r2c(void * plan, const real * in, Complex * out){
+  BuiltinPlan * p = plan;
+  int nx = p->nx;
+  int hx = nx/2+1;
+  int nlines = p->ny*p->nz;
+  Complex * full = sp_malloc(sizeof(Complex)*nx*nlines);
+  for(int i = 0;i<nx*nlines;i++){
+    full[i] = sp_cinit(in[i],0);
+  }
+  builtin_execute(plan,full,full);
+  for(int l = 0;l<nlines;l++){
+    memcpy(&out[l*hx],&full[l*nx],sizeof(Complex)*hx);
+  }
+  sp_free(full);
+}
+
+static void builtin_execute_c2r(void * plan, Complex * in, real * out){
+  BuiltinPlan * p = plan;
+  int nx = p->nx;
+  int ny = p->ny;
+  int nz = p->nz;
+  int hx = nx/2+1;
+  Complex * full = sp_malloc(sizeof(Complex)*nx*ny*nz);
+  for(int z = 0;z<nz;z++){
+    for(int y = 0;y<ny;y++){
+      Complex * line = &full[(z*ny+y)*nx];
+      /* F(-k) = conj(F(k)) */
+      const Complex * mirror = &in[(((nz-z)%nz)*ny+(ny-y)%ny)*hx];
+      memcpy(line,&in[(z*ny+y)*hx],sizeof(Complex)*hx);
+      for(int x = hx;x<nx;x++){
+	line[x] = sp_cconj(mirror[nx-x]);
+      }
+    }
+  }
+  builtin_execute(plan,full,full);
+  for(int i = 0;i<nx*ny*nz;i++){
+    out[i] = sp_real(full[i]);
+  }
+  sp_free(full);
+}
+
+const FFTBackend fft_builtin_backend = {"builtin",builtin_plan,builtin_execute,builtin_execute_r2c,
+					builtin_execute_c2r,builtin_destroy};
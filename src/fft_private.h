@@ -0,0 +1,45 @@
+#ifndef _FFT_PRIVATE_H_
+#define _FFT_PRIVATE_H_
+
+#include "spimage.h"
+
+/* Kinds of transforms in the plan cache */
+enum{PlanC2C=0,PlanR2C,PlanC2R};
+
+typedef struct{
+  int type;
+  /* nx, ny and nz always refer to the real space array */
+  int nx;
+  int ny;
+  int nz;
+  /* number of contiguous arrays transformed together, 0 for a single one */
+  int howmany;
+  int sign;
+  int in_place;
+  int aligned;
+  int nthreads;
+  unsigned flags;
+  /* requested SpFFTBackend. Only complex to complex transforms can use
+     something else than FFTW, unless it is not built in. */
+  int backend;
+}PlanKey;
+
+/* An FFT implementation. plan() returns an opaque plan for the transform
+   described by key, or NULL on failure. execute() runs complex to complex
+   plans, execute_r2c() real to complex ones and execute_c2r() complex to
+   real ones, which may destroy their input. They must be safe to call
+   concurrently on the same plan with different arrays. destroy() is
+   always called with the planner lock held. */
+typedef struct{
+  const char * name;
+  void * (*plan)(const PlanKey * key);
+  void (*execute)(void * plan, const Complex * in, Complex * out);
+  void (*execute_r2c)(void * plan, const real * in, Complex * out);
+  void (*execute_c2r)(void * plan, Complex * in, real * out);
+  void (*destroy)(void * plan);
+}FFTBackend;
+
+/* Self contained mixed radix FFT, in fft_builtin.c */
+extern const FFTBackend fft_builtin_backend;
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "spimage.h"
+#include "filter_cache_private.h"
+#include "image_filter_private.h"
+
+/* Cache of filter transfer functions.
+
+   Entries are looked up by a linear search of a small table, like the
+   FFT plan cache, and the least recently used entry not in use is freed
+   when the total size goes above the capacity. Tables larger than the
+   capacity are built for each call and freed on release. A single mutex
+   protects the table. It is only held for the lookups and the
+   bookkeeping, never while the tables are built. */
+
+typedef struct{
+  int type;
+  int nx;
+  int ny;
+  int nz;
+  int half;
+  /* distances measured from center, otherwise from the top left corner
+     with wrap around */
+  int centered;
+  real center[3];
+  real param;
+}FilterKey;
+
+typedef struct{
+  FilterKey key;
+  /* the tables of the transfer function, or the spatial kernels */
+  void * data;
+  size_t bytes;
+  /* number of callers currently using the data */
+  int in_use;
+  /* value of the cache clock when the entry was last used */
+  long long last_used;
+}FilterCacheEntry;
+
+static FilterCacheEntry * filter_cache = NULL;
+static int filter_cache_entries = 0;
+static int filter_cache_allocated = 0;
+static size_t filter_cache_bytes = 0;
+/* 1 MiB, enough for hundreds of 3D transfer functions of 256^3 */
+static size_t filter_cache_capacity = 1024*1024;
+static long long filter_cache_clock = 0;
+static long long filter_cache_hits = 0;
+static long long filter_cache_misses = 0;
+static long long filter_cache_evictions = 0;
+
+#if defined(_WIN32)
+static SRWLOCK filter_cache_mutex = SRWLOCK_INIT;
+static void filter_cache_lock(){
+  AcquireSRWLockExclusive(&filter_cache_mutex);
+}
+static void filter_cache_unlock(){
+  ReleaseSRWLockExclusive(&filter_cache_mutex);
+}
+#else
+static pthread_mutex_t filter_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void filter_cache_lock(){
+  pthread_mutex_lock(&filter_cache_mutex);
+}
+static void filter_cache_unlock(){
+  pthread_mutex_unlock(&filter_cache_mutex);
+}
+#endif
+
+/* Fills table with f(d) for every index of an axis of size n, where d is
+   the distance used by key */
+static void filter_axis_table(const FilterKey * key, double * table, int n, int size, int axis){
+  for(int i = 0;i<n;i++){
+    double d;
+    if(key->centered){
+      d = i-key->center[axis];
+    }else{
+      d = MIN(i,size-i);
+    }
+    if(key->type == FilterGaussianBlur){
+      /* all axes are scaled by nx, as sp_gaussian_blur() does */
+      d /= key->nx;
+      table[i] = exp(-2.*M_PI*M_PI*key->param*key->param*d*d);
+    }else{
+      d /= key->param;
+      table[i] = exp(-7.*d*d);
+    }
+  }
+}
+
+static void filter_key_init(FilterKey * key, int type, int nx, int ny, int nz, int half, real param, const real * center){
+  /* keys are compared with memcmp */
+  memset(key,0,sizeof(FilterKey));
+  key->type = type;
+  key->nx = nx;
+  key->ny = ny;
+  key->nz = nz;
+  key->half = (half != 0);
+  key->param = param;
+  if(center){
+    key->centered = 1;
+    for(int i = 0;i<3;i++){
+      key->center[i] = center[i];
+    }
+  }
+}
+
+static void filter_transfer_build(const FilterKey * key, double * transfer){
+  int nx = key->nx;
+  int ny = key->ny;
+  int nz = key->nz;
+  int hx = key->half ? nx/2+1 : nx;
+  double * tx = transfer;
+  double * ty = tx+hx;
+  double * tz = ty+ny;
+  filter_axis_table(key,tx,hx,nx,0);
+  filter_axis_table(key,ty,ny,ny,1);
+  filter_axis_table(key,tz,nz,nz,2);
+  if(key->type == FilterGaussianBlur){
+    /* the normalization of the inverse transform */
+    double scale = 1.0/((double)nx*ny*nz);
+    for(int x = 0;x<hx;x++){
+      tx[x] *= scale;
+    }
+  }
+}
+
+size_t sp_filter_transfer_size(int nx, int ny, int nz, int half){
+  return (size_t)(half ? nx/2+1 : nx)+ny+nz;
+}
+
+void sp_filter_transfer_tables(int type, int nx, int ny, int nz, int half, real param, const real * center,
+			       double * transfer){
+  FilterKey key;
+  filter_key_init(&key,type,nx,ny,nz,half,param,center);
+  filter_transfer_build(&key,transfer);
+}
+
+void sp_filter_transfer_apply(const double * transfer, Complex * data, int nx, int ny, int nz, int half){
+  int hx = half ? nx/2+1 : nx;
+  const double * tx = transfer;
+  const double * ty = tx+hx;
+  const double * tz = ty+ny;
+  for(int z = 0;z<nz;z++){
+    for(int y = 0;y<ny;y++){
+      double tyz = ty[y]*tz[z];
+      Complex * line = &data[(z*ny+y)*hx];
+      for(int x = 0;x<hx;x++){
+	line[x] = sp_cscale(line[x],tx[x]*tyz);
+      }
+    }
+  }
+}
+
+/* Removes the least recently used entry which is not in use. Returns 0
+   if there was no such entry. Needs the lock. */
+static int filter_cache_evict(){
+  int lru = -1;
+  for(int i = 0;i<filter_cache_entries;i++){
+    if(filter_cache[i].in_use == 0 && (lru < 0 || filter_cache[i].last_used < filter_cache[lru].last_used)){
+      lru = i;
+    }
+  }
+  if(lru < 0){
+    return 0;
+  }
+  sp_free(filter_cache[lru].data);
+  filter_cache_bytes -= filter_cache[lru].bytes;
+  filter_cache[lru] = filter_cache[filter_cache_entries-1];
+  filter_cache_entries--;
+  filter_cache_evictions++;
+  return 1;
+}
+
+/* Returns the entry of key and marks it as in use, or NULL. Needs the lock. */
+static FilterCacheEntry * filter_cache_lookup(const FilterKey * key){
+  for(int i = 0;i<filter_cache_entries;i++){
+    if(memcmp(&filter_cache[i].key,key,sizeof(FilterKey)) == 0){
+      filter_cache[i].in_use++;
+      filter_cache[i].last_used = ++filter_cache_clock;
+      return &filter_cache[i];
+    }
+  }
+  return NULL;
+}
+
+/* Returns the data of key from the cache, building it if needed */
+static const void * filter_cache_acquire(const FilterKey * key){
+  filter_cache_lock();
+  FilterCacheEntry * e = filter_cache_lookup(key);
+  if(e){
+    filter_cache_hits++;
+    filter_cache_unlock();
+    return e->data;
+  }
+  filter_cache_misses++;
+  filter_cache_unlock();
+
+  size_t bytes;
+  void * data;
+  if(key->type == FilterGaussianBlurKernels){
+    bytes = sizeof(real)*sp_gaussian_blur_kernels_size(key->nx,key->ny,key->nz,key->param);
+    data = sp_malloc(bytes);
+    sp_gaussian_blur_kernels(key->nx,key->ny,key->nz,key->param,data);
+  }else{
+    bytes = sizeof(double)*sp_filter_transfer_size(key->nx,key->ny,key->nz,key->half);
+    data = sp_malloc(bytes);
+    filter_transfer_build(key,data);
+  }
+  filter_cache_lock();
+  /* Someone else might have built it in the meantime */
+  e = filter_cache_lookup(key);
+  if(e){
+    filter_cache_unlock();
+    sp_free(data);
+    return e->data;
+  }
+  if(bytes <= filter_cache_capacity){
+    while(filter_cache_bytes+bytes > filter_cache_capacity && filter_cache_evict());
+  }
+  if(filter_cache_bytes+bytes <= filter_cache_capacity){
+    if(filter_cache_entries == filter_cache_allocated){
+      filter_cache_allocated = filter_cache_allocated ? 2*filter_cache_allocated : 8;
+      filter_cache = sp_realloc(filter_cache,sizeof(FilterCacheEntry)*filter_cache_allocated);
+    }
+    e = &filter_cache[filter_cache_entries++];
+    e->key = *key;
+    e->data = data;
+    e->bytes = bytes;
+    e->in_use = 1;
+    e->last_used = ++filter_cache_clock;
+    filter_cache_bytes += bytes;
+  }
+  filter_cache_unlock();
+  return data;
+}
+
+static void filter_cache_release(const void * data){
+  filter_cache_lock();
+  /* entries move around when others are evicted */
+  for(int i = 0;i<filter_cache_entries;i++){
+    if(filter_cache[i].data == data){
+      filter_cache[i].in_use--;
+      filter_cache_unlock();
+      return;
+    }
+  }
+  filter_cache_unlock();
+  /* it did not fit in the cache */
+  sp_free((void *)data);
+}
+
+const double * sp_filter_transfer_acquire(int type, int nx, int ny, int nz, int half, real param, const real * center){
+  FilterKey key;
+  filter_key_init(&key,type,nx,ny,nz,half,param,center);
+  return filter_cache_acquire(&key);
+}
+
+void sp_filter_transfer_release(const double * transfer){
+  filter_cache_release(transfer);
+}
+
+const real * sp_filter_kernels_acquire(int nx, int ny, int nz, real radius){
+  FilterKey key;
+  filter_key_init(&key,FilterGaussianBlurKernels,nx,ny,nz,0,radius,NULL);
+  return filter_cache_acquire(&key);
+}
+
+void sp_filter_kernels_release(const real * kernels){
+  filter_cache_release(kernels);
+}
+
+void sp_filter_cache_stats(SpFilterCacheStats * stats){
+  filter_cache_lock();
+  stats->hits = filter_cache_hits;
+  stats->misses = filter_cache_misses;
+  stats->evictions = filter_cache_evictions;
+  stats->entries = filter_cache_entries;
+  stats->bytes = filter_cache_bytes;
+  stats->capacity = filter_cache_capacity;
+  filter_cache_unlock();
+}
+
+void sp_filter_cache_set_capacity(size_t bytes){
+  filter_cache_lock();
+  while(filter_cache_bytes > bytes && filter_cache_evict());
+  filter_cache_capacity = bytes;
+  filter_cache_unlock();
+}
+
+void sp_filter_cache_clear(){
+  filter_cache_lock();
+  while(filter_cache_entries && filter_cache_evict());
+  filter_cache_hits = 0;
+  filter_cache_misses = 0;
+  filter_cache_evictions = 0;
+  filter_cache_unlock();
+}
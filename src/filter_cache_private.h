@@ -0,0 +1,51 @@
+#ifndef _FILTER_CACHE_PRIVATE_H_
+#define _FILTER_CACHE_PRIVATE_H_
+
+#include "spimage.h"
+
+/* Transfer functions of the Fourier space filters.
+
+   A transfer function is the real array, the size of a spectrum, which
+   the filters multiply pixel by pixel. The gaussians are separable, so
+   they are stored as one table per axis, nx (or nx/2+1 for a half
+   spectrum), ny and nz doubles one after the other, and the value of
+   pixel (x,y,z) is tx[x]*ty[y]*tz[z]. That is a few KiB even for large
+   volumes and costs one exponential per axis index to build. The tables
+   are kept in a cache keyed by everything they depend on, so a filter
+   applied again with the same parameters only costs the multiply. The
+   cache also keeps the kernels of the spatial gaussian blur. */
+
+enum{
+  /* exp(-2*pi^2*radius^2*d^2/nx^2)/(nx*ny*nz), with d the distance to
+     the top left corner with wrap around, as in sp_gaussian_blur() */
+  FilterGaussianBlur=0,
+  /* exp(-7*d^2/radius^2), with d the distance to center or to the top
+     left corner with wrap around when center is NULL, as in
+     sp_gaussian_filter() */
+  FilterGaussianWindow,
+  /* The spatial kernels of sp_gaussian_blur() with radius param, from
+     sp_gaussian_blur_kernels() */
+  FilterGaussianBlurKernels
+};
+
+/* Number of doubles in the tables of the transfer function of a nx*ny*nz
+   image. With half set they only cover the nx/2+1 first columns, as the
+   half spectrum of a real to complex transform. */
+size_t sp_filter_transfer_size(int nx, int ny, int nz, int half);
+/* Fills transfer with the tables of the filter type with parameter param,
+   without going through the cache */
+void sp_filter_transfer_tables(int type, int nx, int ny, int nz, int half, real param, const real * center,
+			       double * transfer);
+/* Returns the tables of the filter type with parameter param from the
+   cache. They must be handed back with sp_filter_transfer_release() and
+   are never changed or freed while in use. */
+const double * sp_filter_transfer_acquire(int type, int nx, int ny, int nz, int half, real param, const real * center);
+void sp_filter_transfer_release(const double * transfer);
+/* Multiplies data, a spectrum of a nx*ny*nz image, by transfer */
+void sp_filter_transfer_apply(const double * transfer, Complex * data, int nx, int ny, int nz, int half);
+/* Returns the spatial kernels of the gaussian blur of an nx*ny*nz image
+   from the cache, to be handed back with sp_filter_kernels_release() */
+const real * sp_filter_kernels_acquire(int nx, int ny, int nz, real radius);
+void sp_filter_kernels_release(const real * kernels);
+
+#endif
@@ -2,7 +2,14 @@
 #include <dmalloc.h>
 #endif
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #include "spimage.h"
+#include "filter_cache_private.h"
+#include "image_filter_private.h"
 
 
 
@@ -77,13 +84,374 @@ Image * sp_gaussian_blur_old(Image * in, real radius){
   return res;
 }
 
+/* Half width of the spatial kernels in standard deviations, as in
+   sp_gaussian_blur_old() */
+#define SPATIAL_BLUR_WIDTH 3
+/* Number of reals of a row convolved at a time */
+#define SPATIAL_BLUR_BLOCK 1024
+/* Side of the volume the costs are calibrated on, and the radius used */
+#define SPATIAL_BLUR_CALIBRATION_SIZE 32
+#define SPATIAL_BLUR_CALIBRATION_RADIUS 2
+/* Number of timed runs of each path in the calibration, after an
+   untimed one. The fastest run is kept. */
+#define SPATIAL_BLUR_CALIBRATION_RUNS 3
+
+/* Standard deviation of the gaussian of an axis of size n. The
+   transfer function has the same width in frequency along every axis,
+   relative to the x size. */
+static double spatial_blur_sigma(int n, int nx, real radius){
+  return radius*(double)n/nx;
+}
+
+/* Half width of the kernel of an axis of size n. At n/2 the kernel
+   covers the whole axis. */
+static int spatial_blur_half_width(int n, int nx, real radius){
+  if(n == 1){
+    return 0;
+  }
+  double w = spatial_blur_sigma(n,nx,radius)*SPATIAL_BLUR_WIDTH;
+  return MIN((int)ceil(w),n/2);
+}
+
+/* Cost of a complex to complex and of a real to complex FFT pair, with
+   the transfer function in between, per pixel and per log2 of the
+   number of pixels, in units of one tap of the spatial convolutions on
+   one real. Negative until measured by spatial_blur_calibrate(). See
+   sp_gaussian_blur_set_fft_cost(). Protected by the mutex below. */
+static double spatial_blur_fft_cost = -1;
+static double spatial_blur_rfft_cost = -1;
+
+#if defined(_WIN32)
+static SRWLOCK spatial_blur_mutex = SRWLOCK_INIT;
+static void spatial_blur_lock(){
+  AcquireSRWLockExclusive(&spatial_blur_mutex);
+}
+static void spatial_blur_unlock(){
+  ReleaseSRWLockExclusive(&spatial_blur_mutex);
+}
+#else
+static pthread_mutex_t spatial_blur_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void spatial_blur_lock(){
+  pthread_mutex_lock(&spatial_blur_mutex);
+}
+static void spatial_blur_unlock(){
+  pthread_mutex_unlock(&spatial_blur_mutex);
+}
+#endif
+
+/* Fills data with a fixed pattern of non zero values */
+static void spatial_blur_calibration_fill(real * data, size_t n){
+  for(size_t i = 0;i<n;i++){
+    data[i] = (real)(i%7)-3;
+  }
+}
+
+/* Times both FFT paths and the spatial convolutions of a complex
+   volume and sets the costs from them. Needs the lock. */
+static void spatial_blur_calibrate(){
+  const int n = SPATIAL_BLUR_CALIBRATION_SIZE;
+  const int hx = n/2+1;
+  const int size = n*n*n;
+  const real radius = SPATIAL_BLUR_CALIBRATION_RADIUS;
+  const size_t ntaps = sp_gaussian_blur_kernels_size(n,n,n,radius);
+  Complex * data = sp_malloc(sizeof(Complex)*size);
+  Complex * half = sp_malloc(sizeof(Complex)*hx*n*n);
+  real * values = sp_malloc(sizeof(real)*size);
+  real * kernels = sp_malloc(sizeof(real)*ntaps);
+  real * scratch = sp_malloc(sizeof(real)*sp_gaussian_blur_spatial_scratch(2,n,n,n,radius));
+  double * tables = sp_malloc(sizeof(double)*sp_filter_transfer_size(n,n,n,0));
+  double * half_tables = sp_malloc(sizeof(double)*sp_filter_transfer_size(n,n,n,1));
+  long long best[3] = {-1,-1,-1};
+  sp_gaussian_blur_kernels(n,n,n,radius,kernels);
+  sp_filter_transfer_tables(FilterGaussianBlur,n,n,n,0,radius,NULL,tables);
+  sp_filter_transfer_tables(FilterGaussianBlur,n,n,n,1,radius,NULL,half_tables);
+  for(int run = 0;run<=SPATIAL_BLUR_CALIBRATION_RUNS;run++){
+    long long t[3];
+    /* Relies on Complex being two contiguous reals */
+    spatial_blur_calibration_fill((real *)data,2*size);
+    t[0] = sp_gettime();
+    sp_gaussian_blur_spatial((real *)data,2,n,n,n,radius,kernels,scratch);
+    t[0] = sp_gettime()-t[0];
+    spatial_blur_calibration_fill((real *)data,2*size);
+    t[1] = sp_gettime();
+    sp_fft_stack(data,data,n,n,n,1);
+    sp_filter_transfer_apply(tables,data,n,n,n,0);
+    sp_ifft_stack(data,data,n,n,n,1);
+    t[1] = sp_gettime()-t[1];
+    spatial_blur_calibration_fill(values,size);
+    t[2] = sp_gettime();
+    sp_rfft_array(values,half,n,n,n,0);
+    sp_filter_transfer_apply(half_tables,half,n,n,n,1);
+    sp_irfft_array(half,values,n,n,n,0);
+    t[2] = sp_gettime()-t[2];
+    for(int i = 0;run > 0 && i<3;i++){
+      if(best[i] < 0 || t[i] < best[i]){
+	best[i] = t[i];
+      }
+    }
+  }
+  /* The clock counts microseconds */
+  double tap = MAX(best[0],1)/(2.0*size*ntaps);
+  double pixel_log = size*log2((double)size);
+  spatial_blur_fft_cost = MAX(best[1],1)/pixel_log/tap;
+  spatial_blur_rfft_cost = MAX(best[2],1)/pixel_log/tap;
+  sp_free(half_tables);
+  sp_free(tables);
+  sp_free(scratch);
+  sp_free(kernels);
+  sp_free(values);
+  sp_free(half);
+  sp_free(data);
+}
+
+/* Returns the cost of the complex to complex or of the real to complex
+   FFT path, calibrating them first if needed */
+static double spatial_blur_cost(int real_fft){
+  double ret;
+  spatial_blur_lock();
+  if(spatial_blur_fft_cost < 0){
+    spatial_blur_calibrate();
+  }
+  ret = real_fft ? spatial_blur_rfft_cost : spatial_blur_fft_cost;
+  spatial_blur_unlock();
+  return ret;
+}
+
+void sp_gaussian_blur_set_fft_cost(real cost){
+  spatial_blur_lock();
+  if(cost < 0){
+    spatial_blur_fft_cost = -1;
+    spatial_blur_rfft_cost = -1;
+  }else{
+    spatial_blur_fft_cost = cost;
+    spatial_blur_rfft_cost = cost/2;
+  }
+  spatial_blur_unlock();
+}
+
+real sp_gaussian_blur_fft_cost(){
+  return spatial_blur_cost(0);
+}
+
+/* Fills kernel[w+m], for m in [-w,w], with a gaussian of standard
+   deviation sigma sampled on an axis of size n. The tails beyond the
+   axis are wrapped around, as the blur is periodic, and the kernel is
+   normalized so that it keeps the mean of the image. */
+static void spatial_blur_kernel(real * kernel, int w, int n, double sigma){
+  /* Number of times the cut gaussian goes around the axis */
+  const int wraps = ceil(sigma*SPATIAL_BLUR_WIDTH/n)+1;
+  double sum = 0;
+  for(int m = 0;m<=w;m++){
+    double g = 0;
+    for(int j = -wraps;j<=wraps;j++){
+      double d = m+(double)j*n;
+      g += sigma > 0 ? exp(-d*d/(2*sigma*sigma)) : (d == 0);
+    }
+    kernel[w+m] = g;
+    kernel[w-m] = g;
+  }
+  if(w > 0 && 2*w == n){
+    /* -w and w are the same pixel when the kernel wraps around */
+    kernel[0] /= 2;
+    kernel[2*w] /= 2;
+  }
+  for(int m = 0;m<=2*w;m++){
+    sum += kernel[m];
+  }
+  for(int m = 0;m<=2*w;m++){
+    kernel[m] /= sum;
+  }
+}
+
+/* Convolves periodically each of the outer blocks of n rows of inner
+   reals of in with kernel, into out. The kernel is symmetric, so the
+   two rows at the same distance are added before the multiplication.
+   The inner loops always run over contiguous memory so that they can be
+   vectorized. */
+static void spatial_blur_axis(const real * in, real * out, int outer, int n, int inner,
+			      const real * kernel, int w, real * line){
+  for(int o = 0;o<outer;o++){
+    const real * src = &in[(size_t)o*n*inner];
+    real * dst = &out[(size_t)o*n*inner];
+    if(inner <= 2){
+      /* Rows of a pixel, pad the whole line periodically instead,
+	 with the last w pixels before it and the first w after it */
+      memcpy(line,&src[(n-w)*inner],sizeof(real)*w*inner);
+      memcpy(&line[w*inner],src,sizeof(real)*n*inner);
+      memcpy(&line[(n+w)*inner],src,sizeof(real)*w*inner);
+      const real * center = &line[w*inner];
+      for(int t = 0;t<n*inner;t++){
+	dst[t] = kernel[w]*center[t];
+      }
+      for(int m = 1;m<=w;m++){
+	const real k = kernel[w+m];
+	const real * before = &center[-m*inner];
+	const real * after = &center[m*inner];
+	for(int t = 0;t<n*inner;t++){
+	  dst[t] += k*(before[t]+after[t]);
+	}
+      }
+    }else{
+      /* Go through the rows in blocks which stay in cache for all taps */
+      for(int t0 = 0;t0<inner;t0 += SPATIAL_BLUR_BLOCK){
+	const int t1 = MIN(inner,t0+SPATIAL_BLUR_BLOCK);
+	for(int i = 0;i<n;i++){
+	  real * d = &dst[(size_t)i*inner];
+	  const real * c = &src[(size_t)i*inner];
+	  for(int t = t0;t<t1;t++){
+	    d[t] = kernel[w]*c[t];
+	  }
+	  for(int m = 1;m<=w;m++){
+	    const real k = kernel[w+m];
+	    const real * before = &src[(size_t)(((i-m)%n+n)%n)*inner];
+	    const real * after = &src[(size_t)((i+m)%n)*inner];
+	    for(int t = t0;t<t1;t++){
+	      d[t] += k*(before[t]+after[t]);
+	    }
+	  }
+	}
+      }
+    }
+  }
+}
+
+int sp_gaussian_blur_spatial_is_faster(int nx, int ny, int nz, real radius, int ncomp, int real_fft){
+  double spatial = ncomp*(double)sp_gaussian_blur_kernels_size(nx,ny,nz,radius);
+  return spatial < spatial_blur_cost(real_fft)*log2((double)nx*ny*nz);
+}
+
+size_t sp_gaussian_blur_kernels_size(int nx, int ny, int nz, real radius){
+  int n[3] = {nx,ny,nz};
+  size_t size = 0;
+  for(int a = 0;a<3;a++){
+    if(n[a] > 1){
+      size += 2*spatial_blur_half_width(n[a],nx,radius)+1;
+    }
+  }
+  return size;
+}
+
+void sp_gaussian_blur_kernels(int nx, int ny, int nz, real radius, real * kernels){
+  int n[3] = {nx,ny,nz};
+  for(int a = 0;a<3;a++){
+    if(n[a] > 1){
+      int w = spatial_blur_half_width(n[a],nx,radius);
+      spatial_blur_kernel(kernels,w,n[a],spatial_blur_sigma(n[a],nx,radius));
+      kernels += 2*w+1;
+    }
+  }
+}
+
+/* Returns the number of reals of the padded line and sets wmax to the
+   largest half width. The first axis longer than 1 is padded, which is
+   not always x. */
+static size_t spatial_blur_line_size(int ncomp, const int n[3], real radius, int * wmax){
+  int nmax = 0;
+  *wmax = 0;
+  for(int a = 0;a<3;a++){
+    nmax = MAX(nmax,n[a]);
+    *wmax = MAX(*wmax,spatial_blur_half_width(n[a],n[0],radius));
+  }
+  return (size_t)ncomp*(nmax+2*(*wmax));
+}
+
+size_t sp_gaussian_blur_spatial_scratch(int ncomp, int nx, int ny, int nz, real radius){
+  int n[3] = {nx,ny,nz};
+  int wmax;
+  size_t line = spatial_blur_line_size(ncomp,n,radius,&wmax);
+  /* the intermediate image and the padded line */
+  return (size_t)ncomp*nx*ny*nz+line;
+}
+
+void sp_gaussian_blur_spatial(real * data, int ncomp, int nx, int ny, int nz, real radius,
+			      const real * kernels, real * scratch){
+  int n[3] = {nx,ny,nz};
+  size_t size = (size_t)ncomp*nx*ny*nz;
+  real * src = data;
+  real * dst = scratch;
+  real * line = scratch+size;
+  int inner = ncomp;
+  for(int a = 0;a<3;a++){
+    if(n[a] > 1){
+      int w = spatial_blur_half_width(n[a],nx,radius);
+      spatial_blur_axis(src,dst,size/((size_t)n[a]*inner),n[a],inner,kernels,w,line);
+      kernels += 2*w+1;
+      real * t = src;
+      src = dst;
+      dst = t;
+    }
+    inner *= n[a];
+  }
+  if(src != data){
+    memcpy(data,src,sizeof(real)*size);
+  }
+}
+
+/* Blurs in with the spatial convolutions, with the same flags as the
+   FFT paths */
+static Image * gaussian_blur_spatial(Image * in, real radius){
+  int nx = sp_image_x(in);
+  int ny = sp_image_y(in);
+  int nz = sp_image_z(in);
+  int size = sp_image_size(in);
+  int ncomp = in->phased ? 2 : 1;
+  Image * ret = sp_image_duplicate(in,SP_COPY_DATA|SP_COPY_DETECTOR);
+  real * scratch = sp_malloc(sizeof(real)*(sp_gaussian_blur_spatial_scratch(ncomp,nx,ny,nz,radius)+(ncomp == 1 ? size : 0)));
+  const real * kernels = sp_filter_kernels_acquire(nx,ny,nz,radius);
+  if(ncomp == 2){
+    /* Relies on Complex being two contiguous reals */
+    sp_gaussian_blur_spatial((real *)ret->image->data,2,nx,ny,nz,radius,kernels,scratch);
+  }else{
+    real * values = scratch;
+    for(int i = 0;i<size;i++){
+      values[i] = sp_real(ret->image->data[i]);
+    }
+    sp_gaussian_blur_spatial(values,1,nx,ny,nz,radius,kernels,scratch+size);
+    for(int i = 0;i<size;i++){
+      ret->image->data[i] = sp_cinit(values[i],0);
+    }
+  }
+  sp_filter_kernels_release(kernels);
+  sp_free(scratch);
+  ret->phased = 1;
+  ret->shifted = 0;
+  return ret;
+}
+
+/* Blurs the real image in using only half of the spectrum */
+static Image * gaussian_blur_real(Image * in, real radius){
+  int nx = sp_image_x(in);
+  int ny = sp_image_y(in);
+  int nz = sp_image_z(in);
+  Image * fourier_image = sp_image_rfft(in);
+  const double * transfer = sp_filter_transfer_acquire(FilterGaussianBlur,nx,ny,nz,1,radius,NULL);
+  sp_filter_transfer_apply(transfer,fourier_image->image->data,nx,ny,nz,1);
+  sp_filter_transfer_release(transfer);
+  Image *ret = sp_image_irfft(fourier_image,nx);
+  sp_image_free(fourier_image);
+  /* Keep the same flags as the complex path */
+  ret->phased = 1;
+  return ret;
+}
+
+int sp_gaussian_blur_is_spatial(const Image * in, real radius){
+  /* Phased images are blurred as complex data with complex FFTs, the
+     others as real data with real FFTs */
+  return sp_gaussian_blur_spatial_is_faster(sp_image_x(in),sp_image_y(in),sp_image_z(in),radius,
+					    in->phased ? 2 : 1,!in->phased);
+}
+
 Image * sp_gaussian_blur(Image * in, real radius){
-  Image *fourier_image = sp_image_fft(in);
-  real coordinate_rad;
-  for (int i = 0; i < sp_image_size(fourier_image); i++) {
-    coordinate_rad = sp_image_dist(fourier_image, i, SP_TO_TOP_LEFT) / ((real)sp_image_x(fourier_image));
-    fourier_image->image->data[i] = sp_cmul(fourier_image->image->data[i], sp_cinit(exp(-2.*pow(M_PI,2)*pow(coordinate_rad,2)*pow(radius,2))/((real) sp_image_size(fourier_image)), 0.));
+  if(sp_gaussian_blur_is_spatial(in,radius)){
+    return gaussian_blur_spatial(in,radius);
+  }
+  if(!in->phased){
+    return gaussian_blur_real(in,radius);
   }
+  Image *fourier_image = sp_image_fft(in);
+  const double * transfer = sp_filter_transfer_acquire(FilterGaussianBlur,sp_image_x(in),sp_image_y(in),sp_image_z(in),0,radius,NULL);
+  sp_filter_transfer_apply(transfer,fourier_image->image->data,sp_image_x(in),sp_image_y(in),sp_image_z(in),0);
+  sp_filter_transfer_release(transfer);
 
   Image *ret = sp_image_ifft(fourier_image);
   return ret;
@@ -212,20 +580,16 @@ Image * sp_low_pass_gaussian_filter(Image * in, int edge_size){
 /* Filter using a centered gaussian window of side edge_size */
 Image * sp_gaussian_filter(Image * in, real radius,int in_place){
   Image * res;
-  const real scaling_factor = 7;
-  int i;
-  real scaling;
   if(in_place){
     res = in;
   }else{
     res = sp_image_duplicate(in,SP_COPY_DATA|SP_COPY_MASK);
   }
   /* the scaling of 7 makes sure the pattern is scaled by 0.0009 at the edge */
-
-  for(i = 0;i<sp_image_size(in);i++){
-    scaling = (sp_image_dist(in,i,SP_TO_CENTER)/(radius))*(sp_image_dist(in,i,SP_TO_CENTER)/(radius));
-    res->image->data[i] = sp_cscale(res->image->data[i],exp(-scaling*scaling_factor));
-  }
+  const double * transfer = sp_filter_transfer_acquire(FilterGaussianWindow,sp_image_x(in),sp_image_y(in),sp_image_z(in),0,radius,
+						       in->shifted ? NULL : in->detector->image_center);
+  sp_filter_transfer_apply(transfer,res->image->data,sp_image_x(in),sp_image_y(in),sp_image_z(in),0);
+  sp_filter_transfer_release(transfer);
   return res;
 }
 
@@ -0,0 +1,35 @@
+#ifndef _IMAGE_FILTER_PRIVATE_H_
+#define _IMAGE_FILTER_PRIVATE_H_
+
+#include "spimage.h"
+
+/* Spatial gaussian blur.
+
+   The transfer function of sp_gaussian_blur() is separable, so the same
+   blur is also a periodic convolution with one gaussian kernel per axis.
+   For small radii these kernels are short and the convolutions are
+   cheaper than the FFT pair. The kernels are sampled gaussians, wrapped
+   around the axis, cut at 3 standard deviations like the ones of
+   sp_gaussian_blur_old() and normalized. The cut leaves out 0.3% of
+   the weight, so the result differs from the FFT blur by up to about
+   that fraction of the range of the image, which does not matter for
+   support updates. The kernels of all the axes are stored one after the
+   other, leaving out the axes of size 1. */
+
+/* Returns 1 if the spatial blur of an nx*ny*nz image with ncomp reals
+   per pixel is expected to be faster than the FFT one, which uses real
+   to complex transforms if real_fft is set and complex ones otherwise.
+   The costs are measured the first time this is called. */
+int sp_gaussian_blur_spatial_is_faster(int nx, int ny, int nz, real radius, int ncomp, int real_fft);
+/* Number of reals of the kernels of an nx*ny*nz image */
+size_t sp_gaussian_blur_kernels_size(int nx, int ny, int nz, real radius);
+/* Fills kernels with the kernels of an nx*ny*nz image */
+void sp_gaussian_blur_kernels(int nx, int ny, int nz, real radius, real * kernels);
+/* Number of reals of scratch memory sp_gaussian_blur_spatial() needs */
+size_t sp_gaussian_blur_spatial_scratch(int ncomp, int nx, int ny, int nz, real radius);
+/* Blurs data in place with kernels. data holds ncomp reals per pixel, 1
+   for real images and 2 for complex ones. */
+void sp_gaussian_blur_spatial(real * data, int ncomp, int nx, int ny, int nz, real radius,
+			      const real * kernels, real * scratch);
+
+#endif
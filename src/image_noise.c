@@ -16,15 +16,36 @@ Image * sp_image_noise_estimate(Image * intensities,Image * autocorrelation_supp
   Image * a = sp_image_duplicate(intensities,SP_COPY_ALL);
   sp_image_to_intensities(a);
   sp_image_rephase(a,SP_ZERO_PHASE);
-  Image * ac = sp_image_ifft(a);
-  sp_image_mul_elements(ac,autocorrelation_support);
-  Image * filtered_intensities = sp_image_fft(ac);
-  sp_image_scale(filtered_intensities,1.0/sp_image_size(ac));
+  /* The intensities are real so we can work on half of the spectrum.
+     With R = rfft(a) the autocorrelation is ifft(a) = conj(R) and only
+     the real part of fft(conj(R)*S) is used. That is the fft of its
+     Hermitian part h = conj(R)*(S(k)+conj(S(-k)))/2, which is the
+     c2r transform of conj(h). */
+  Image * ac = sp_image_rfft(a);
+  int nx = sp_image_x(a);
+  int ny = sp_image_y(a);
+  int nz = sp_image_z(a);
+  int hx = sp_image_x(ac);
+  for(int z = 0;z<nz;z++){
+    for(int y = 0;y<ny;y++){
+      for(int x = 0;x<hx;x++){
+	Complex s = autocorrelation_support->image->data[(z*ny+y)*nx+x];
+	Complex s_mirror = autocorrelation_support->image->data[(((nz-z)%nz)*ny+(ny-y)%ny)*nx+(nx-x)%nx];
+	Complex h = sp_cscale(sp_cadd(sp_cconj(s),s_mirror),0.5);
+	ac->image->data[(z*ny+y)*hx+x] = sp_cmul(ac->image->data[(z*ny+y)*hx+x],h);
+      }
+    }
+  }
+  Image * filtered_intensities = sp_image_irfft(ac,nx);
+  sp_image_scale(filtered_intensities,1.0/sp_image_size(filtered_intensities));
   Image * std_dev = sp_image_alloc(sp_image_x(a),sp_image_y(a),sp_image_z(a));
   real arbitrary_constant = 1;
   for(int i = 0;i<sp_image_size(a);i++){
     /* Here lies a problem. The standard deviation is probably related to this difference, but I have no idea by what constant */
     sp_real(std_dev->image->data[i]) = arbitrary_constant*sp_real(filtered_intensities->image->data[i]) - sp_real(a->image->data[i]);
   }
+  sp_image_free(ac);
+  sp_image_free(filtered_intensities);
+  sp_image_free(a);
   return std_dev;
 }
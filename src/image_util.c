@@ -149,7 +149,14 @@ Image * sp_image_patterson(Image * a){
   if(b->scaled){
     sp_c3matrix_mul_elements(b->image,b->image);
   }
-  c = sp_image_fft(b);
+  if(!b->phased){
+    /* Real intensities only need half of the transform */
+    d = sp_image_rfft(b);
+    c = sp_image_rfft_expand(d,sp_image_x(b));
+    sp_image_free(d);
+  }else{
+    c = sp_image_fft(b);
+  }
 
   sp_image_free(b);
   d = sp_image_shift(c);
@@ -1310,6 +1317,49 @@ Image * _sp_image_alloc(int x, int y, int z,const char * file, int line){
 
 */
 
+/* Zero pads a and b to x,y,z and transforms them. Without padding both
+   go through one batched fft, otherwise the padding is pruned. */
+static void fft_padded_pair(Image * a, Image * b, int x, int y, int z, Image ** a_ft, Image ** b_ft){
+  if(sp_image_x(a) == x && sp_image_y(a) == y && sp_image_z(a) == z &&
+     sp_image_x(b) == x && sp_image_y(b) == y && sp_image_z(b) == z){
+    Image * pair[2] = {a,b};
+    Image ** ft = sp_image_fft_many(pair,2);
+    *a_ft = ft[0];
+    *b_ft = ft[1];
+    sp_free(ft);
+    return;
+  }
+  *a_ft = sp_image_fft_padded(a,x,y,z);
+  *b_ft = sp_image_fft_padded(b,x,y,z);
+}
+
+/* Cross correlation of two real images using only half of the spectrum */
+static Image * cross_correlate_real(Image * a, Image * b, int x, int y, int z){
+  Image * a_ft;
+  Image * b_ft;
+  Image * tmp;
+  Image * res;
+  tmp = zero_pad_image(a,x,y,z,1);
+  a_ft = sp_image_rfft(tmp);
+  sp_image_free(tmp);
+
+  tmp = zero_pad_image(b,x,y,z,1);
+  b_ft = sp_image_rfft(tmp);
+  sp_image_free(tmp);
+
+  /* Using the Convolution Theorem */
+  for(int i = 0;i<sp_image_size(a_ft);i++){
+    a_ft->image->data[i] = sp_cmul(a_ft->image->data[i],sp_cconj(b_ft->image->data[i]));
+  }
+  sp_image_free(b_ft);
+  res = sp_image_irfft(a_ft,x);
+  sp_image_free(a_ft);
+  sp_image_scale(res,1.0/sp_image_size(res));
+  /* Keep the same flags as the complex path */
+  res->phased = 1;
+  return res;
+}
+
 Image * sp_image_cross_correlate(Image * a, Image * b, int * size){
   int x;
   int y;
@@ -1337,13 +1387,11 @@ Image * sp_image_cross_correlate(Image * a, Image * b, int * size){
     z = sp_c3matrix_z(a->image);
   }
 
-  tmp = zero_pad_image(a,x,y,z,1);
-  a_ft = sp_image_fft(tmp);
-  sp_image_free(tmp);
+  if(!a->phased && !b->phased){
+    return cross_correlate_real(a,b,x,y,z);
+  }
 
-  tmp = zero_pad_image(b,x,y,z,1);
-  b_ft = sp_image_fft(tmp);
-  sp_image_free(tmp);
+  fft_padded_pair(a,b,x,y,z,&a_ft,&b_ft);
 
   tmp = sp_image_duplicate(a_ft,SP_COPY_DETECTOR);
   tmp->shifted = 1;
@@ -1410,22 +1458,10 @@ Image * sp_image_convolute_fractional(Image * a, Image * b, int * size,int preci
     z = sp_c3matrix_z(a->image);
   }
 
-  tmp = zero_pad_image(a,x,y,z,1);
-  a_ft = sp_image_fft(tmp);
-  sp_image_free(tmp);
-  tmp = zero_pad_image(a_ft,x*precision,y*precision,z*precision_z,1);
-  sp_image_free(a_ft);
-  a_ft = tmp;
-  
-
-  tmp = zero_pad_image(b,x,y,z,1);
-  b_ft = sp_image_fft(tmp);
-  sp_image_free(tmp);
-  tmp = zero_pad_image(b_ft,x*precision,y*precision,z*precision_z,1);
-  sp_image_free(b_ft);
-  b_ft = tmp;
-
+  fft_padded_pair(a,b,x,y,z,&a_ft,&b_ft);
 
+  /* The product of the padded spectra is the padded product, so
+     multiply before padding and let the backtransform prune the padding */
   tmp = sp_image_duplicate(a_ft,SP_COPY_DETECTOR);
   tmp->shifted = 1;
   sp_image_rephase(tmp,SP_ZERO_PHASE);
@@ -1442,7 +1478,7 @@ Image * sp_image_convolute_fractional(Image * a, Image * b, int * size,int preci
   sp_image_free(a_ft);
   sp_image_free(b_ft);
   /* Backtransform */
-  res = sp_image_ifft(tmp);
+  res = sp_image_ifft_padded(tmp,x*precision,y*precision,z*precision_z);
   sp_image_free(tmp);
 
   /* should be all real */
@@ -1506,16 +1542,7 @@ Image * sp_image_convolute(Image * a, Image * b, int * size){
   y = sp_max(sp_image_y(a),sp_image_y(b));
   z = sp_max(sp_image_z(a),sp_image_z(b));
 
-  tmp = zero_pad_image(a,x,y,z,1);
-
-/*  sp_image_dephase(tmp);*/
-  a_ft = sp_image_fft(tmp);
-  sp_image_free(tmp);
-
-  tmp = zero_pad_image(b,x,y,z,1);
-/*  sp_image_dephase(tmp);*/
-  b_ft = sp_image_fft(tmp);
-  sp_image_free(tmp);
+  fft_padded_pair(a,b,x,y,z,&a_ft,&b_ft);
 
   tmp = sp_image_duplicate(a_ft,SP_COPY_DETECTOR);
   tmp->shifted = 1;
@@ -1911,9 +1938,8 @@ Image * fourier_rescale(Image * img, int new_x, int new_y, int new_z){
     perror("fourier_scale doesn't downscale");
     abort();
   }
-  tmp = zero_pad_image(res,new_x,new_y,new_z,1);
-  sp_image_free(res);
-  res = sp_image_ifft(tmp);
+  tmp = res;
+  res = sp_image_ifft_padded(tmp,new_x,new_y,new_z);
   sp_image_free(tmp);
   res->detector->image_center[0] = img->detector->image_center[0]*(new_x/sp_c3matrix_x(img->image));
   res->detector->image_center[1] = img->detector->image_center[1]*(new_y/sp_c3matrix_y(img->image));
@@ -3531,68 +3557,11 @@ void sp_image_invert_mask(const Image *in, Image *out)
 }
 
 void sp_image_grow_mask(Image *in, int pixels){
-  Image *tmp1 = sp_image_duplicate(in,SP_COPY_DATA|SP_COPY_MASK|SP_COPY_DETECTOR);
-  Image *tmp2 = sp_image_duplicate(in,SP_COPY_DATA|SP_COPY_MASK|SP_COPY_DETECTOR);
-  Image *foo;
-
-  for (int i = 0; i < pixels; i++) {
-    for (int x = 0; x < sp_image_x(in); x++) {
-      for (int y = 0; y < sp_image_y(in); y++) {
-	for (int z = 0; z < sp_image_z(in); z++) {
-	  
-	  if ((sp_image_mask_get(tmp1,x,y,z) == 1) ||
-	      ((x != 0 && sp_image_mask_get(tmp1,x-1,y,z) != 0) ||
-	       (x != sp_image_x(tmp1)-1 && sp_image_mask_get(tmp1,x+1,y,z) != 0) ||
-	       (y != 0 && sp_image_mask_get(tmp1,x,y-1,z) != 0) ||
-	       (y != sp_image_y(tmp1)-1 && sp_image_mask_get(tmp1,x,y+1,z) != 0) ||
-	       (z != 0 && sp_image_mask_get(tmp1,x,y,z-1) != 0) ||
-	       (z != sp_image_z(tmp1)-1 && sp_image_mask_get(tmp1,x,y,z+1) != 0))) {
-	    sp_image_mask_set(tmp2,x,y,z,1);
-	  } else {
-	    sp_image_mask_set(tmp2,x,y,z,0);
-	  }
-	}
-      }
-    }
-    foo = tmp1;
-    tmp1 = tmp2;
-    tmp2 = foo;
-  }
-  sp_image_mask_to_mask(tmp1,in);
-  sp_image_free(tmp1);
-  sp_image_free(tmp2);
+  sp_image_mask_morphology(in,SpMorphologyDilate,SpMorphologyDiamond,pixels);
 }
 
 void sp_image_shrink_mask(Image *in, int pixels){
-  Image *tmp1 = sp_image_duplicate(in,SP_COPY_DATA|SP_COPY_MASK|SP_COPY_DETECTOR);
-  Image *tmp2 = sp_image_duplicate(in,SP_COPY_DATA|SP_COPY_MASK|SP_COPY_DETECTOR);
-  Image *foo;
-
-  for (int i = 0; i < pixels; i++) {
-    for (int x = 0; x < sp_image_x(in); x++) {
-      for (int y = 0; y < sp_image_y(in); y++) {
-	for (int z = 0; z < sp_image_z(in); z++) {
-	  if ((sp_image_mask_get(tmp1,x,y,z) == 0) ||
-	      ((x != 0 && sp_image_mask_get(tmp1,x-1,y,z) == 0) ||
-	       (x != sp_image_x(tmp1)-1 && sp_image_mask_get(tmp1,x+1,y,z) == 0) ||
- 	       (y != 0 && sp_image_mask_get(tmp1,x,y-1,z) == 0) ||
-	       (y != sp_image_y(tmp1)-1 && sp_image_mask_get(tmp1,x,y+1,z) == 0) ||
-	       (z != 0 && sp_image_mask_get(tmp1,x,y,z-1) == 0) ||
-	       (z != sp_image_z(tmp1)-1 && sp_image_mask_get(tmp1,x,y,z+1) == 0))) {
-	    sp_image_mask_set(tmp2,x,y,z,0);
-	  } else {
-	    sp_image_mask_set(tmp2,x,y,z,1);
-	  }
-	}
-      }
-    }
-    foo = tmp1;
-    tmp1 = tmp2;
-    tmp2 = foo;
-  }
-  sp_image_mask_to_mask(tmp1,in);
-  sp_image_free(tmp1);
-  sp_image_free(tmp2);
+  sp_image_mask_morphology(in,SpMorphologyErode,SpMorphologyDiamond,pixels);
 }
 
 void sp_pixel_flags_translate_mask(sp_i3matrix * pfm, int dx, int dy, int dz){
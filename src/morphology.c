@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "spimage.h"
+
+/* Binary morphology.
+
+   A dilation sets every pixel within the structuring element of a pixel
+   of the set, which is a threshold on the distance transform of the set
+   in the metric of the element. The transforms of the three metrics are
+   separable, so they are computed one axis at a time, with a number of
+   operations linear in the length of each line whatever the radius. An
+   erosion is the complement of the dilation of the complement. */
+
+/* Distance of the pixels with no pixel of the set on their line yet.
+   Small enough that adding squared distances to it can't overflow. */
+#define MORPHOLOGY_FAR (INT_MAX/4)
+
+/* g[i] = min_j f[j]+|i-j| */
+static void morphology_line_l1(const int * f, int * g, int n){
+  g[0] = f[0];
+  for(int i = 1;i<n;i++){
+    g[i] = MIN(f[i],g[i-1]+1);
+  }
+  for(int i = n-2;i>=0;i--){
+    g[i] = MIN(g[i],g[i+1]+1);
+  }
+}
+
+/* g[i] = min_j f[j]+(i-j)^2, from the lower envelope of the parabolas
+   rooted at the finite f[j], as in Felzenszwalb and Huttenlocher,
+   "Distance Transforms of Sampled Functions". v holds the roots of the
+   parabolas of the envelope and z the boundaries between them. */
+static void morphology_line_l2(const int * f, int * g, int n, int * v, double * z){
+  int k = -1;
+  for(int q = 0;q<n;q++){
+    if(f[q] >= MORPHOLOGY_FAR){
+      continue;
+    }
+    double s = 0;
+    while(k >= 0){
+      s = ((f[q]+(double)q*q)-(f[v[k]]+(double)v[k]*v[k]))/(2.0*(q-v[k]));
+      if(s > z[k]){
+	break;
+      }
+      k--;
+    }
+    k++;
+    v[k] = q;
+    z[k] = k ? s : -HUGE_VAL;
+  }
+  if(k < 0){
+    memcpy(g,f,sizeof(int)*n);
+    return;
+  }
+  z[k+1] = HUGE_VAL;
+  int j = 0;
+  for(int q = 0;q<n;q++){
+    while(z[j+1] < q){
+      j++;
+    }
+    g[q] = f[v[j]]+(q-v[j])*(q-v[j]);
+  }
+}
+
+/* Dilates the pixels of m which have any of bits set, or unset when
+   invert is set, and writes the result back into bits, inverted again
+   when invert is set, which makes it an erosion */
+static void morphology_dilate(sp_i3matrix * m, int bits, int invert, SpMorphologyElement element,
+			      real radius, void * scratch){
+  int n[3] = {sp_i3matrix_x(m),sp_i3matrix_y(m),sp_i3matrix_z(m)};
+  int nmax = MAX(n[0],MAX(n[1],n[2]));
+  int size = n[0]*n[1]*n[2];
+  double * z = scratch;
+  int * d = (int *)(z+nmax+1);
+  int * f = d+size;
+  int * g = f+nmax;
+  int * v = g+nmax;
+  for(int i = 0;i<size;i++){
+    d[i] = ((m->data[i] & bits) != 0) != invert ? 0 : MORPHOLOGY_FAR;
+  }
+  double limit_distance = element == SpMorphologyBall ? radius*radius : radius;
+  /* Pixels with no pixel of the set anywhere stay out of the result */
+  int limit = MIN(floor(limit_distance),MORPHOLOGY_FAR-1);
+  int stride = 1;
+  for(int a = 0;a<3;a++){
+    if(n[a] > 1){
+      for(int o = 0;o<size/(n[a]*stride);o++){
+	for(int s = 0;s<stride;s++){
+	  int * line = &d[o*n[a]*stride+s];
+	  for(int i = 0;i<n[a];i++){
+	    f[i] = line[i*stride];
+	  }
+	  if(element == SpMorphologyBall){
+	    morphology_line_l2(f,g,n[a],v,z);
+	  }else{
+	    morphology_line_l1(f,g,n[a]);
+	  }
+	  if(element == SpMorphologyBox){
+	    /* The box is the product of the dilations along each axis */
+	    for(int i = 0;i<n[a];i++){
+	      line[i*stride] = g[i] <= limit ? 0 : MORPHOLOGY_FAR;
+	    }
+	  }else{
+	    for(int i = 0;i<n[a];i++){
+	      line[i*stride] = g[i];
+	    }
+	  }
+	}
+      }
+    }
+    stride *= n[a];
+  }
+  for(int i = 0;i<size;i++){
+    if((d[i] <= limit) != invert){
+      m->data[i] |= bits;
+    }else{
+      m->data[i] &= ~bits;
+    }
+  }
+}
+
+size_t sp_morphology_scratch_size(int nx, int ny, int nz){
+  int nmax = MAX(nx,MAX(ny,nz));
+  return sizeof(double)*(nmax+1)+sizeof(int)*((size_t)nx*ny*nz+3*nmax);
+}
+
+int sp_i3matrix_morphology(sp_i3matrix * m, int bits, SpMorphologyOperation op,
+			   SpMorphologyElement element, real radius, void * scratch){
+  if(radius < 0){
+    fprintf(stderr,"Error: Negative structuring element radius!\n");
+    return -1;
+  }
+  if(element != SpMorphologyBall && element != SpMorphologyBox && element != SpMorphologyDiamond){
+    fprintf(stderr,"Error: Unknown structuring element!\n");
+    return -2;
+  }
+  if(op != SpMorphologyDilate && op != SpMorphologyErode &&
+     op != SpMorphologyOpen && op != SpMorphologyClose){
+    fprintf(stderr,"Error: Unknown morphological operation!\n");
+    return -3;
+  }
+  void * allocated = NULL;
+  if(!scratch){
+    allocated = sp_malloc(sp_morphology_scratch_size(sp_i3matrix_x(m),sp_i3matrix_y(m),sp_i3matrix_z(m)));
+    scratch = allocated;
+  }
+  if(op == SpMorphologyErode || op == SpMorphologyOpen){
+    morphology_dilate(m,bits,1,element,radius,scratch);
+  }
+  if(op != SpMorphologyErode){
+    morphology_dilate(m,bits,0,element,radius,scratch);
+  }
+  if(op == SpMorphologyClose){
+    morphology_dilate(m,bits,1,element,radius,scratch);
+  }
+  if(allocated){
+    sp_free(allocated);
+  }
+  return 0;
+}
+
+int sp_image_mask_morphology(Image * in, SpMorphologyOperation op,
+			     SpMorphologyElement element, real radius){
+  for(int i = 0;i<sp_image_size(in);i++){
+    in->mask->data[i] = (in->mask->data[i] != 0);
+  }
+  return sp_i3matrix_morphology(in->mask,1,op,element,radius,NULL);
+}
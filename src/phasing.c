@@ -1,17 +1,31 @@
+#include <stdint.h>
 #include <spimage.h>
+#include "thread_pool_private.h"
+#include "phasing_private.h"
 
 
 static int phaser_iterate_er(SpPhaser * ph,int iterations);
 static int phaser_iterate_hio(SpPhaser * ph, int iterations);
 static int phaser_iterate_raar(SpPhaser * ph, int iterations);
 static int phaser_iterate_diff_map(SpPhaser * ph, int iterations);
-static Image * phaser_iterate_diff_map_f1(Image * real_in,sp_i3matrix * pixel_flags,real gamma1);
-static void phaser_apply_constraints(SpPhaser * ph,Image * new_model, SpPhasingConstraints constraints);
-static void phaser_module_projection(Image * a, sp_3matrix * amp, sp_3matrix * amp_min,sp_3matrix * amp_max, sp_i3matrix * pixel_flags, SpPhasingConstraints constraints);
-static void phaser_phased_amplitudes_projection(Image * a, sp_c3matrix * phased_amp, sp_i3matrix * pixel_flags);
+static int phaser_iterate_rrr(SpPhaser * ph, int iterations);
+static int phaser_iterate_accelerated_er(SpPhaser * ph, int iterations);
+static void phaser_iterate_diff_map_f1(Complex * out, const Complex * real_in, const SpPixelSpans * support, int size, real gamma1);
 
 
 static void phaser_check_dimensions(SpPhaser * ph,const Image * a);
+static SpThreadPool * phaser_thread_pool(SpPhaser * ph);
+static void phaser_for(SpPhaser * ph, int n, SpThreadPoolFunction kernel, void * args);
+static int phaser_iterate_real_object(SpPhaser * ph, int iterations);
+static void phaser_free_half_spectrum(SpPhaser * ph);
+static void phaser_invalidate_amplitudes(SpPhaser * ph);
+static void phaser_spans_free(SpPixelSpans * s);
+static void phaser_select_kernels(SpPhaser * ph);
+
+/* Both CPU engines keep the iterates in g0, g1 and gp */
+static inline int phaser_cpu_engine(const SpPhaser * ph){
+  return ph->engine == SpEngineCPU || ph->engine == SpEngineCPUThreaded;
+}
 
 SpPhasingAlgorithm * sp_phasing_diff_map_alloc(sp_smap * beta, real gamma1, real gamma2, SpPhasingConstraints constraints){
   SpPhasingAlgorithm * ret = sp_malloc(sizeof(SpPhasingAlgorithm));
@@ -75,6 +89,26 @@ SpPhasingAlgorithm * sp_phasing_er_alloc(SpPhasingConstraints constraints){
   return ret;
 }
 
+SpPhasingAlgorithm * sp_phasing_rrr_alloc(sp_smap * beta, SpPhasingConstraints constraints){
+  SpPhasingAlgorithm * ret = sp_malloc(sizeof(SpPhasingAlgorithm));
+  ret->type = SpRRR;
+  SpPhasingRRRParameters * params = sp_malloc(sizeof(SpPhasingRRRParameters));
+  params->beta = beta;
+  params->constraints = constraints;
+  ret->params = params;
+  return ret;
+}
+
+SpPhasingAlgorithm * sp_phasing_accelerated_er_alloc(sp_smap * momentum, SpPhasingConstraints constraints){
+  SpPhasingAlgorithm * ret = sp_malloc(sizeof(SpPhasingAlgorithm));
+  ret->type = SpAcceleratedER;
+  SpPhasingAcceleratedERParameters * params = sp_malloc(sizeof(SpPhasingAcceleratedERParameters));
+  params->beta = momentum;
+  params->constraints = constraints;
+  ret->params = params;
+  return ret;
+}
+
 SpPhaser * sp_phaser_alloc(){
   SpPhaser * ret = sp_malloc(sizeof(SpPhaser));
   memset(ret,0,sizeof(SpPhaser));
@@ -85,27 +119,382 @@ SpPhaser * sp_phaser_alloc(){
   ret->model_before_projection_iteration = -1;
   ret->model_change_iteration = -1;
   ret->support_iteration = -1;
+  ret->fmodel_iteration = -1;
+  ret->efourier_iteration = -1;
+  ret->momentum_iteration = -1;
   ret->phasing_objective = SpRecoverPhases;  
   return ret;
 }
 
 void sp_phaser_set_objective(SpPhaser * ph, SpPhasingObjective obj){
   ph->phasing_objective = obj;  
+  phaser_select_kernels(ph);
 }
 
-void sp_phaser_free(SpPhaser * ph){
-  if(ph->model){
-    sp_image_free(ph->model);
-    ph->model = 0;
+void sp_phaser_set_threads(SpPhaser * ph, int nthreads){
+  if(nthreads < 0){
+    nthreads = 0;
   }
-  if (ph->model_before_projection){
-    sp_image_free(ph->model_before_projection);
-    ph->model_before_projection = 0;
+  ph->nthreads = nthreads;
+  /* Recreated with the new size when needed */
+  if(ph->thread_pool){
+    sp_thread_pool_free(ph->thread_pool);
+    ph->thread_pool = NULL;
   }
-  if(ph->model_change){
-    sp_image_free(ph->model_change);
-    ph->model_change = 0;
+}
+
+int sp_phaser_set_real_object(SpPhaser * ph, int enable){
+  if(!phaser_cpu_engine(ph) || ph->g0 || ph->r0){
+    fprintf(stderr,"Error: The real object mode must be set on a CPU engine before the model is initialized\n");
+    return -1;
+  }
+  ph->real_object = (enable != 0);
+  return 0;
+}
+
+int sp_phaser_set_low_memory(SpPhaser * ph, int enable){
+  if(ph->engine == SpEngineCUDA || ph->g0 || ph->r0){
+    fprintf(stderr,"Error: The low memory mode must be set on a CPU engine before the model is initialized\n");
+    return -1;
+  }
+  ph->low_memory = (enable != 0);
+  return 0;
+}
+
+void sp_phaser_set_metrics_capacity(SpPhaser * ph, int capacity){
+  if(capacity < 0){
+    capacity = 0;
+  }
+  SpPhaserMetrics * metrics = NULL;
+  int kept = 0;
+  if(capacity){
+    metrics = sp_malloc(sizeof(SpPhaserMetrics)*capacity);
+    /* Keep the most recent records, oldest first */
+    if(ph->metrics){
+      kept = sp_phaser_metrics(ph,metrics,capacity);
+    }
+  }
+  if(ph->metrics){
+    sp_free(ph->metrics);
+  }
+  ph->metrics = metrics;
+  ph->metrics_capacity = capacity;
+  ph->metrics_count = kept;
+}
+
+int sp_phaser_metrics(const SpPhaser * ph, SpPhaserMetrics * metrics, int n){
+  int available = ph->metrics_count < ph->metrics_capacity ? ph->metrics_count : ph->metrics_capacity;
+  if(n > available){
+    n = available;
+  }
+  /* The last n records, oldest first */
+  for(int i = 0;i<n;i++){
+    metrics[i] = ph->metrics[(ph->metrics_count-n+i) % ph->metrics_capacity];
+  }
+  return n;
+}
+
+static SpThreadPool * phaser_thread_pool(SpPhaser * ph){
+  if(!ph->thread_pool){
+    ph->thread_pool = sp_thread_pool_alloc(ph->nthreads ? ph->nthreads : sp_thread_pool_cpu_count());
+  }
+  return ph->thread_pool;
+}
+
+/* Wraps data, an array the size of the phaser images, in view so that it
+   can be passed to the image functions without allocating anything */
+static Image * phaser_image_view(SpPhaser * ph, Image * view, sp_c3matrix * m, Complex * data){
+  *m = *ph->g0->image;
+  m->data = data;
+  *view = *ph->g0;
+  view->image = m;
+  return view;
+}
+
+/* In the low memory mode the complex CPU engines keep a single mask and
+   detector for g0, g1, gp and the images the getters return. The model,
+   the old model and the model before the projection are then views of
+   g1, g0 and gp instead of copies. */
+static inline int phaser_borrows_masks(const SpPhaser * ph){
+  return ph->low_memory && !ph->real_object && phaser_cpu_engine(ph);
+}
+
+/* An image sharing the mask and the detector of like, with data as its
+   values or with its own values when data is NULL */
+static Image * phaser_borrowed_image(const Image * like, Complex * data){
+  Image * a = sp_malloc(sizeof(Image));
+  *a = *like;
+  a->image = sp_malloc(sizeof(sp_c3matrix));
+  *a->image = *like->image;
+  if(!data){
+    data = sp_malloc(sizeof(Complex)*sp_c3matrix_size(like->image));
+  }
+  a->image->data = data;
+  return a;
+}
+
+static void phaser_borrowed_image_free(Image * a, int owns_data){
+  if(owns_data){
+    sp_free(a->image->data);
+  }
+  sp_free(a->image);
+  sp_free(a);
+}
+
+/* Allocates one of the images returned by the getters */
+static Image * phaser_exposed_image_alloc(SpPhaser * ph){
+  if(phaser_borrows_masks(ph) && ph->g0){
+    return phaser_borrowed_image(ph->g0,NULL);
+  }
+  return sp_image_alloc(ph->nx,ph->ny,ph->nz);
+}
+
+/* Frees *a, one of the images returned by the getters. view tells if it
+   is a view of an iterate in the low memory mode. */
+static void phaser_exposed_image_free(SpPhaser * ph, Image ** a, int view){
+  if(!*a){
+    return;
+  }
+  if(ph->g0 && (*a)->mask == ph->g0->mask){
+    phaser_borrowed_image_free(*a,!view);
+  }else{
+    sp_image_free(*a);
+  }
+  *a = NULL;
+}
+
+/* Points the view *a at the values of the iterate g. They have to be
+   set again after every iteration as the iterates swap their arrays. */
+static Image * phaser_iterate_view(Image ** a, const Image * g){
+  if(!*a){
+    *a = phaser_borrowed_image(g,g->image->data);
+  }
+  (*a)->image->data = g->image->data;
+  return *a;
+}
+
+/* Points the view *a at the values of b, with a mask of its own that
+   the getters can set without touching the one b shares */
+static Image * phaser_masked_view(Image ** a, const Image * b){
+  if(!*a){
+    *a = phaser_borrowed_image(b,b->image->data);
+    (*a)->mask = sp_i3matrix_alloc(sp_image_x(b),sp_image_y(b),sp_image_z(b));
+  }
+  sp_c3matrix * image = (*a)->image;
+  sp_i3matrix * mask = (*a)->mask;
+  *image = *b->image;
+  **a = *b;
+  (*a)->image = image;
+  (*a)->mask = mask;
+  return *a;
+}
+
+static void phaser_masked_view_free(Image ** a){
+  if(!*a){
+    return;
+  }
+  sp_i3matrix_free((*a)->mask);
+  phaser_borrowed_image_free(*a,0);
+  *a = NULL;
+}
+
+static void phaser_free_iterates(SpPhaser * ph){
+  if(phaser_borrows_masks(ph)){
+    /* g0 frees the shared mask and detector */
+    phaser_borrowed_image_free(ph->g1,1);
+    phaser_borrowed_image_free(ph->gp,1);
+  }else{
+    sp_image_free(ph->g1);
+    sp_image_free(ph->gp);
+  }
+  sp_image_free(ph->g0);
+  ph->g0 = NULL;
+  ph->g1 = NULL;
+  ph->gp = NULL;
+}
+
+/* Workspace buffers start on a cache line */
+#define PHASER_WORKSPACE_ALIGNMENT 64
+
+/* Sets s to the runs of the n flags which have flag set */
+static void phaser_spans_build(SpPixelSpans * s, const int * flags, int n, int flag){
+  s->nspans = 0;
+  int i = 0;
+  while(i < n){
+    while(i < n && !(flags[i] & flag)){
+      i++;
+    }
+    if(i == n){
+      break;
+    }
+    int begin = i;
+    while(i < n && (flags[i] & flag)){
+      i++;
+    }
+    if(s->nspans == s->allocated){
+      s->allocated = s->allocated ? 2*s->allocated : 64;
+      s->bounds = sp_realloc(s->bounds,sizeof(int)*2*s->allocated);
+    }
+    s->bounds[2*s->nspans] = begin;
+    s->bounds[2*s->nspans+1] = i;
+    s->nspans++;
+  }
+}
+
+static void phaser_spans_free(SpPixelSpans * s){
+  if(s->bounds){
+    sp_free(s->bounds);
+  }
+  s->bounds = NULL;
+  s->nspans = 0;
+  s->allocated = 0;
+}
+
+/* Rebuilds the spans of ph if pixel_flags changed since they were built */
+static void phaser_update_spans(SpPhaser * ph){
+  if(ph->spans_valid){
+    return;
+  }
+  phaser_spans_build(&ph->support_spans,ph->pixel_flags->data,ph->image_size,SpPixelInsideSupport);
+  phaser_spans_build(&ph->measured_spans,ph->pixel_flags->data,ph->image_size,SpPixelMeasuredAmplitude);
+  ph->spans_valid = 1;
+}
+
+/* Splits the pixels [begin,end) in runs which are alternately outside
+   and inside a set of spans, so that loops can handle each kind of run
+   without testing any flag */
+typedef struct{
+  const int * bounds;
+  int nspans;
+  /* first span not yet reached */
+  int k;
+  int pos;
+  int end;
+}PhaserRuns;
+
+static inline void phaser_runs_init(PhaserRuns * r, const SpPixelSpans * s, int begin, int end){
+  /* Find the first span that ends after begin */
+  int lo = 0;
+  int hi = s->nspans;
+  while(lo < hi){
+    int mid = (lo+hi)/2;
+    if(s->bounds[2*mid+1] <= begin){
+      lo = mid+1;
+    }else{
+      hi = mid;
+    }
+  }
+  r->bounds = s->bounds;
+  r->nspans = s->nspans;
+  r->k = lo;
+  r->pos = begin;
+  r->end = end;
+}
+
+/* Sets [*run_begin,*run_end) to the next run. Returns 1 if it is inside
+   the spans, 0 if it is outside and -1 when there are no runs left. */
+static inline int phaser_runs_next(PhaserRuns * r, int * run_begin, int * run_end){
+  if(r->pos >= r->end){
+    return -1;
+  }
+  *run_begin = r->pos;
+  if(r->k < r->nspans && r->bounds[2*r->k] <= r->pos){
+    *run_end = MIN(r->bounds[2*r->k+1],r->end);
+    r->k++;
+    r->pos = *run_end;
+    return 1;
   }
+  *run_end = r->k < r->nspans ? MIN(r->bounds[2*r->k],r->end) : r->end;
+  r->pos = *run_end;
+  return 0;
+}
+
+void sp_phaser_workspace_reserve(SpPhaser * ph, size_t size){
+  SpPhaserWorkspace * ws = &ph->workspace;
+  if(size > ws->peak){
+    ws->peak = size;
+  }
+  if(ws->size < size){
+    if(ws->data){
+      sp_free(ws->data);
+    }
+    ws->data = sp_malloc(size);
+    ws->size = size;
+    ws->heap_allocations++;
+  }
+}
+
+void * sp_phaser_workspace_alloc(SpPhaser * ph, size_t size){
+  SpPhaserWorkspace * ws = &ph->workspace;
+  /* The padding is counted even when not needed so that the arena
+     grown to peak always has room for the same requests */
+  ws->requested += size+PHASER_WORKSPACE_ALIGNMENT;
+  if(ws->requested > ws->peak){
+    ws->peak = ws->requested;
+  }
+  if(ws->data){
+    uintptr_t base = (uintptr_t)ws->data;
+    size_t start = ((base+ws->used+PHASER_WORKSPACE_ALIGNMENT-1) & ~(uintptr_t)(PHASER_WORKSPACE_ALIGNMENT-1))-base;
+    if(start+size <= ws->size){
+      ws->used = start+size;
+      return ws->data+start;
+    }
+  }
+  if(ws->noverflow == ws->overflow_allocated){
+    ws->overflow_allocated = ws->overflow_allocated ? 2*ws->overflow_allocated : 4;
+    ws->overflow = sp_realloc(ws->overflow,sizeof(void *)*ws->overflow_allocated);
+    ws->heap_allocations++;
+  }
+  void * ret = sp_malloc(size);
+  ws->overflow[ws->noverflow++] = ret;
+  ws->heap_allocations++;
+  return ret;
+}
+
+void sp_phaser_workspace_reset(SpPhaser * ph){
+  SpPhaserWorkspace * ws = &ph->workspace;
+  for(int i = 0;i<ws->noverflow;i++){
+    sp_free(ws->overflow[i]);
+  }
+  ws->noverflow = 0;
+  ws->used = 0;
+  ws->requested = 0;
+  sp_phaser_workspace_reserve(ph,ws->peak);
+}
+
+void sp_phaser_workspace_free(SpPhaser * ph){
+  SpPhaserWorkspace * ws = &ph->workspace;
+  sp_phaser_workspace_reset(ph);
+  if(ws->data){
+    sp_free(ws->data);
+  }
+  if(ws->overflow){
+    sp_free(ws->overflow);
+  }
+  memset(ws,0,sizeof(SpPhaserWorkspace));
+}
+
+long long sp_phaser_heap_allocations(const SpPhaser * ph){
+  return ph->workspace.heap_allocations;
+}
+
+void sp_phaser_set_fft_threads(SpPhaser * ph, int nthreads){
+  if(nthreads < 0){
+    nthreads = 0;
+  }
+  ph->fft_nthreads = nthreads;
+}
+
+void sp_phaser_free(SpPhaser * ph){
+  int views = phaser_borrows_masks(ph);
+  phaser_exposed_image_free(ph,&ph->model,views);
+  phaser_exposed_image_free(ph,&ph->model_before_projection,views);
+  phaser_exposed_image_free(ph,&ph->old_model,views);
+  phaser_exposed_image_free(ph,&ph->model_change,0);
+  phaser_exposed_image_free(ph,&ph->support,0);
+  phaser_exposed_image_free(ph,&ph->fmodel,0);
+  phaser_masked_view_free(&ph->model_with_support);
+  phaser_masked_view_free(&ph->fmodel_with_mask);
   if(ph->amplitudes){
     sp_3matrix_free(ph->amplitudes);
     ph->amplitudes = 0;
@@ -122,6 +511,12 @@ void sp_phaser_free(SpPhaser * ph){
     sp_i3matrix_free(ph->pixel_flags);
     ph->pixel_flags = 0;
   }
+  phaser_spans_free(&ph->support_spans);
+  phaser_spans_free(&ph->measured_spans);
+  if(ph->kernels){
+    sp_free(ph->kernels);
+    ph->kernels = 0;
+  }
   if (ph->phased_amplitudes) {
     sp_c3matrix_free(ph->phased_amplitudes);
     ph->phased_amplitudes = 0;
@@ -130,18 +525,6 @@ void sp_phaser_free(SpPhaser * ph){
     sp_image_free(ph->amplitudes_image);
     ph->amplitudes_image = 0;
   }
-  if (ph->old_model) {
-    sp_image_free(ph->old_model);
-    ph->old_model = 0;
-  }
-  if (ph->support) {
-    sp_image_free(ph->support);
-    ph->support = 0;
-  }
-  if (ph->fmodel) {
-    sp_image_free(ph->fmodel);
-    ph->fmodel = 0;
-  }
 #ifdef _USE_CUDA
   if(ph->engine == SpEngineCUDA){
 
@@ -167,24 +550,49 @@ void sp_phaser_free(SpPhaser * ph){
       cufftDestroy(ph->cufft_plan);
       ph->cufft_plan = 0;
     }
-  }else{
-    sp_image_free(ph->g0);
-    sp_image_free(ph->g1);
-    sp_image_free(ph->gp);
+  }else if(ph->g0){
+    phaser_free_iterates(ph);
   }
 #else
-  sp_image_free(ph->g0);
-  sp_image_free(ph->g1);
-  sp_image_free(ph->gp);
+  if(ph->g0){
+    phaser_free_iterates(ph);
+  }
 #endif
+  if(ph->r0){
+    sp_free(ph->r0);
+    sp_free(ph->r1);
+    sp_free(ph->rp);
+  }
+  phaser_free_half_spectrum(ph);
+  if(ph->thread_pool){
+    sp_thread_pool_free(ph->thread_pool);
+  }
+  sp_phaser_workspace_free(ph);
+  if(ph->metrics){
+    sp_free(ph->metrics);
+  }
   free(ph);
 }
 
 
+/* Copies the real array of the real object mode into the image out */
+static void phaser_real_to_image(const real * in, Image * out){
+  for(int i = 0;i<sp_image_size(out);i++){
+    out->image->data[i] = sp_cinit(in[i],0);
+  }
+}
+
 void sp_phaser_set_model(SpPhaser * ph,const Image * model){
   phaser_check_dimensions(ph,model);
   ph->model_iteration = -1;
-  if(ph->engine == SpEngineCPU){
+  ph->fmodel_iteration = -1;
+  ph->efourier_iteration = -1;
+  ph->momentum_iteration = -1;
+  if(ph->real_object){
+    for(int i = 0;i<ph->image_size;i++){
+      ph->r1[i] = sp_real(model->image->data[i]);
+    }
+  }else if(phaser_cpu_engine(ph)){
     sp_image_memcpy(ph->g1,model);
   }else if(ph->engine == SpEngineCUDA){
 #ifdef _USE_CUDA
@@ -200,6 +608,7 @@ void sp_phaser_set_model(SpPhaser * ph,const Image * model){
 void sp_phaser_set_support(SpPhaser * ph,const Image * support){
   phaser_check_dimensions(ph,support);
   ph->support_iteration = -1;
+  ph->spans_valid = 0;
   if(!ph->pixel_flags){
     ph->pixel_flags = sp_i3matrix_alloc(ph->nx,ph->ny,ph->nz);
     for(int i= 0;i<ph->image_size;i++){
@@ -238,6 +647,7 @@ void sp_phaser_set_phased_amplitudes(SpPhaser * ph,const Image * phased_amplitud
       ph->pixel_flags->data[i] = 0;
     }
   }
+  ph->spans_valid = 0;
   for(int i = 0;i<ph->image_size;i++){
     ph->phased_amplitudes->data[i] = phased_amplitudes->image->data[i];
     if(phased_amplitudes->mask->data[i]){
@@ -298,6 +708,7 @@ void sp_phaser_set_amplitudes(SpPhaser * ph,const Image * amplitudes){
     }
   }
   int masked = 0;
+  phaser_invalidate_amplitudes(ph);
   for(int i = 0;i<ph->image_size;i++){
     ph->amplitudes->data[i] = sp_real(amplitudes->image->data[i]);
     if(amplitudes->mask->data[i]){
@@ -336,6 +747,7 @@ void sp_phaser_set_amplitudes_margins(SpPhaser * ph,const Image * amplitudes_min
   if(!ph->amplitudes_max){
     ph->amplitudes_max = sp_3matrix_alloc(ph->nx,ph->ny,ph->nz);
   }
+  phaser_invalidate_amplitudes(ph);
   for(int i = 0;i<ph->image_size;i++){
     ph->amplitudes_min->data[i] = sp_real(amplitudes_min->image->data[i]);
     ph->amplitudes_max->data[i] = sp_real(amplitudes_max->image->data[i]);
@@ -376,12 +788,17 @@ const Image * sp_phaser_amplitudes(SpPhaser * ph){
 }
 
 const Image * sp_phaser_model(SpPhaser * ph){
+  if(phaser_borrows_masks(ph)){
+    return phaser_iterate_view(&ph->model,ph->g1);
+  }
   if(ph->model_iteration != ph->iteration){
     if(!ph->model){
       ph->model = sp_image_alloc(ph->nx,ph->ny,ph->nz);
     }
     ph->model_iteration = ph->iteration;
-    if(ph->engine == SpEngineCPU){
+    if(ph->real_object){
+      phaser_real_to_image(ph->r1,ph->model);
+    }else if(phaser_cpu_engine(ph)){
       sp_image_memcpy(ph->model,ph->g1);
     }else if(ph->engine == SpEngineCUDA){
 #ifdef _USE_CUDA
@@ -396,12 +813,17 @@ const Image * sp_phaser_model(SpPhaser * ph){
 }
 
 const Image * sp_phaser_model_before_projection(SpPhaser *ph) {
+  if (phaser_borrows_masks(ph)) {
+    return phaser_iterate_view(&ph->model_before_projection, ph->gp);
+  }
   if (ph->model_before_projection_iteration != ph->iteration) {
     if (!ph->model_before_projection) {
       ph->model_before_projection = sp_image_alloc(ph->nx, ph->ny, ph->nz);
     }
     ph->model_before_projection_iteration = ph->iteration;
-    if (ph->engine == SpEngineCPU) {
+    if (ph->real_object) {
+      phaser_real_to_image(ph->rp, ph->model_before_projection);
+    } else if (phaser_cpu_engine(ph)) {
       sp_image_memcpy(ph->model_before_projection, ph->gp);
     } else if (ph->engine == SpEngineCUDA) {
 #ifdef _USE_CUDA
@@ -416,12 +838,17 @@ const Image * sp_phaser_model_before_projection(SpPhaser *ph) {
 }
 
 static Image * sp_phaser_model_non_const(SpPhaser * ph){
+  if(phaser_borrows_masks(ph)){
+    return phaser_iterate_view(&ph->model,ph->g1);
+  }
   if(ph->model_iteration != ph->iteration){
     if(!ph->model){
       ph->model = sp_image_alloc(ph->nx,ph->ny,ph->nz);
     }
     ph->model_iteration = ph->iteration;
-    if(ph->engine == SpEngineCPU){
+    if(ph->real_object){
+      phaser_real_to_image(ph->r1,ph->model);
+    }else if(phaser_cpu_engine(ph)){
       sp_image_memcpy(ph->model,ph->g1);
     }else if(ph->engine == SpEngineCUDA){
 #ifdef _USE_CUDA
@@ -438,26 +865,35 @@ static Image * sp_phaser_model_non_const(SpPhaser * ph){
 const Image * sp_phaser_model_with_support(SpPhaser * ph){
   Image * model = sp_phaser_model_non_const(ph);
   const Image * support = sp_phaser_support(ph);
+  if(phaser_borrows_masks(ph)){
+    model = phaser_masked_view(&ph->model_with_support,model);
+  }
   sp_image_image_to_mask(support,model);
   return model;
 }
 
-const Image * sp_phaser_fmodel(SpPhaser * ph){
+/* The spectrum is computed straight from g1. On the CPU engines the next
+   iteration starts from the same spectrum, so it copies it instead of
+   doing its own forward transform and querying the Fourier model every
+   iteration costs no extra FFT. */
+static Image * sp_phaser_fmodel_non_const(SpPhaser * ph){
   if(ph->fmodel_iteration != ph->iteration){
     if(!ph->fmodel){
-      ph->fmodel = sp_image_alloc(ph->nx,ph->ny,ph->nz);
+      ph->fmodel = phaser_exposed_image_alloc(ph);
     }
 
     ph->fmodel_iteration = ph->iteration;
-    if(ph->engine == SpEngineCPU){
-      sp_image_memcpy(ph->fmodel,ph->g1);
-      sp_image_fft_fast(ph->fmodel,ph->fmodel);
+    if(ph->real_object){
+      phaser_real_to_image(ph->r1,ph->fmodel);
+      sp_image_fft_fast_threads(ph->fmodel,ph->fmodel,ph->fft_nthreads);
+    }else if(phaser_cpu_engine(ph)){
+      sp_image_fft_fast_threads(ph->g1,ph->fmodel,ph->fft_nthreads);
     }else if(ph->engine == SpEngineCUDA){
 #ifdef _USE_CUDA
       /* transfer the model from the graphics card to the main memory */
       cutilSafeCall(cudaMemcpy(ph->fmodel->image->data,ph->d_g1,sizeof(cufftComplex)*ph->image_size,cudaMemcpyDeviceToHost));
       /* not really efficient here */
-      sp_image_fft_fast(ph->fmodel,ph->fmodel);
+      sp_image_fft_fast_threads(ph->fmodel,ph->fmodel,ph->fft_nthreads);
 #else
       return NULL;
 #endif    
@@ -467,34 +903,26 @@ const Image * sp_phaser_fmodel(SpPhaser * ph){
   return ph->fmodel;
 }
 
-static Image * sp_phaser_fmodel_non_const(SpPhaser * ph){
-  if(ph->fmodel_iteration != ph->iteration){
-    if(!ph->fmodel){
-      ph->fmodel = sp_image_alloc(ph->nx,ph->ny,ph->nz);
-    }
+const Image * sp_phaser_fmodel(SpPhaser * ph){
+  return sp_phaser_fmodel_non_const(ph);
+}
 
-    ph->fmodel_iteration = ph->iteration;
-    if(ph->engine == SpEngineCPU){
-      sp_image_memcpy(ph->fmodel,ph->g1);
-      sp_image_fft_fast(ph->fmodel,ph->fmodel);
-    }else if(ph->engine == SpEngineCUDA){
-#ifdef _USE_CUDA
-      /* transfer the model from the graphics card to the main memory */
-      cutilSafeCall(cudaMemcpy(ph->fmodel->image->data,ph->d_g1,sizeof(cufftComplex)*ph->image_size,cudaMemcpyDeviceToHost));
-      /* not really efficient here */
-      sp_image_fft_fast(ph->fmodel,ph->fmodel);
-#else
-      return NULL;
-#endif    
-    }
+/* Forward transform of g0 into g1 at the start of an iteration */
+static void phaser_transform_model(SpPhaser * ph){
+  if(ph->fmodel && ph->fmodel_iteration == ph->iteration){
+    /* g0 is the model sp_phaser_fmodel() transformed */
+    sp_c3matrix_memcpy(ph->g1->image,ph->fmodel->image);
+  }else{
+    sp_image_fft_fast_threads(ph->g0,ph->g1,ph->fft_nthreads);
   }
-  ph->fmodel->phased = 1;
-  return ph->fmodel;
 }
 
 const Image * sp_phaser_fmodel_with_mask(SpPhaser * ph){
   Image *fmodel = sp_phaser_fmodel_non_const(ph);
   const Image *amplitudes = sp_phaser_amplitudes(ph);
+  if(phaser_borrows_masks(ph)){
+    fmodel = phaser_masked_view(&ph->fmodel_with_mask,fmodel);
+  }
   sp_image_mask_to_mask(amplitudes,fmodel);
   /*
   for (int i = 0; i < sp_image_size(fmodel); i++) {
@@ -505,6 +933,9 @@ const Image * sp_phaser_fmodel_with_mask(SpPhaser * ph){
 }
 
 const Image * sp_phaser_old_model(SpPhaser * ph){
+  if(phaser_borrows_masks(ph)){
+    return phaser_iterate_view(&ph->old_model,ph->g0);
+  }
   if(ph->old_model_iteration != ph->iteration){
     if(!ph->old_model){
       ph->old_model = sp_image_alloc(ph->nx,
@@ -512,7 +943,9 @@ const Image * sp_phaser_old_model(SpPhaser * ph){
 				  ph->nz);
     }
     ph->old_model_iteration = ph->iteration;
-    if(ph->engine == SpEngineCPU){
+    if(ph->real_object){
+      phaser_real_to_image(ph->r0,ph->old_model);
+    }else if(phaser_cpu_engine(ph)){
       sp_image_memcpy(ph->old_model,ph->g0);
     }else if(ph->engine == SpEngineCUDA){
 #ifdef _USE_CUDA
@@ -533,7 +966,19 @@ Image * sp_phaser_model_change(SpPhaser * ph){
   }
   if(ph->model_change_iteration != ph->iteration){
     ph->model_change_iteration = ph->iteration;
-    if(ph->engine == SpEngineCPU){
+    if(!ph->model_change){
+      /* allocated on first use in the low memory mode */
+      ph->model_change = phaser_exposed_image_alloc(ph);
+    }
+    if(ph->real_object){
+      for(int i = 0;i<ph->image_size;i++){
+	ph->model_change->image->data[i] = sp_cinit(ph->r1[i]-ph->r0[i],0);
+      }
+    }else if(phaser_borrows_masks(ph)){
+      for(int i = 0;i<ph->image_size;i++){
+	ph->model_change->image->data[i] = sp_csub(ph->g1->image->data[i],ph->g0->image->data[i]);
+      }
+    }else if(phaser_cpu_engine(ph)){
       sp_image_memcpy(ph->model_change,ph->model);
       sp_image_sub(ph->model_change,ph->g0);
     }else if(ph->engine == SpEngineCUDA){
@@ -566,6 +1011,9 @@ int sp_phaser_init(SpPhaser * ph, SpPhasingAlgorithm * alg,SpSupportArray * sup_
   ph->iteration = 0;
   /* default engine is CPU */
   ph->engine = SpEngineCPU;
+  if(engine == SpEngineCPUThreaded){
+    ph->engine = SpEngineCPUThreaded;
+  }
 #ifdef _USE_CUDA
   if(engine == SpEngineAutomatic || engine == SpEngineCUDA){
     if(sp_cuda_get_device_type() == SpCUDAHardwareDevice){
@@ -576,6 +1024,7 @@ int sp_phaser_init(SpPhaser * ph, SpPhasingAlgorithm * alg,SpSupportArray * sup_
   if(engine != SpEngineAutomatic && engine != ph->engine){
     fprintf(stderr,"Requested engine unavailable. Defaulting to CPU engine.\n");
   }
+  phaser_select_kernels(ph);
   return 0;
 } 
 
@@ -585,6 +1034,7 @@ int sp_phaser_set_phasing_algorithm(SpPhaser * ph, SpPhasingAlgorithm * alg) {
     return -2;
   }
   ph->algorithm = alg;
+  phaser_select_kernels(ph);
   return 0;
 }
 
@@ -600,12 +1050,26 @@ int sp_phaser_init_model(SpPhaser * ph, const Image * user_model, int flags){
   if(!ph){
     return -1;    
   }
+  if(phaser_borrows_masks(ph) && ph->g0){
+    /* the views and the images sharing the mask go with the iterates */
+    phaser_exposed_image_free(ph,&ph->model,1);
+    phaser_exposed_image_free(ph,&ph->model_before_projection,1);
+    phaser_exposed_image_free(ph,&ph->old_model,1);
+    phaser_exposed_image_free(ph,&ph->model_change,0);
+    phaser_exposed_image_free(ph,&ph->support,0);
+    phaser_exposed_image_free(ph,&ph->fmodel,0);
+    phaser_free_iterates(ph);
+  }
   if(ph->model){
     sp_image_free(ph->model);
   }
   if(ph->model_change){
     sp_image_free(ph->model_change);
+    ph->model_change = NULL;
   }
+  ph->fmodel_iteration = -1;
+  ph->efourier_iteration = -1;
+  ph->momentum_iteration = -1;
   if(user_model){
     ph->model = sp_image_duplicate(user_model,SP_COPY_ALL);
   }else if(flags & SpModelRandomPhases){
@@ -659,10 +1123,36 @@ int sp_phaser_init_model(SpPhaser * ph, const Image * user_model, int flags){
     sp_image_free(tmp);
   }
   ph->model->phased = 1;
-  ph->model_change = sp_image_alloc(sp_image_x(ph->model),sp_image_y(ph->model),sp_image_z(ph->model));
-  sp_image_fill(ph->model_change,sp_cinit(0,0));
+  if(!phaser_borrows_masks(ph)){
+    ph->model_change = sp_image_alloc(sp_image_x(ph->model),sp_image_y(ph->model),sp_image_z(ph->model));
+    sp_image_fill(ph->model_change,sp_cinit(0,0));
+  }
 
-  if(ph->engine == SpEngineCPU){
+  if(ph->real_object){
+    ph->half_size = (ph->nx/2+1)*ph->ny*ph->nz;
+    /* Enough for the half spectrum and the support updates */
+    sp_phaser_workspace_reserve(ph,sizeof(Complex)*ph->image_size+PHASER_WORKSPACE_ALIGNMENT);
+    ph->r0 = sp_malloc(sizeof(real)*ph->image_size);
+    ph->r1 = sp_malloc(sizeof(real)*ph->image_size);
+    ph->rp = sp_malloc(sizeof(real)*ph->image_size);
+    for(int i = 0;i<ph->image_size;i++){
+      ph->r0[i] = 0;
+      ph->r1[i] = sp_real(ph->model->image->data[i]);
+      ph->rp[i] = 0;
+    }
+  }else if(phaser_borrows_masks(ph)){
+    /* g1 takes over the model and the workspace only grows to what
+       the algorithms actually use */
+    ph->g1 = ph->model;
+    ph->model = NULL;
+    ph->g0 = phaser_borrowed_image(ph->g1,NULL);
+    sp_image_fill(ph->g0,sp_cinit(0,0));
+    ph->gp = phaser_borrowed_image(ph->g1,NULL);
+    sp_image_fill(ph->gp,sp_cinit(0,0));
+    phaser_iterate_view(&ph->model,ph->g1);
+  }else if(phaser_cpu_engine(ph)){
+    /* Enough for the difference map and the support updates */
+    sp_phaser_workspace_reserve(ph,2*(sizeof(Complex)*ph->image_size+PHASER_WORKSPACE_ALIGNMENT));
     ph->g0 = sp_image_duplicate(ph->model,SP_COPY_ALL);
     sp_image_fill(ph->g0,sp_cinit(0,0));
     ph->g1 = sp_image_duplicate(ph->model,SP_COPY_ALL);
@@ -712,16 +1202,30 @@ int sp_phaser_init_support(SpPhaser * ph, const Image * support, int flags, real
       sp_real(tmp->image->data[i]) = ph->amplitudes->data[i]*ph->amplitudes->data[i];
       sp_imag(tmp->image->data[i]) = 0;
     }
-    tmp->phased = 1;
+    tmp->phased = 0;
     tmp->shifted = 1;
     
-    Image * patterson = sp_image_ifft(tmp);
+    /* The intensities are real so |ifft| = |fft| and the patterson is
+       Hermitian. Only half of it needs to be calculated. */
+    Image * patterson = sp_image_rfft(tmp);
+    int hx = sp_image_x(patterson);
     real abs_threshold = sp_image_max(patterson,0,0,0,0)*value;
-    for(int i = 0;i<ph->image_size;i++){
-      if(sp_cabs(patterson->image->data[i]) > abs_threshold){
-	ph->pixel_flags->data[i] |= SpPixelInsideSupport;
-      }else{
-	ph->pixel_flags->data[i] &= ~SpPixelInsideSupport;
+    for(int z = 0;z<ph->nz;z++){
+      for(int y = 0;y<ph->ny;y++){
+	for(int x = 0;x<ph->nx;x++){
+	  int i = (z*ph->ny+y)*ph->nx+x;
+	  int j;
+	  if(x < hx){
+	    j = (z*ph->ny+y)*hx+x;
+	  }else{
+	    j = (((ph->nz-z)%ph->nz)*ph->ny+(ph->ny-y)%ph->ny)*hx+ph->nx-x;
+	  }
+	  if(sp_cabs(patterson->image->data[j]) > abs_threshold){
+	    ph->pixel_flags->data[i] |= SpPixelInsideSupport;
+	  }else{
+	    ph->pixel_flags->data[i] &= ~SpPixelInsideSupport;
+	  }
+	}
       }
     }
     sp_image_free(patterson);
@@ -729,6 +1233,7 @@ int sp_phaser_init_support(SpPhaser * ph, const Image * support, int flags, real
   }else{
     return -1;
   }
+  ph->spans_valid = 0;
   if(ph->engine == SpEngineCUDA){
 #ifdef _USE_CUDA
     if(!ph->d_pixel_flags){
@@ -744,7 +1249,7 @@ int sp_phaser_init_support(SpPhaser * ph, const Image * support, int flags, real
 
 const Image * sp_phaser_support(SpPhaser * ph){
   if(!ph->support){
-    ph->support = sp_image_alloc(ph->nx,ph->ny,ph->nz);    
+    ph->support = phaser_exposed_image_alloc(ph);
   }
   if(ph->iteration != ph->support_iteration){
     ph->support_iteration = ph->iteration;
@@ -765,12 +1270,45 @@ const Image * sp_phaser_support(SpPhaser * ph){
   return ph->support;
 }
 
-real sp_phaser_ereal(SpPhaser *ph) {
-  const Image *real_space = sp_phaser_model_before_projection(ph);
-  const Image *support = sp_phaser_support(ph);
+/* Arguments of the error reductions. Each part of the loop adds to its
+   own nom[part] and den[part], which are then summed in part order so
+   that the result doesn't depend on the scheduling of the threads. */
+typedef struct{
+  const Image * a;
+  const Image * b;
+  real * nom;
+  real * den;
+}PhaserReductionArgs;
+
+static real phaser_reduce(SpPhaser * ph, int n, SpThreadPoolFunction kernel, const Image * a, const Image * b){
+  int nparts = 1;
+  if(ph->engine == SpEngineCPUThreaded){
+    nparts = sp_thread_pool_size(phaser_thread_pool(ph));
+  }
+  real * nom = sp_malloc(sizeof(real)*nparts*2);
+  real * den = nom+nparts;
+  PhaserReductionArgs args = {a,b,nom,den};
+  for(int i = 0;i<nparts;i++){
+    nom[i] = 0;
+    den[i] = 0;
+  }
+  phaser_for(ph,n,kernel,&args);
+  real total_nom = 0;
+  real total_den = 0;
+  for(int i = 0;i<nparts;i++){
+    total_nom += nom[i];
+    total_den += den[i];
+  }
+  sp_free(nom);
+  return sqrt(total_nom / total_den);
+}
+
+static void phaser_ereal_kernel(void * p, int begin, int end, int part){
+  PhaserReductionArgs * args = p;
+  const Image *real_space = args->a;
+  const Image *support = args->b;
   real ereal_den = 0.;
   real ereal_nom = 0.;
-  const int image_size = sp_image_size(real_space);
   /*
   for (int i = 0; i < image_size; i++) {
     if (sp_real(support->image->data[i])) {
@@ -780,19 +1318,27 @@ real sp_phaser_ereal(SpPhaser *ph) {
     }
   }
   */
-  for (int i = 0; i < image_size; i++) {
+  for (int i = begin; i < end; i++) {
+    real p = sp_cabs2(real_space->image->data[i]);
     if (!sp_real(support->image->data[i])) {
-      ereal_nom += pow(sp_cabs(real_space->image->data[i]), 2);
+      ereal_nom += p;
     }
-    ereal_den += pow(sp_cabs(real_space->image->data[i]), 2);
+    ereal_den += p;
   }
-  return sqrt(ereal_nom / ereal_den);
+  args->nom[part] = ereal_nom;
+  args->den[part] = ereal_den;
 }
 
-real sp_phaser_efourier(SpPhaser *ph) {
-  const Image *fourier_space = sp_phaser_fmodel(ph);
-  const Image *amplitudes = sp_phaser_amplitudes(ph);
-  const int image_size = sp_image_size(fourier_space);
+real sp_phaser_ereal(SpPhaser *ph) {
+  const Image *real_space = sp_phaser_model_before_projection(ph);
+  const Image *support = sp_phaser_support(ph);
+  return phaser_reduce(ph,sp_image_size(real_space),phaser_ereal_kernel,real_space,support);
+}
+
+static void phaser_efourier_kernel(void * p, int begin, int end, int part){
+  PhaserReductionArgs * args = p;
+  const Image *fourier_space = args->a;
+  const Image *amplitudes = args->b;
   real efourier_den = 0.;
   real efourier_nom = 0.;
   /*
@@ -803,15 +1349,37 @@ real sp_phaser_efourier(SpPhaser *ph) {
     }
   }
   */
-  for (int i = 0; i < image_size; i++) {
+  for (int i = begin; i < end; i++) {
     if (amplitudes->mask->data[i]) {
-      efourier_nom += pow(sp_cabs(fourier_space->image->data[i]) - sp_cabs(amplitudes->image->data[i]), 2);
-      efourier_den += pow(sp_cabs(amplitudes->image->data[i]), 2);
+      real d = sp_cabs(fourier_space->image->data[i]) - sp_cabs(amplitudes->image->data[i]);
+      efourier_nom += d*d;
+      efourier_den += sp_cabs2(amplitudes->image->data[i]);
     } else {
-      efourier_den += pow(sp_cabs(fourier_space->image->data[i]), 2);
+      efourier_den += sp_cabs2(fourier_space->image->data[i]);
     }
   }
-  return sqrt(efourier_nom / efourier_den);
+  args->nom[part] = efourier_nom;
+  args->den[part] = efourier_den;
+}
+
+real sp_phaser_efourier(SpPhaser *ph) {
+  if(ph->efourier_iteration != ph->iteration){
+    const Image *fourier_space = sp_phaser_fmodel(ph);
+    const Image *amplitudes = sp_phaser_amplitudes(ph);
+    ph->efourier = phaser_reduce(ph,sp_image_size(fourier_space),phaser_efourier_kernel,fourier_space,amplitudes);
+    ph->efourier_iteration = ph->iteration;
+  }
+  return ph->efourier;
+}
+
+/* Returns the constraints the algorithm applies to the model */
+static SpPhasingConstraints phaser_algorithm_constraints(const SpPhasingAlgorithm * alg){
+  if(alg->type == SpER){
+    return ((SpPhasingERParameters *)alg->params)->constraints;
+  }else if(alg->type == SpDiffMap){
+    return ((SpPhasingDiffMapParameters *)alg->params)->constraints;
+  }
+  return ((SpPhasingHIOParameters *)alg->params)->constraints;
 }
 
 int sp_phaser_iterate(SpPhaser * ph, int iterations){
@@ -834,7 +1402,7 @@ int sp_phaser_iterate(SpPhaser * ph, int iterations){
   if(!ph->pixel_flags){
     return -5;
   }
-  if(!ph->model_change){
+  if(!ph->model_change && !phaser_borrows_masks(ph)){
     return -6;
   }
   /*
@@ -914,10 +1482,26 @@ int sp_phaser_iterate(SpPhaser * ph, int iterations){
     }else{
       phaser_iterate_pointer = phaser_iterate_er;
     }
+  }else if(ph->algorithm->type == SpRRR || ph->algorithm->type == SpAcceleratedER){
+    if(ph->engine == SpEngineCUDA){
+      fprintf(stderr,"Error: The CUDA engine doesn't support RRR and accelerated ER\n");
+      return -10;
+    }
+    phaser_iterate_pointer = (ph->algorithm->type == SpRRR) ? phaser_iterate_rrr : phaser_iterate_accelerated_er;
+  }
+  if(ph->real_object){
+    if((ph->algorithm->type != SpER && ph->algorithm->type != SpHIO && ph->algorithm->type != SpRAAR) ||
+       ph->phasing_objective != SpRecoverPhases ||
+       !(phaser_algorithm_constraints(ph->algorithm) & (SpRealObject|SpPositiveRealObject))){
+      fprintf(stderr,"Error: The real object mode needs ER, HIO or RAAR with real object constraints\n");
+      return -10;
+    }
+    phaser_iterate_pointer = phaser_iterate_real_object;
   }
   if(phaser_iterate_pointer == NULL){
     return -7;
   }
+  phaser_select_kernels(ph);
   int ret = 0;
   if(ph->sup_algorithm && ph->sup_algorithm->algorithms[0]->function){
     /* iterate up to the point of the support update */
@@ -932,6 +1516,7 @@ int sp_phaser_iterate(SpPhaser * ph, int iterations){
 	//ph->sup_algorithm->function(ph);
 	//((int(*)(SpPhaser *))ph->sup_algorithm->function)(ph);
 	sp_support_array_update(ph->sup_algorithm,ph);
+	sp_phaser_workspace_reset(ph);
 	
 	ph->iteration++;
 	iterations -= 1;
@@ -945,39 +1530,113 @@ int sp_phaser_iterate(SpPhaser * ph, int iterations){
   return ret;
 }
 
-static void phaser_apply_constraints(SpPhaser * ph,Image * new_model, SpPhasingConstraints constraints){
-  /* Apply constraints */
-  for(int i =0;i<sp_image_size(new_model);i++){
-    if(ph->pixel_flags->data[i] & SpPixelInsideSupport){
-    if(constraints & SpRealObject){
-      sp_imag(new_model->image->data[i]) = 0;
-    }else if(constraints & SpPositiveRealObject){
-      if(sp_real(new_model->image->data[i]) < 0){
-	if(constraints & SpPositivityFlipping){
-	  sp_real(new_model->image->data[i]) = fabs(sp_real(new_model->image->data[i]));
-	}else{
-	  sp_real(new_model->image->data[i]) = 0;
-	}
+/* Returns the value of metric in m */
+static real phaser_plateau_value(const SpPhaserMetrics * m, SpPlateauMetric metric){
+  if(metric == SpPlateauFourierError){
+    return m->efourier;
+  }
+  return m->model_change;
+}
+
+int sp_phaser_iterate_until(SpPhaser * ph, const SpPhaserStopPolicy * policy){
+  if(!ph){
+    return -1;
+  }
+  if(policy->max_iterations <= 0 && policy->max_seconds <= 0 && policy->plateau_metric == SpPlateauNone){
+    fprintf(stderr,"Error: Stopping policy without any limit\n");
+    return -9;
+  }
+  if(policy->plateau_metric != SpPlateauNone && ph->engine == SpEngineCUDA){
+    /* It would never see a plateau and could run forever */
+    fprintf(stderr,"Error: The CUDA engine does not record the metrics needed to detect a plateau\n");
+    return -10;
+  }
+  const int check_period = policy->check_period > 0 ? policy->check_period : 10;
+  const int window = policy->plateau_window > 0 ? policy->plateau_window : 1;
+  SpPhaserMetrics * history = NULL;
+  if(policy->plateau_metric != SpPlateauNone){
+    if(ph->metrics_capacity < window+1){
+      sp_phaser_set_metrics_capacity(ph,window+1);
+    }
+    history = sp_malloc(sizeof(SpPhaserMetrics)*(window+1));
+  }
+  const long long start = sp_gettime();
+  const long long budget = policy->max_seconds*1e6;
+  int done = 0;
+  int ret = 0;
+  while(1){
+    if(policy->max_iterations > 0 && done >= policy->max_iterations){
+      ret = SpStopMaxIterations;
+      break;
+    }
+    long long elapsed = sp_gettime()-start;
+    if(budget > 0 && elapsed >= budget){
+      ret = SpStopTimeBudget;
+      break;
+    }
+    if(history && sp_phaser_metrics(ph,history,window+1) == window+1){
+      real first = phaser_plateau_value(&history[0],policy->plateau_metric);
+      real last = phaser_plateau_value(&history[window],policy->plateau_metric);
+      /* <= so that a metric stuck at 0 counts as a plateau */
+      if(first-last <= policy->plateau_tolerance*first){
+	ret = SpStopPlateau;
+	break;
       }
-      sp_imag(new_model->image->data[i]) = 0;	
-    }else if(constraints & SpPositiveComplexObject){
-      if(sp_real(new_model->image->data[i]) < 0){
-	if(constraints & SpPositivityFlipping){
-	  sp_real(new_model->image->data[i]) = fabs(sp_real(new_model->image->data[i]));
-	}else{
-	  sp_real(new_model->image->data[i]) = 0;
-	}
+    }
+    int chunk = check_period;
+    if(policy->max_iterations > 0){
+      chunk = sp_min(chunk,policy->max_iterations-done);
+    }
+    if(budget > 0 && done > 0){
+      /* Don't run past the budget at the measured speed */
+      long long fits = (budget-elapsed)*done/(elapsed+1);
+      if(fits < chunk){
+	chunk = fits > 1 ? fits : 1;
       }
-      if(sp_imag(new_model->image->data[i]) < 0){
-	if(constraints & SpPositivityFlipping){
-	  sp_imag(new_model->image->data[i]) = fabs(sp_imag(new_model->image->data[i]));
-	}else{
-	  sp_imag(new_model->image->data[i]) = 0;
-	}
+    }
+    int err = sp_phaser_iterate(ph,chunk);
+    if(err){
+      ret = err;
+      break;
+    }
+    done += chunk;
+  }
+  if(history){
+    sp_free(history);
+  }
+  return ret;
+}
+
+/* Applies the object constraints to a pixel inside the support */
+static inline Complex phaser_constrain_pixel(Complex v, SpPhasingConstraints constraints){
+  if(constraints & SpRealObject){
+    sp_imag(v) = 0;
+  }else if(constraints & SpPositiveRealObject){
+    if(sp_real(v) < 0){
+      if(constraints & SpPositivityFlipping){
+	sp_real(v) = fabs(sp_real(v));
+      }else{
+	sp_real(v) = 0;
       }
     }
+    sp_imag(v) = 0;	
+  }else if(constraints & SpPositiveComplexObject){
+    if(sp_real(v) < 0){
+      if(constraints & SpPositivityFlipping){
+	sp_real(v) = fabs(sp_real(v));
+      }else{
+	sp_real(v) = 0;
+      }
+    }
+    if(sp_imag(v) < 0){
+      if(constraints & SpPositivityFlipping){
+	sp_imag(v) = fabs(sp_imag(v));
+      }else{
+	sp_imag(v) = 0;
+      }
     }
   }
+  return v;
 }
 
 static void phaser_apply_fourier_constraints(SpPhaser * ph,Image * new_amplitudes, SpPhasingConstraints constraints){
@@ -989,106 +1648,449 @@ static void phaser_apply_fourier_constraints(SpPhaser * ph,Image * new_amplitude
   }
 }
 
-static void phaser_module_projection(Image * a, sp_3matrix * amp, sp_3matrix * amp_min, sp_3matrix * amp_max, sp_i3matrix * pixel_flags, SpPhasingConstraints constraints){
-  if ((constraints & SpAmplitudeErrorMargin) && ((amp_min == NULL) || (amp_max == NULL))){
-    sp_error_fatal("Amplitude margin map is a null pointer.");
+/* Projects pixel i of a, which must be measured, on the measured amplitudes */
+static inline Complex phaser_module_project_pixel(Complex a, int i, sp_3matrix * amp, sp_3matrix * amp_min, sp_3matrix * amp_max, SpPhasingConstraints constraints){
+  float m = 1.;
+  if(!(constraints & SpAmplitudeErrorMargin)){
+    // Default: Projection on measured amplitude
+    m = amp->data[i]/sp_cabs(a);
   }
-  for(int i = 0;i<sp_image_size(a);i++){
-    float m = 1.;
-    if(pixel_flags->data[i] & SpPixelMeasuredAmplitude){
-      if(!(constraints & SpAmplitudeErrorMargin)){
-	// Default: Projection on measured amplitude
-	m = amp->data[i]/sp_cabs(a->image->data[i]);
-      }
-      else{
-	// Projection according to given amplitude error tolerance map
-	const float amp_a = sp_cabs(a->image->data[i]);
-	if (amp_a < amp_min->data[i]){
-	  m = amp_min->data[i]/amp_a;
-	}
-	else if (amp_a > amp_max->data[i]){
-	  m = amp_max->data[i]/amp_a;
-	}
-      }
-      // Do projection
-      if(isfinite(m)){
-	a->image->data[i] = sp_cscale(a->image->data[i],m);	  
-      }else{
-	sp_real(a->image->data[i]) = amp->data[i];
-	sp_imag(a->image->data[i]) = 0;
-      }
+  else{
+    // Projection according to given amplitude error tolerance map
+    const float amp_a = sp_cabs(a);
+    if (amp_a < amp_min->data[i]){
+      m = amp_min->data[i]/amp_a;
     }
+    else if (amp_a > amp_max->data[i]){
+      m = amp_max->data[i]/amp_a;
+    }
+  }
+  // Do projection
+  if(isfinite(m)){
+    return sp_cscale(a,m);
   }
+  return sp_cinit(amp->data[i],0);
 }
 
+/* Sums accumulated by the kernels as a by-product of their sweeps, from
+   which the metrics of an iteration are computed */
+typedef struct{
+  double ereal_nom;
+  double ereal_den;
+  double efourier_nom;
+  double efourier_den;
+  double support;
+  double change_nom;
+  double change_den;
+}PhaserMetricSums;
 
-static void phaser_phased_amplitudes_projection(Image * a, sp_c3matrix * phased_amp, sp_i3matrix * pixel_flags){
-  for(int i = 0;i<sp_image_size(a);i++){
-    if(pixel_flags->data[i] & SpPixelMeasuredAmplitude){
-      a->image->data[i] = phased_amp->data[i];
-    }
-  }  
+/* Arguments of the per-pixel kernels. Each kernel works on the pixels
+   [begin,end) so that the threaded engine can split it between threads. */
+typedef struct{
+  SpPhaser * ph;
+  Image * a;
+  SpPhasingConstraints constraints;
+  SpPhasingAlgorithmType type;
+  real beta;
+  real gamma2;
+  /* Pi2(f1) of the difference map */
+  const Image * f1;
+  /* one per part, NULL when the metrics are not recorded */
+  PhaserMetricSums * sums;
+  /* half spectrum of the real object mode */
+  Complex * half_spectrum;
+}PhaserKernelArgs;
+
+/* Fourier space kernels, which work on the pixels [begin,end) of data */
+typedef void (*PhaserFourierKernel)(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end);
+/* Real space kernels, which update the pixels [begin,end) of the model */
+typedef void (*PhaserRealSpaceKernel)(const PhaserKernelArgs * args, PhaserMetricSums * sums, int begin, int end);
+
+/* The per pixel kernels of a phaser, instantiated for its constraints
+   and objective by phaser_select_kernels(). Each kernel comes in two
+   versions, indexed by whether the metrics are accumulated. */
+typedef struct PhaserKernels{
+  /* what the kernels were selected for */
+  SpPhasingConstraints constraints;
+  SpPhasingObjective objective;
+  PhaserFourierKernel fourier_projection[2];
+  PhaserFourierKernel module_projection[2];
+  PhaserRealSpaceKernel real_space_update[2];
+  /* real object mode */
+  PhaserFourierKernel half_projection[2];
+  PhaserRealSpaceKernel real_object_update[2];
+}PhaserKernels;
+
+static inline void phaser_add_fourier_metrics(PhaserMetricSums * acc, Complex v, int measured, real amplitude){
+  if(measured){
+    real d = sp_cabs(v)-amplitude;
+    acc->efourier_nom += d*d;
+    acc->efourier_den += amplitude*amplitude;
+  }else{
+    acc->efourier_den += sp_cabs2(v);
+  }
 }
 
-static int phaser_iterate_er(SpPhaser * ph,int iterations){
-  SpPhasingERParameters * params = ph->algorithm->params;
-  for(int i = 0;i<iterations;i++){
-    Image * swap = ph->g0;
-    ph->g0 = ph->g1;
-    ph->g1 = swap;
-    sp_image_fft_fast(ph->g0,ph->g1);
-    phaser_apply_fourier_constraints(ph,ph->g1,params->constraints);
-    if(ph->phasing_objective == SpRecoverPhases){
-      phaser_module_projection(ph->g1,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,ph->pixel_flags,params->constraints);
-    }else if(ph->phasing_objective == SpRecoverAmplitudes){
-      phaser_phased_amplitudes_projection(ph->g1,ph->phased_amplitudes,ph->pixel_flags);
+static inline void phaser_add_real_metrics(PhaserMetricSums * acc, int inside, Complex gp, Complex g0, Complex g1){
+  real p = sp_cabs2(gp);
+  if(inside){
+    acc->support += 1;
+  }else{
+    acc->ereal_nom += p;
+  }
+  acc->ereal_den += p;
+  acc->change_nom += sp_cabs2(sp_csub(g1,g0));
+  acc->change_den += sp_cabs2(g1);
+}
+
+static inline void phaser_metric_sums_add(PhaserMetricSums * sums, const PhaserMetricSums * acc){
+  sums->ereal_nom += acc->ereal_nom;
+  sums->ereal_den += acc->ereal_den;
+  sums->efourier_nom += acc->efourier_nom;
+  sums->efourier_den += acc->efourier_den;
+  sums->support += acc->support;
+  sums->change_nom += acc->change_nom;
+  sums->change_den += acc->change_den;
+}
+
+/* Number of parts the loops of ph are split in */
+static int phaser_nparts(SpPhaser * ph){
+  if(ph->engine == SpEngineCPUThreaded){
+    return sp_thread_pool_size(phaser_thread_pool(ph));
+  }
+  return 1;
+}
+
+/* Returns zeroed sums for each part of the loops of the next iteration
+   of nmodels models, taken from the workspace of ph, or NULL if ph
+   does not record metrics */
+static PhaserMetricSums * phaser_metrics_begin(SpPhaser * ph, int nmodels){
+  if(!ph->metrics_capacity){
+    return NULL;
+  }
+  int n = phaser_nparts(ph)*nmodels;
+  PhaserMetricSums * sums = sp_phaser_workspace_alloc(ph,sizeof(PhaserMetricSums)*n);
+  memset(sums,0,sizeof(PhaserMetricSums)*n);
+  return sums;
+}
+
+/* Adds the metrics of the iteration that just finished to the ring
+   buffer of ph. The parts are added up in order so that the values only
+   depend on the number of threads. */
+static void phaser_metrics_record(SpPhaser * ph, const PhaserMetricSums * sums, int nparts){
+  if(!sums || !ph->metrics_capacity){
+    return;
+  }
+  PhaserMetricSums total = {0};
+  for(int i = 0;i<nparts;i++){
+    phaser_metric_sums_add(&total,&sums[i]);
+  }
+  SpPhaserMetrics * m = &ph->metrics[ph->metrics_count % ph->metrics_capacity];
+  m->iteration = ph->iteration;
+  m->ereal = sqrt(total.ereal_nom/total.ereal_den);
+  m->efourier = sqrt(total.efourier_nom/total.efourier_den);
+  m->support_size = total.support;
+  m->model_change = sqrt(total.change_nom/total.change_den);
+  ph->metrics_count++;
+}
+
+/* Runs kernel over the n pixels, split between the phaser threads
+   when using the threaded engine. */
+static void phaser_for(SpPhaser * ph, int n, SpThreadPoolFunction kernel, void * args){
+  if(ph->engine == SpEngineCPUThreaded){
+    sp_thread_pool_for(phaser_thread_pool(ph),n,kernel,args);
+  }else{
+    kernel(args,0,n,0);
+  }
+}
+
+/* Module projection of the pixels [begin,end) of data, leaving the
+   unmeasured ones alone. margins and metrics must be constants, see
+   phaser_select_kernels(). */
+static inline void phaser_module_projection_generic(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end,
+						    const int margins, const int metrics){
+  const SpPhasingConstraints constraints = margins ? SpAmplitudeErrorMargin : 0;
+  PhaserMetricSums acc = {0};
+  PhaserRuns runs;
+  int run_begin;
+  int run_end;
+  int measured;
+  phaser_runs_init(&runs,&ph->measured_spans,begin,end);
+  while((measured = phaser_runs_next(&runs,&run_begin,&run_end)) >= 0){
+    if(measured){
+      for(int i = run_begin;i<run_end;i++){
+	if(metrics){
+	  phaser_add_fourier_metrics(&acc,data[i],1,ph->amplitudes->data[i]);
+	}
+	data[i] = phaser_module_project_pixel(data[i],i,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,constraints);
+      }
+    }else if(metrics){
+      for(int i = run_begin;i<run_end;i++){
+	phaser_add_fourier_metrics(&acc,data[i],0,ph->amplitudes->data[i]);
+      }
+    }
+  }
+  if(metrics){
+    phaser_metric_sums_add(sums,&acc);
+  }
+}
+
+static void phaser_module_projection_kernel(void * p, int begin, int end, int part){
+  PhaserKernelArgs * args = p;
+  PhaserMetricSums * sums = args->sums ? &args->sums[part] : NULL;
+  args->ph->kernels->module_projection[sums != NULL](args->ph,args->a->image->data,sums,begin,end);
+}
+
+/* Accumulates the Fourier error of a in sums when not NULL */
+static void phaser_module_projection(SpPhaser * ph, Image * a, SpPhasingConstraints constraints, PhaserMetricSums * sums){
+  PhaserKernelArgs args = {ph,a,constraints};
+  args.sums = sums;
+  if ((constraints & SpAmplitudeErrorMargin) && ((ph->amplitudes_min == NULL) || (ph->amplitudes_max == NULL))){
+    sp_error_fatal("Amplitude margin map is a null pointer.");
+  }
+  phaser_for(ph,sp_image_size(a),phaser_module_projection_kernel,&args);
+}
+
+/* Fourier projection of the pixels [begin,end) of data, the transform
+   of the model of ph. The Fourier error of the model is added to sums
+   when metrics is set. All the flags must be constants, see
+   phaser_select_kernels(). */
+static inline void phaser_fourier_projection_generic(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end,
+						     const int recover_phases, const int centrosymmetric, const int margins,
+						     const int metrics){
+  const real scale = 1.0/ph->image_size;
+  const int fourier_metrics = metrics && ph->amplitudes;
+  const SpPhasingConstraints constraints = margins ? SpAmplitudeErrorMargin : 0;
+  PhaserMetricSums acc = {0};
+  PhaserRuns runs;
+  int run_begin;
+  int run_end;
+  int measured;
+  phaser_runs_init(&runs,&ph->measured_spans,begin,end);
+  while((measured = phaser_runs_next(&runs,&run_begin,&run_end)) >= 0){
+    if(measured){
+      for(int i = run_begin;i<run_end;i++){
+	Complex v = data[i];
+	if(fourier_metrics){
+	  phaser_add_fourier_metrics(&acc,v,1,ph->amplitudes->data[i]);
+	}
+	if(centrosymmetric){
+	  sp_imag(v) = 0;
+	}
+	if(recover_phases){
+	  v = phaser_module_project_pixel(v,i,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,constraints);
+	}else{
+	  v = ph->phased_amplitudes->data[i];
+	}
+	data[i] = sp_cscale(v,scale);
+      }
     }else{
-      abort();
+      for(int i = run_begin;i<run_end;i++){
+	Complex v = data[i];
+	if(fourier_metrics){
+	  phaser_add_fourier_metrics(&acc,v,0,ph->amplitudes->data[i]);
+	}
+	if(centrosymmetric){
+	  sp_imag(v) = 0;
+	}
+	data[i] = sp_cscale(v,scale);
+      }
     }
-    sp_image_ifft_fast(ph->g1,ph->gp);
-    sp_image_scale(ph->gp,1.0/sp_image_size(ph->gp));
-    for(int i =0;i<sp_image_size(ph->gp);i++){
-      if(ph->pixel_flags->data[i] & SpPixelInsideSupport){
-	// Nothing to do here 
-	ph->g1->image->data[i] = ph->gp->image->data[i];
+  }
+  if(metrics){
+    phaser_metric_sums_add(sums,&acc);
+  }
+}
+
+static void phaser_fourier_projection_kernel(void * p, int begin, int end, int part){
+  PhaserKernelArgs * args = p;
+  PhaserMetricSums * sums = args->sums ? &args->sums[part] : NULL;
+  args->ph->kernels->fourier_projection[sums != NULL](args->ph,args->a->image->data,sums,begin,end);
+}
+
+static void phaser_check_fourier_projection(SpPhaser * ph, SpPhasingConstraints constraints){
+  if(ph->phasing_objective != SpRecoverPhases && ph->phasing_objective != SpRecoverAmplitudes){
+    abort();
+  }
+  if(ph->phasing_objective == SpRecoverPhases && (constraints & SpAmplitudeErrorMargin) &&
+     ((ph->amplitudes_min == NULL) || (ph->amplitudes_max == NULL))){
+    sp_error_fatal("Amplitude margin map is a null pointer.");
+  }
+}
+
+/* First fused kernel of the CPU engine. In a single sweep over the
+   transform of the current model it applies the Fourier space
+   constraints, the projection required by the phasing objective and the
+   1/N normalization which would otherwise follow the inverse transform. */
+static void phaser_fourier_projection(SpPhaser * ph, Image * a, SpPhasingConstraints constraints, PhaserMetricSums * sums){
+  PhaserKernelArgs args = {ph,a,constraints};
+  args.sums = sums;
+  phaser_check_fourier_projection(ph,constraints);
+  phaser_for(ph,sp_image_size(a),phaser_fourier_projection_kernel,&args);
+}
+
+/* Real space update of the pixels [begin,end) of the model of ph. The
+   real space metrics are added to sums when metrics is set. constraints
+   and metrics must be constants, see phaser_select_kernels(). */
+static inline void phaser_real_space_update_generic(const PhaserKernelArgs * args, PhaserMetricSums * sums, int begin, int end,
+						    const SpPhasingConstraints constraints, const int metrics){
+  SpPhaser * ph = args->ph;
+  PhaserMetricSums acc = {0};
+  const real beta = args->beta;
+  const Complex * g0 = ph->g0->image->data;
+  const Complex * gp = ph->gp->image->data;
+  Complex * g1 = ph->g1->image->data;
+  PhaserRuns runs;
+  int run_begin;
+  int run_end;
+  int inside;
+  phaser_runs_init(&runs,&ph->support_spans,begin,end);
+  while((inside = phaser_runs_next(&runs,&run_begin,&run_end)) >= 0){
+    if(args->type == SpDiffMap){
+      /* gp holds Pi2(rho) and f1 Pi2(f1), both still to be divided by size */
+      const int size = ph->image_size;
+      const real gamma2 = args->gamma2;
+      const Complex * Pi2f1 = args->f1->image->data;
+      if(inside){
+	for(int i = run_begin;i<run_end;i++){
+	  sp_real(g1[i]) = sp_real(g0[i])+(beta)*((1+gamma2)*sp_real(gp[i])/size-gamma2*sp_real(g0[i]));
+	  sp_imag(g1[i]) = sp_imag(g0[i])+(beta)*((1+gamma2)*sp_imag(gp[i])/size-gamma2*sp_imag(g0[i]));
+	  sp_real(g1[i]) -= beta*sp_real(Pi2f1[i])/size;
+	  sp_imag(g1[i]) -= beta*sp_imag(Pi2f1[i])/size;
+	  g1[i] = phaser_constrain_pixel(g1[i],constraints);
+	  if(metrics){
+	    phaser_add_real_metrics(&acc,1,gp[i],g0[i],g1[i]);
+	  }
+	}
       }else{
-	ph->g1->image->data[i] = sp_cinit(0,0);
+	for(int i = run_begin;i<run_end;i++){
+	  sp_real(g1[i]) = sp_real(g0[i])-beta*sp_real(Pi2f1[i])/size;
+	  sp_imag(g1[i]) = sp_imag(g0[i])-beta*sp_imag(Pi2f1[i])/size;
+	  if(metrics){
+	    phaser_add_real_metrics(&acc,0,gp[i],g0[i],g1[i]);
+	  }
+	}
+      }
+    }else if(inside && args->type == SpRRR){
+      /* x + beta*(Ps(2*Pm(x)-x)-Pm(x)) */
+      for(int i = run_begin;i<run_end;i++){
+	Complex reflected = phaser_constrain_pixel(sp_csub(sp_cscale(gp[i],2),g0[i]),constraints);
+	g1[i] = sp_cadd(g0[i],sp_cscale(sp_csub(reflected,gp[i]),beta));
+	if(metrics){
+	  phaser_add_real_metrics(&acc,1,gp[i],g0[i],g1[i]);
+	}
+      }
+    }else if(inside){
+      /* The same for ER, HIO and RAAR */
+      for(int i = run_begin;i<run_end;i++){
+	g1[i] = phaser_constrain_pixel(gp[i],constraints);
+	if(metrics){
+	  phaser_add_real_metrics(&acc,1,gp[i],g0[i],g1[i]);
+	}
+      }
+    }else{
+      switch(args->type){
+      case SpER:
+	for(int i = run_begin;i<run_end;i++){
+	  g1[i] = sp_cinit(0,0);
+	  if(metrics){
+	    phaser_add_real_metrics(&acc,0,gp[i],g0[i],g1[i]);
+	  }
+	}
+	break;
+      case SpHIO:
+      case SpRRR:
+	/* Outside the support RRR reduces to HIO */
+	for(int i = run_begin;i<run_end;i++){
+	  g1[i] = sp_csub(g0[i],sp_cscale(gp[i],beta));
+	  if(metrics){
+	    phaser_add_real_metrics(&acc,0,gp[i],g0[i],g1[i]);
+	  }
+	}
+	break;
+      case SpRAAR:
+	/* A bit of documentation about the equation:
+	   
+	   Rs = 2*Ps-I; Rm = 2*Pm-I
+	   
+	   RAAR = 1/2 * beta * (RsRm + I) + (1 - beta) * Pm;    
+	   RAAR = 2*beta*Ps*Pm+(1-2*beta)*Pm - beta * (Ps-I)
+	   
+	   Which reduces to:
+	   
+	   Inside the support: Pm
+	   Outside the support: (1 - 2*beta)*Pm + beta*I
+	   
+	*/    
+	for(int i = run_begin;i<run_end;i++){
+	  g1[i] = sp_cadd(sp_cscale(gp[i],1-2*beta),sp_cscale(g0[i],beta));
+	  if(metrics){
+	    phaser_add_real_metrics(&acc,0,gp[i],g0[i],g1[i]);
+	  }
+	}
+	break;
+      default:
+	abort();
       }
     }
-    phaser_apply_constraints(ph,ph->g1,params->constraints);
+  }
+  if(metrics){
+    phaser_metric_sums_add(sums,&acc);
+  }
+}
+
+static void phaser_real_space_update_kernel(void * p, int begin, int end, int part){
+  PhaserKernelArgs * args = p;
+  PhaserMetricSums * sums = args->sums ? &args->sums[part] : NULL;
+  args->ph->kernels->real_space_update[sums != NULL](args,sums,begin,end);
+}
+
+/* Second fused kernel of the CPU engine. In a single sweep it combines
+   the projected model gp with the previous model g0 according to the
+   support rule of the algorithm and applies the object constraints
+   inside the support, writing the new model to g1. */
+static void phaser_real_space_update(SpPhaser * ph, SpPhasingAlgorithmType type, real beta, SpPhasingConstraints constraints,
+				     PhaserMetricSums * sums){
+  PhaserKernelArgs args = {ph,NULL,constraints,type,beta};
+  args.sums = sums;
+  phaser_for(ph,ph->image_size,phaser_real_space_update_kernel,&args);
+}
+
+static int phaser_iterate_er(SpPhaser * ph,int iterations){
+  SpPhasingERParameters * params = ph->algorithm->params;
+  phaser_update_spans(ph);
+  for(int i = 0;i<iterations;i++){
+    Image * swap = ph->g0;
+    ph->g0 = ph->g1;
+    ph->g1 = swap;
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    phaser_transform_model(ph);
+    phaser_fourier_projection(ph,ph->g1,params->constraints,sums);
+    sp_image_ifft_fast_threads(ph->g1,ph->gp,ph->fft_nthreads);
+    phaser_real_space_update(ph,SpER,0,params->constraints,sums);
     ph->iteration++;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
   }
   return 0;
 }
 
 static int phaser_iterate_hio(SpPhaser * ph,int iterations){
   SpPhasingHIOParameters * params = ph->algorithm->params;
+  phaser_update_spans(ph);
   for(int i = 0;i<iterations;i++){
     real beta = sp_smap_interpolate(params->beta,ph->iteration);
     Image * swap = ph->g0;
     ph->g0 = ph->g1;
     ph->g1 = swap;
-    sp_image_fft_fast(ph->g0,ph->g1);
-    phaser_apply_fourier_constraints(ph,ph->g1,params->constraints);
-    if(ph->phasing_objective == SpRecoverPhases){
-      phaser_module_projection(ph->g1,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,ph->pixel_flags,params->constraints);
-    }else if(ph->phasing_objective == SpRecoverAmplitudes){
-      phaser_phased_amplitudes_projection(ph->g1,ph->phased_amplitudes,ph->pixel_flags);
-    }else{
-      abort();
-    }
-    sp_image_ifft_fast(ph->g1,ph->gp);
-    sp_image_scale(ph->gp,1.0/sp_image_size(ph->gp));
-    for(int i =0;i<sp_image_size(ph->gp);i++){
-      if(ph->pixel_flags->data[i] & SpPixelInsideSupport){
-	// Nothing to do here 
-	ph->g1->image->data[i] = ph->gp->image->data[i];
-      }else{
-	ph->g1->image->data[i] = sp_csub(ph->g0->image->data[i],sp_cscale(ph->gp->image->data[i],beta));
-      }
-    }
-    phaser_apply_constraints(ph,ph->g1,params->constraints);
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    phaser_transform_model(ph);
+    phaser_fourier_projection(ph,ph->g1,params->constraints,sums);
+    sp_image_ifft_fast_threads(ph->g1,ph->gp,ph->fft_nthreads);
+    phaser_real_space_update(ph,SpHIO,beta,params->constraints,sums);
     ph->iteration++;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
   }
   return 0;
 }
@@ -1096,53 +2098,92 @@ static int phaser_iterate_hio(SpPhaser * ph,int iterations){
 
 static int phaser_iterate_raar(SpPhaser * ph,int iterations){
   SpPhasingRAARParameters * params = ph->algorithm->params;
+  phaser_update_spans(ph);
   for(int i = 0;i<iterations;i++){
     real beta = sp_smap_interpolate(params->beta,ph->iteration);
     Image * swap = ph->g0;
     ph->g0 = ph->g1;
     ph->g1 = swap;
-    sp_image_fft_fast(ph->g0,ph->g1);
-    phaser_apply_fourier_constraints(ph,ph->g1,params->constraints);
-    SpPhasingHIOParameters * params = ph->algorithm->params;
-    if(ph->phasing_objective == SpRecoverPhases){
-      phaser_module_projection(ph->g1,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,ph->pixel_flags,params->constraints);
-    }else if(ph->phasing_objective == SpRecoverAmplitudes){
-      phaser_phased_amplitudes_projection(ph->g1,ph->phased_amplitudes,ph->pixel_flags);
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    phaser_transform_model(ph);
+    phaser_fourier_projection(ph,ph->g1,params->constraints,sums);
+    sp_image_ifft_fast_threads(ph->g1,ph->gp,ph->fft_nthreads);
+    phaser_real_space_update(ph,SpRAAR,beta,params->constraints,sums);
+    ph->iteration++;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
+  }
+  return 0;
+}
+
+
+static int phaser_iterate_rrr(SpPhaser * ph,int iterations){
+  SpPhasingRRRParameters * params = ph->algorithm->params;
+  phaser_update_spans(ph);
+  for(int i = 0;i<iterations;i++){
+    real beta = sp_smap_interpolate(params->beta,ph->iteration);
+    Image * swap = ph->g0;
+    ph->g0 = ph->g1;
+    ph->g1 = swap;
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    phaser_transform_model(ph);
+    phaser_fourier_projection(ph,ph->g1,params->constraints,sums);
+    sp_image_ifft_fast_threads(ph->g1,ph->gp,ph->fft_nthreads);
+    phaser_real_space_update(ph,SpRRR,beta,params->constraints,sums);
+    ph->iteration++;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
+  }
+  return 0;
+}
+
+/* y = x+momentum*(x-x_prev), with x in g0 and x_prev in g1, written
+   over g1 */
+static void phaser_momentum_kernel(void * p, int begin, int end, int part){
+  PhaserKernelArgs * args = p;
+  const real momentum = args->beta;
+  const Complex * g0 = args->ph->g0->image->data;
+  Complex * g1 = args->ph->g1->image->data;
+  for(int i = begin;i<end;i++){
+    sp_real(g1[i]) = sp_real(g0[i])+momentum*(sp_real(g0[i])-sp_real(g1[i]));
+    sp_imag(g1[i]) = sp_imag(g0[i])+momentum*(sp_imag(g0[i])-sp_imag(g1[i]));
+  }
+}
+
+static int phaser_iterate_accelerated_er(SpPhaser * ph,int iterations){
+  SpPhasingAcceleratedERParameters * params = ph->algorithm->params;
+  phaser_update_spans(ph);
+  for(int i = 0;i<iterations;i++){
+    /* Without the previous model the step is plain ER */
+    real momentum = 0;
+    if(ph->momentum_iteration == ph->iteration){
+      momentum = sp_smap_interpolate(params->beta,ph->iteration);
+    }
+    Image * swap = ph->g0;
+    ph->g0 = ph->g1;
+    ph->g1 = swap;
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    if(momentum){
+      PhaserKernelArgs args = {ph,NULL,params->constraints,SpAcceleratedER,momentum};
+      phaser_for(ph,ph->image_size,phaser_momentum_kernel,&args);
+      sp_image_fft_fast_threads(ph->g1,ph->g1,ph->fft_nthreads);
     }else{
-      abort();
-    }
-    sp_image_ifft_fast(ph->g1,ph->gp);
-    sp_image_scale(ph->gp,1.0/sp_image_size(ph->gp));
-    for(int i =0;i<sp_image_size(ph->gp);i++){
-      /* A bit of documentation about the equation:
-	 
-	 Rs = 2*Ps-I; Rm = 2*Pm-I
-	 
-	 RAAR = 1/2 * beta * (RsRm + I) + (1 - beta) * Pm;    
-	 RAAR = 2*beta*Ps*Pm+(1-2*beta)*Pm - beta * (Ps-I)
-	 
-	 Which reduces to:
-	 
-	 Inside the support: Pm
-	 Outside the support: (1 - 2*beta)*Pm + beta*I
-	 
-      */    
-      if(ph->pixel_flags->data[i] & SpPixelInsideSupport){
-	// Nothing to do here 
-	ph->g1->image->data[i] = ph->gp->image->data[i];
-      }else{
-	ph->g1->image->data[i] = sp_cadd(sp_cscale(ph->gp->image->data[i],1-2*beta),sp_cscale(ph->g0->image->data[i],beta));      
-      }
+      phaser_transform_model(ph);
     }
-    phaser_apply_constraints(ph,ph->g1,params->constraints);
+    phaser_fourier_projection(ph,ph->g1,params->constraints,sums);
+    sp_image_ifft_fast_threads(ph->g1,ph->gp,ph->fft_nthreads);
+    phaser_real_space_update(ph,SpER,0,params->constraints,sums);
     ph->iteration++;
+    ph->momentum_iteration = ph->iteration;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
   }
   return 0;
 }
 
-
 static int phaser_iterate_diff_map(SpPhaser * ph,int iterations){
   SpPhasingDiffMapParameters * params = ph->algorithm->params;
+  phaser_update_spans(ph);
   const real gamma1 = params->gamma1;
   const real gamma2 = params->gamma2;
   for(int i = 0;i<iterations;i++){
@@ -1150,47 +2191,828 @@ static int phaser_iterate_diff_map(SpPhaser * ph,int iterations){
     Image * swap = ph->g0;
     ph->g0 = ph->g1;
     ph->g1 = swap;
-    sp_image_fft_fast(ph->g0,ph->g1);
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    phaser_transform_model(ph);
     phaser_apply_fourier_constraints(ph,ph->g1,params->constraints);
-    Image * f1 = phaser_iterate_diff_map_f1(ph->g0,ph->pixel_flags,gamma1);
-    sp_image_fft_fast(f1,f1);
-    phaser_module_projection(f1,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,ph->pixel_flags,params->constraints);
-    sp_image_ifft_fast(f1,f1);
+    Image f1_view;
+    sp_c3matrix f1_data;
+    Image * f1 = phaser_image_view(ph,&f1_view,&f1_data,sp_phaser_workspace_alloc(ph,sizeof(Complex)*ph->image_size));
+    phaser_iterate_diff_map_f1(f1->image->data,ph->g0->image->data,&ph->support_spans,ph->image_size,gamma1);
+    sp_image_fft_fast_threads(f1,f1,ph->fft_nthreads);
+    phaser_module_projection(ph,f1,params->constraints,NULL);
+    sp_image_ifft_fast_threads(f1,f1,ph->fft_nthreads);
     Image * Pi2f1 = f1;
-    phaser_module_projection(ph->g1,ph->amplitudes,ph->amplitudes_min,ph->amplitudes_max,ph->pixel_flags,params->constraints);
-    sp_image_ifft_fast(ph->g1,ph->gp);
-    Image * Pi2rho = ph->gp;
-    
-    int size = ph->image_size;
-    for(int i = 0;i<size;i++){
-      if(ph->pixel_flags->data[i] & SpPixelInsideSupport){
-	sp_real(ph->g1->image->data[i]) = sp_real(ph->g0->image->data[i])+(beta)*((1+gamma2)*sp_real(Pi2rho->image->data[i])/size-gamma2*sp_real(ph->g0->image->data[i]));
-	sp_imag(ph->g1->image->data[i]) = sp_imag(ph->g0->image->data[i])+(beta)*((1+gamma2)*sp_imag(Pi2rho->image->data[i])/size-gamma2*sp_imag(ph->g0->image->data[i]));
+    phaser_module_projection(ph,ph->g1,params->constraints,sums);
+    sp_image_ifft_fast_threads(ph->g1,ph->gp,ph->fft_nthreads);
+    PhaserKernelArgs args = {ph,NULL,params->constraints,SpDiffMap,beta,gamma2,Pi2f1,sums};
+    phaser_for(ph,ph->image_size,phaser_real_space_update_kernel,&args);
+    ph->iteration++;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
+  }
+  return 0;
+}
+
+/* Writes the reflection of real_in through the support, scaled by
+   gamma1 outside of it, to out */
+static void phaser_iterate_diff_map_f1(Complex * out, const Complex * real_in, const SpPixelSpans * support, int size, real gamma1){
+  PhaserRuns runs;
+  int run_begin;
+  int run_end;
+  int inside;
+  phaser_runs_init(&runs,support,0,size);
+  while((inside = phaser_runs_next(&runs,&run_begin,&run_end)) >= 0){
+    if(inside){
+      /* 1+gamma1-gamma1 is 1 so  do nothing */
+      memcpy(&out[run_begin],&real_in[run_begin],sizeof(Complex)*(run_end-run_begin));
+    }else{
+      for(int i = run_begin;i<run_end;i++){
+	sp_real(out[i]) = -gamma1*sp_real(real_in[i]);
+	sp_imag(out[i]) = -gamma1*sp_imag(real_in[i]);
+      }
+    }
+  }
+}
+
+/* Real object mode */
+
+/* Set in half_flags for the pixels whose mirror image F(-k) = conj(F(k))
+   is not part of the half spectrum, so that they count twice */
+#define PHASER_HALF_PAIRED 4
+
+static void phaser_free_half_spectrum(SpPhaser * ph){
+  if(ph->half_amplitudes){
+    sp_3matrix_free(ph->half_amplitudes);
+    ph->half_amplitudes = NULL;
+  }
+  if(ph->half_amplitudes_min){
+    sp_3matrix_free(ph->half_amplitudes_min);
+    sp_3matrix_free(ph->half_amplitudes_max);
+    ph->half_amplitudes_min = NULL;
+    ph->half_amplitudes_max = NULL;
+  }
+  if(ph->half_flags){
+    sp_free(ph->half_flags);
+    ph->half_flags = NULL;
+  }
+  phaser_spans_free(&ph->half_measured_spans);
+}
+
+/* Drops everything derived from the amplitudes and their margins, which
+   is rebuilt from the new ones when needed */
+static void phaser_invalidate_amplitudes(SpPhaser * ph){
+  if(ph->amplitudes_image){
+    sp_image_free(ph->amplitudes_image);
+    ph->amplitudes_image = NULL;
+  }
+  ph->efourier_iteration = -1;
+  ph->spans_valid = 0;
+  phaser_free_half_spectrum(ph);
+}
+
+/* Value of m for a pixel of the half spectrum, from the values of the
+   pixel i and its mirror image j in the full one */
+static real phaser_half_value(const sp_3matrix * m, int i, int j, int measured_i, int measured_j){
+  if(measured_i && measured_j){
+    return (m->data[i]+m->data[j])/2;
+  }else if(measured_j){
+    return m->data[j];
+  }
+  return m->data[i];
+}
+
+/* Builds the amplitudes and flags of the half spectrum. As the spectrum
+   of a real object is Hermitian a pixel and its mirror image share
+   their amplitude, so the two measurements are averaged. */
+static void phaser_half_spectrum_prepare(SpPhaser * ph){
+  if(ph->half_flags){
+    return;
+  }
+  const int nx = ph->nx;
+  const int ny = ph->ny;
+  const int nz = ph->nz;
+  const int hx = nx/2+1;
+  const int margins = ph->amplitudes_min && ph->amplitudes_max;
+  ph->half_amplitudes = sp_3matrix_alloc(hx,ny,nz);
+  if(margins){
+    ph->half_amplitudes_min = sp_3matrix_alloc(hx,ny,nz);
+    ph->half_amplitudes_max = sp_3matrix_alloc(hx,ny,nz);
+  }
+  ph->half_flags = sp_malloc(sizeof(int)*ph->half_size);
+  for(int z = 0;z<nz;z++){
+    for(int y = 0;y<ny;y++){
+      for(int x = 0;x<hx;x++){
+	int h = (z*ny+y)*hx+x;
+	int i = (z*ny+y)*nx+x;
+	int mx = (nx-x)%nx;
+	int j = (((nz-z)%nz)*ny+(ny-y)%ny)*nx+mx;
+	int measured_i = ph->pixel_flags->data[i] & SpPixelMeasuredAmplitude;
+	int measured_j = ph->pixel_flags->data[j] & SpPixelMeasuredAmplitude;
+	ph->half_amplitudes->data[h] = phaser_half_value(ph->amplitudes,i,j,measured_i,measured_j);
+	if(margins){
+	  ph->half_amplitudes_min->data[h] = phaser_half_value(ph->amplitudes_min,i,j,measured_i,measured_j);
+	  ph->half_amplitudes_max->data[h] = phaser_half_value(ph->amplitudes_max,i,j,measured_i,measured_j);
+	}
+	ph->half_flags[h] = (measured_i || measured_j) ? SpPixelMeasuredAmplitude : 0;
+	if(mx >= hx){
+	  ph->half_flags[h] |= PHASER_HALF_PAIRED;
+	}
+      }
+    }
+  }
+  phaser_spans_build(&ph->half_measured_spans,ph->half_flags,ph->half_size,SpPixelMeasuredAmplitude);
+}
+
+/* Fourier projection of the pixels [begin,end) of the half spectrum,
+   like phaser_fourier_projection_generic() */
+static inline void phaser_half_projection_generic(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end,
+						  const int centrosymmetric, const int margins, const int metrics){
+  const real scale = 1.0/ph->image_size;
+  const SpPhasingConstraints constraints = margins ? SpAmplitudeErrorMargin : 0;
+  const int * flags = ph->half_flags;
+  PhaserMetricSums acc = {0};
+  PhaserRuns runs;
+  int run_begin;
+  int run_end;
+  int measured;
+  phaser_runs_init(&runs,&ph->half_measured_spans,begin,end);
+  while((measured = phaser_runs_next(&runs,&run_begin,&run_end)) >= 0){
+    for(int i = run_begin;i<run_end;i++){
+      Complex v = data[i];
+      if(metrics){
+	phaser_add_fourier_metrics(&acc,v,measured,ph->half_amplitudes->data[i]);
+	if(flags[i] & PHASER_HALF_PAIRED){
+	  phaser_add_fourier_metrics(&acc,v,measured,ph->half_amplitudes->data[i]);
+	}
+      }
+      if(centrosymmetric){
+	sp_imag(v) = 0;
+      }
+      if(measured){
+	v = phaser_module_project_pixel(v,i,ph->half_amplitudes,ph->half_amplitudes_min,ph->half_amplitudes_max,constraints);
+      }
+      data[i] = sp_cscale(v,scale);
+    }
+  }
+  if(metrics){
+    phaser_metric_sums_add(sums,&acc);
+  }
+}
+
+static void phaser_half_projection_kernel(void * p, int begin, int end, int part){
+  PhaserKernelArgs * args = p;
+  PhaserMetricSums * sums = args->sums ? &args->sums[part] : NULL;
+  args->ph->kernels->half_projection[sums != NULL](args->ph,args->half_spectrum,sums,begin,end);
+}
+
+/* phaser_constrain_pixel() for a real pixel */
+static inline real phaser_constrain_real_pixel(real v, SpPhasingConstraints constraints){
+  if(!(constraints & SpRealObject) && (constraints & SpPositiveRealObject) && v < 0){
+    if(constraints & SpPositivityFlipping){
+      return fabs(v);
+    }
+    return 0;
+  }
+  return v;
+}
+
+/* Real space update of the real arrays, like phaser_real_space_update_generic() */
+static inline void phaser_real_object_update_generic(const PhaserKernelArgs * args, PhaserMetricSums * sums, int begin, int end,
+						     const SpPhasingConstraints constraints, const int metrics){
+  SpPhaser * ph = args->ph;
+  PhaserMetricSums acc = {0};
+  const real beta = args->beta;
+  const real * g0 = ph->r0;
+  const real * gp = ph->rp;
+  real * g1 = ph->r1;
+  PhaserRuns runs;
+  int run_begin;
+  int run_end;
+  int inside;
+  phaser_runs_init(&runs,&ph->support_spans,begin,end);
+  while((inside = phaser_runs_next(&runs,&run_begin,&run_end)) >= 0){
+    for(int i = run_begin;i<run_end;i++){
+      if(inside){
+	g1[i] = phaser_constrain_real_pixel(gp[i],constraints);
+      }else if(args->type == SpHIO){
+	g1[i] = g0[i]-beta*gp[i];
+      }else if(args->type == SpRAAR){
+	g1[i] = (1-2*beta)*gp[i]+beta*g0[i];
       }else{
-	ph->g1->image->data[i] = ph->g0->image->data[i];
+	g1[i] = 0;
+      }
+      if(metrics){
+	phaser_add_real_metrics(&acc,inside,sp_cinit(gp[i],0),sp_cinit(g0[i],0),sp_cinit(g1[i],0));
       }
-      sp_real(ph->g1->image->data[i]) -= beta*sp_real(Pi2f1->image->data[i])/size;
-      sp_imag(ph->g1->image->data[i]) -= beta*sp_imag(Pi2f1->image->data[i])/size;
     }
-    sp_image_free(Pi2f1);
-    phaser_apply_constraints(ph,ph->g1,params->constraints);
+  }
+  if(metrics){
+    phaser_metric_sums_add(sums,&acc);
+  }
+}
+
+static void phaser_real_object_update_kernel(void * p, int begin, int end, int part){
+  PhaserKernelArgs * args = p;
+  PhaserMetricSums * sums = args->sums ? &args->sums[part] : NULL;
+  args->ph->kernels->real_object_update[sums != NULL](args,sums,begin,end);
+}
+
+/* ER, HIO and RAAR iterations of the real object mode. They follow the
+   complex ones, with real to complex transforms of the half spectrum. */
+static int phaser_iterate_real_object(SpPhaser * ph, int iterations){
+  const SpPhasingAlgorithmType type = ph->algorithm->type;
+  const SpPhasingConstraints constraints = phaser_algorithm_constraints(ph->algorithm);
+  sp_smap * beta_map = NULL;
+  if(type != SpER){
+    beta_map = ((SpPhasingHIOParameters *)ph->algorithm->params)->beta;
+  }
+  phaser_check_fourier_projection(ph,constraints);
+  phaser_update_spans(ph);
+  phaser_half_spectrum_prepare(ph);
+  for(int i = 0;i<iterations;i++){
+    real beta = beta_map ? sp_smap_interpolate(beta_map,ph->iteration) : 0;
+    real * swap = ph->r0;
+    ph->r0 = ph->r1;
+    ph->r1 = swap;
+    PhaserMetricSums * sums = phaser_metrics_begin(ph,1);
+    PhaserKernelArgs args = {ph,NULL,constraints,type,beta};
+    args.sums = sums;
+    args.half_spectrum = sp_phaser_workspace_alloc(ph,sizeof(Complex)*ph->half_size);
+    sp_rfft_array(ph->r0,args.half_spectrum,ph->nx,ph->ny,ph->nz,ph->fft_nthreads);
+    phaser_for(ph,ph->half_size,phaser_half_projection_kernel,&args);
+    sp_irfft_array(args.half_spectrum,ph->rp,ph->nx,ph->ny,ph->nz,ph->fft_nthreads);
+    phaser_for(ph,ph->image_size,phaser_real_object_update_kernel,&args);
     ph->iteration++;
+    phaser_metrics_record(ph,sums,phaser_nparts(ph));
+    sp_phaser_workspace_reset(ph);
   }
   return 0;
 }
 
-Image * phaser_iterate_diff_map_f1(Image * real_in,sp_i3matrix * pixel_flags,real gamma1){
-  Image * out = sp_image_duplicate(real_in,SP_COPY_DATA|SP_COPY_MASK);
-  for(int i = 0;i<sp_image_size(out);i++){
-    if(pixel_flags->data[i] & SpPixelInsideSupport){
-      /* inside support */
-      /* 1+gamma1-gamma1 is 1 so  do nothing */
+/* Instantiations of the generic kernels for every combination of their
+   constant parameters, so that the compiler can drop the branches which
+   don't apply and vectorize what remains. The last digit of the names
+   says whether the metrics are accumulated. */
+
+#define PHASER_FOURIER_PROJECTION_KERNEL(r,c,m,s)			\
+  static void phaser_fourier_projection_##r##c##m##s(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end){ \
+    phaser_fourier_projection_generic(ph,data,sums,begin,end,r,c,m,s);	\
+  }
+#define PHASER_FOURIER_PROJECTION_KERNELS(r,c,m)	\
+  PHASER_FOURIER_PROJECTION_KERNEL(r,c,m,0)		\
+  PHASER_FOURIER_PROJECTION_KERNEL(r,c,m,1)
+
+PHASER_FOURIER_PROJECTION_KERNELS(0,0,0)
+PHASER_FOURIER_PROJECTION_KERNELS(0,0,1)
+PHASER_FOURIER_PROJECTION_KERNELS(0,1,0)
+PHASER_FOURIER_PROJECTION_KERNELS(0,1,1)
+PHASER_FOURIER_PROJECTION_KERNELS(1,0,0)
+PHASER_FOURIER_PROJECTION_KERNELS(1,0,1)
+PHASER_FOURIER_PROJECTION_KERNELS(1,1,0)
+PHASER_FOURIER_PROJECTION_KERNELS(1,1,1)
+
+/* Indexed by recover phases, centrosymmetric, margins and metrics */
+static const PhaserFourierKernel phaser_fourier_projection_kernels[2][2][2][2] = {
+  {{{phaser_fourier_projection_0000,phaser_fourier_projection_0001},{phaser_fourier_projection_0010,phaser_fourier_projection_0011}},
+   {{phaser_fourier_projection_0100,phaser_fourier_projection_0101},{phaser_fourier_projection_0110,phaser_fourier_projection_0111}}},
+  {{{phaser_fourier_projection_1000,phaser_fourier_projection_1001},{phaser_fourier_projection_1010,phaser_fourier_projection_1011}},
+   {{phaser_fourier_projection_1100,phaser_fourier_projection_1101},{phaser_fourier_projection_1110,phaser_fourier_projection_1111}}}
+};
+
+#define PHASER_MODULE_PROJECTION_KERNEL(m,s)				\
+  static void phaser_module_projection_##m##s(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end){ \
+    phaser_module_projection_generic(ph,data,sums,begin,end,m,s);	\
+  }
+
+PHASER_MODULE_PROJECTION_KERNEL(0,0)
+PHASER_MODULE_PROJECTION_KERNEL(0,1)
+PHASER_MODULE_PROJECTION_KERNEL(1,0)
+PHASER_MODULE_PROJECTION_KERNEL(1,1)
+
+/* Indexed by margins and metrics */
+static const PhaserFourierKernel phaser_module_projection_kernels[2][2] = {
+  {phaser_module_projection_00,phaser_module_projection_01},
+  {phaser_module_projection_10,phaser_module_projection_11}
+};
+
+#define PHASER_HALF_PROJECTION_KERNEL(c,m,s)				\
+  static void phaser_half_projection_##c##m##s(SpPhaser * ph, Complex * data, PhaserMetricSums * sums, int begin, int end){ \
+    phaser_half_projection_generic(ph,data,sums,begin,end,c,m,s);	\
+  }
+#define PHASER_HALF_PROJECTION_KERNELS(c,m)	\
+  PHASER_HALF_PROJECTION_KERNEL(c,m,0)		\
+  PHASER_HALF_PROJECTION_KERNEL(c,m,1)
+
+PHASER_HALF_PROJECTION_KERNELS(0,0)
+PHASER_HALF_PROJECTION_KERNELS(0,1)
+PHASER_HALF_PROJECTION_KERNELS(1,0)
+PHASER_HALF_PROJECTION_KERNELS(1,1)
+
+/* Indexed by centrosymmetric, margins and metrics */
+static const PhaserFourierKernel phaser_half_projection_kernels[2][2][2] = {
+  {{phaser_half_projection_000,phaser_half_projection_001},{phaser_half_projection_010,phaser_half_projection_011}},
+  {{phaser_half_projection_100,phaser_half_projection_101},{phaser_half_projection_110,phaser_half_projection_111}}
+};
+
+/* The object constraints phaser_constrain_pixel() tells apart, in the
+   order of phaser_object_constraints_index() */
+#define PHASER_OBJECT_CONSTRAINTS_0 SpNoConstraints
+#define PHASER_OBJECT_CONSTRAINTS_1 SpRealObject
+#define PHASER_OBJECT_CONSTRAINTS_2 SpPositiveRealObject
+#define PHASER_OBJECT_CONSTRAINTS_3 (SpPositiveRealObject|SpPositivityFlipping)
+#define PHASER_OBJECT_CONSTRAINTS_4 SpPositiveComplexObject
+#define PHASER_OBJECT_CONSTRAINTS_5 (SpPositiveComplexObject|SpPositivityFlipping)
+
+static int phaser_object_constraints_index(SpPhasingConstraints constraints){
+  const int flipping = (constraints & SpPositivityFlipping) != 0;
+  if(constraints & SpRealObject){
+    return 1;
+  }else if(constraints & SpPositiveRealObject){
+    return 2+flipping;
+  }else if(constraints & SpPositiveComplexObject){
+    return 4+flipping;
+  }
+  return 0;
+}
+
+#define PHASER_REAL_SPACE_UPDATE_KERNEL(o,s)				\
+  static void phaser_real_space_update_##o##s(const PhaserKernelArgs * args, PhaserMetricSums * sums, int begin, int end){ \
+    phaser_real_space_update_generic(args,sums,begin,end,PHASER_OBJECT_CONSTRAINTS_##o,s); \
+  }
+#define PHASER_REAL_OBJECT_UPDATE_KERNEL(o,s)				\
+  static void phaser_real_object_update_##o##s(const PhaserKernelArgs * args, PhaserMetricSums * sums, int begin, int end){ \
+    phaser_real_object_update_generic(args,sums,begin,end,PHASER_OBJECT_CONSTRAINTS_##o,s); \
+  }
+#define PHASER_OBJECT_KERNELS(o)		\
+  PHASER_REAL_SPACE_UPDATE_KERNEL(o,0)		\
+  PHASER_REAL_SPACE_UPDATE_KERNEL(o,1)		\
+  PHASER_REAL_OBJECT_UPDATE_KERNEL(o,0)		\
+  PHASER_REAL_OBJECT_UPDATE_KERNEL(o,1)
+
+PHASER_OBJECT_KERNELS(0)
+PHASER_OBJECT_KERNELS(1)
+PHASER_OBJECT_KERNELS(2)
+PHASER_OBJECT_KERNELS(3)
+PHASER_OBJECT_KERNELS(4)
+PHASER_OBJECT_KERNELS(5)
+
+/* Indexed by phaser_object_constraints_index() and metrics */
+static const PhaserRealSpaceKernel phaser_real_space_update_kernels[6][2] = {
+  {phaser_real_space_update_00,phaser_real_space_update_01},
+  {phaser_real_space_update_10,phaser_real_space_update_11},
+  {phaser_real_space_update_20,phaser_real_space_update_21},
+  {phaser_real_space_update_30,phaser_real_space_update_31},
+  {phaser_real_space_update_40,phaser_real_space_update_41},
+  {phaser_real_space_update_50,phaser_real_space_update_51}
+};
+
+static const PhaserRealSpaceKernel phaser_real_object_update_kernels[6][2] = {
+  {phaser_real_object_update_00,phaser_real_object_update_01},
+  {phaser_real_object_update_10,phaser_real_object_update_11},
+  {phaser_real_object_update_20,phaser_real_object_update_21},
+  {phaser_real_object_update_30,phaser_real_object_update_31},
+  {phaser_real_object_update_40,phaser_real_object_update_41},
+  {phaser_real_object_update_50,phaser_real_object_update_51}
+};
+
+/* Picks the kernels for the constraints of the algorithm and the
+   objective of ph. Cheap when nothing changed, so the iterations call
+   it too in case the parameters of the algorithm were changed in place. */
+static void phaser_select_kernels(SpPhaser * ph){
+  if(!ph->algorithm){
+    return;
+  }
+  const SpPhasingConstraints constraints = phaser_algorithm_constraints(ph->algorithm);
+  const SpPhasingObjective objective = ph->phasing_objective;
+  if(ph->kernels){
+    if(ph->kernels->constraints == constraints && ph->kernels->objective == objective){
+      return;
+    }
+  }else{
+    ph->kernels = sp_malloc(sizeof(PhaserKernels));
+  }
+  PhaserKernels * k = ph->kernels;
+  const int recover_phases = (objective == SpRecoverPhases);
+  const int centrosymmetric = (constraints & SpCentrosymmetricObject) != 0;
+  const int margins = (constraints & SpAmplitudeErrorMargin) != 0;
+  const int object = phaser_object_constraints_index(constraints);
+  k->constraints = constraints;
+  k->objective = objective;
+  for(int s = 0;s<2;s++){
+    k->fourier_projection[s] = phaser_fourier_projection_kernels[recover_phases][centrosymmetric][margins][s];
+    k->module_projection[s] = phaser_module_projection_kernels[margins][s];
+    k->real_space_update[s] = phaser_real_space_update_kernels[object][s];
+    k->half_projection[s] = phaser_half_projection_kernels[centrosymmetric][margins][s];
+    k->real_object_update[s] = phaser_real_object_update_kernels[object][s];
+  }
+}
+
+/* Host memory of a. The values of views are left out and so are the
+   mask and the detector shared in the low memory mode, except for g0. */
+static size_t phaser_image_memory(const SpPhaser * ph, const Image * a, int view){
+  size_t n;
+  if(!a){
+    return 0;
+  }
+  n = sizeof(Image)+sizeof(sp_c3matrix);
+  if(!view){
+    n += sizeof(Complex)*sp_c3matrix_size(a->image);
+  }
+  if(a == ph->g0 || !ph->g0 || a->mask != ph->g0->mask){
+    n += sizeof(sp_i3matrix)+sizeof(int)*sp_i3matrix_size(a->mask)+sizeof(Detector);
+  }
+  return n;
+}
+
+static size_t phaser_3matrix_memory(const sp_3matrix * m){
+  return m ? sizeof(sp_3matrix)+sizeof(real)*sp_3matrix_size(m) : 0;
+}
+
+size_t sp_phaser_memory_usage(const SpPhaser * ph){
+  int views = phaser_borrows_masks(ph);
+  size_t n = sizeof(SpPhaser);
+  n += phaser_3matrix_memory(ph->amplitudes);
+  n += phaser_3matrix_memory(ph->amplitudes_min);
+  n += phaser_3matrix_memory(ph->amplitudes_max);
+  if(ph->phased_amplitudes){
+    n += sizeof(sp_c3matrix)+sizeof(Complex)*sp_c3matrix_size(ph->phased_amplitudes);
+  }
+  if(ph->pixel_flags){
+    n += sizeof(sp_i3matrix)+sizeof(int)*sp_i3matrix_size(ph->pixel_flags);
+  }
+  n += sizeof(int)*2*(ph->support_spans.allocated+ph->measured_spans.allocated+ph->half_measured_spans.allocated);
+  n += phaser_image_memory(ph,ph->model,views);
+  n += phaser_image_memory(ph,ph->old_model,views);
+  n += phaser_image_memory(ph,ph->model_before_projection,views);
+  n += phaser_image_memory(ph,ph->model_change,0);
+  n += phaser_image_memory(ph,ph->support,0);
+  n += phaser_image_memory(ph,ph->amplitudes_image,0);
+  n += phaser_image_memory(ph,ph->fmodel,0);
+  n += phaser_image_memory(ph,ph->model_with_support,1);
+  n += phaser_image_memory(ph,ph->fmodel_with_mask,1);
+  n += phaser_image_memory(ph,ph->g0,0);
+  n += phaser_image_memory(ph,ph->g1,0);
+  n += phaser_image_memory(ph,ph->gp,0);
+  if(ph->r0){
+    n += 3*sizeof(real)*ph->image_size;
+  }
+  n += phaser_3matrix_memory(ph->half_amplitudes);
+  n += phaser_3matrix_memory(ph->half_amplitudes_min);
+  n += phaser_3matrix_memory(ph->half_amplitudes_max);
+  if(ph->half_flags){
+    n += sizeof(int)*ph->half_size;
+  }
+  n += ph->workspace.size+sizeof(void *)*ph->workspace.overflow_allocated;
+  n += sizeof(SpPhaserMetrics)*ph->metrics_capacity;
+  if(ph->kernels){
+    n += sizeof(PhaserKernels);
+  }
+  return n;
+}
+
+/* Batches of phasers */
+
+SpPhaserBatch * sp_phaser_batch_alloc(int nmodels){
+  if(nmodels < 1){
+    fprintf(stderr,"Error: A phaser batch needs at least one model\n");
+    return NULL;
+  }
+  SpPhaserBatch * b = sp_malloc(sizeof(SpPhaserBatch));
+  b->nmodels = nmodels;
+  b->phasers = sp_malloc(sizeof(SpPhaser *)*nmodels);
+  for(int k = 0;k<nmodels;k++){
+    b->phasers[k] = sp_phaser_alloc();
+  }
+  b->g0 = NULL;
+  b->g1 = NULL;
+  b->gp = NULL;
+  return b;
+}
+
+/* Frees an iterate whose data belongs to the batch stacks */
+static void phaser_batch_free_iterate(Image * a){
+  sp_i3matrix_free(a->mask);
+  sp_free(a->image);
+  sp_free(a->detector);
+  sp_free(a);
+}
+
+void sp_phaser_batch_free(SpPhaserBatch * b){
+  SpPhaser * first = b->phasers[0];
+  /* The first phaser goes last as the others share its arrays */
+  for(int k = b->nmodels-1;k>=0;k--){
+    SpPhaser * ph = b->phasers[k];
+    if(k > 0){
+      if(ph->amplitudes == first->amplitudes){
+	ph->amplitudes = NULL;
+      }
+      if(ph->amplitudes_min == first->amplitudes_min){
+	ph->amplitudes_min = NULL;
+      }
+      if(ph->amplitudes_max == first->amplitudes_max){
+	ph->amplitudes_max = NULL;
+      }
+      if(ph->pixel_flags == first->pixel_flags){
+	ph->pixel_flags = NULL;
+      }
+    }
+    if(b->g0 && ph->g0){
+      phaser_batch_free_iterate(ph->g0);
+      phaser_batch_free_iterate(ph->g1);
+      phaser_batch_free_iterate(ph->gp);
+      ph->g0 = NULL;
+      ph->g1 = NULL;
+      ph->gp = NULL;
+    }
+    sp_phaser_free(ph);
+  }
+  if(b->g0){
+    sp_free(b->g0);
+    sp_free(b->g1);
+    sp_free(b->gp);
+  }
+  sp_free(b->phasers);
+  sp_free(b);
+}
+
+SpPhaser * sp_phaser_batch_phaser(SpPhaserBatch * b, int i){
+  if(i < 0 || i >= b->nmodels){
+    return NULL;
+  }
+  return b->phasers[i];
+}
+
+int sp_phaser_batch_init(SpPhaserBatch * b, SpPhasingAlgorithm * alg, SpSupportArray * sup_alg, SpPhasingEngine engine){
+  if(!b){
+    fprintf(stderr,"Phaser batch is NULL!\n");
+    return -1;
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    int ret = sp_phaser_init(b->phasers[k],alg,sup_alg,engine);
+    if(ret){
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/* Whether the support of each model changes during the iterations */
+static int phaser_batch_updates_support(const SpPhaserBatch * b){
+  SpSupportArray * sup = b->phasers[0]->sup_algorithm;
+  return sup && sup->algorithms[0]->function;
+}
+
+void sp_phaser_batch_set_amplitudes(SpPhaserBatch * b, const Image * amplitudes){
+  SpPhaser * first = b->phasers[0];
+  sp_phaser_set_amplitudes(first,amplitudes);
+  for(int k = 1;k<b->nmodels;k++){
+    SpPhaser * ph = b->phasers[k];
+    if(!phaser_cpu_engine(ph)){
+      sp_phaser_set_amplitudes(ph,amplitudes);
+      continue;
+    }
+    phaser_check_dimensions(ph,amplitudes);
+    phaser_invalidate_amplitudes(ph);
+    ph->amplitudes = first->amplitudes;
+    if(!phaser_batch_updates_support(b)){
+      ph->pixel_flags = first->pixel_flags;
+    }else if(!ph->pixel_flags){
+      ph->pixel_flags = sp_i3matrix_duplicate(first->pixel_flags);
     }else{
-      /* outside support */
-      sp_real(out->image->data[i]) = -gamma1*sp_real(out->image->data[i]);
-      sp_imag(out->image->data[i]) = -gamma1*sp_imag(out->image->data[i]);
+      /* keep the support of this model */
+      for(int i = 0;i<ph->image_size;i++){
+	ph->pixel_flags->data[i] = (ph->pixel_flags->data[i] & ~SpPixelMeasuredAmplitude) |
+	  (first->pixel_flags->data[i] & SpPixelMeasuredAmplitude);
+      }
+    }
+  }
+}
+
+void sp_phaser_batch_set_amplitudes_margins(SpPhaserBatch * b, const Image * amplitudes_min, const Image * amplitudes_max){
+  SpPhaser * first = b->phasers[0];
+  sp_phaser_set_amplitudes_margins(first,amplitudes_min,amplitudes_max);
+  for(int k = 1;k<b->nmodels;k++){
+    SpPhaser * ph = b->phasers[k];
+    if(!phaser_cpu_engine(ph)){
+      sp_phaser_set_amplitudes_margins(ph,amplitudes_min,amplitudes_max);
+      continue;
+    }
+    phaser_check_dimensions(ph,amplitudes_min);
+    phaser_check_dimensions(ph,amplitudes_max);
+    phaser_invalidate_amplitudes(ph);
+    ph->amplitudes_min = first->amplitudes_min;
+    ph->amplitudes_max = first->amplitudes_max;
+  }
+}
+
+/* Moves the data of a into slot k of stack */
+static void phaser_batch_attach_iterate(const SpPhaserBatch * b, Image * a, Complex * stack, int k){
+  int size = b->phasers[0]->image_size;
+  memcpy(&stack[k*size],a->image->data,sizeof(Complex)*size);
+  sp_free(a->image->data);
+  a->image->data = &stack[k*size];
+}
+
+int sp_phaser_batch_init_model(SpPhaserBatch * b, const Image * model, int flags){
+  if(!b){
+    return -1;
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    if(b->phasers[k]->low_memory){
+      fprintf(stderr,"Error: The phasers of a batch can't use the low memory mode\n");
+      return -1;
+    }
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    int ret = sp_phaser_init_model(b->phasers[k],model,flags);
+    if(ret){
+      return ret;
+    }
+  }
+  if(!phaser_cpu_engine(b->phasers[0])){
+    return 0;
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    if(b->phasers[k]->real_object){
+      /* Iterates real buffers which can't be stacked, so the phasers
+	 are left to sp_phaser_iterate() */
+      return 0;
+    }
+  }
+  if(!b->g0){
+    int size = b->phasers[0]->image_size;
+    b->g0 = sp_malloc(sizeof(Complex)*size*b->nmodels);
+    b->g1 = sp_malloc(sizeof(Complex)*size*b->nmodels);
+    b->gp = sp_malloc(sizeof(Complex)*size*b->nmodels);
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    SpPhaser * ph = b->phasers[k];
+    phaser_batch_attach_iterate(b,ph->g0,b->g0,k);
+    phaser_batch_attach_iterate(b,ph->g1,b->g1,k);
+    phaser_batch_attach_iterate(b,ph->gp,b->gp,k);
+  }
+  return 0;
+}
+
+int sp_phaser_batch_init_support(SpPhaserBatch * b, const Image * support, int flags, real value){
+  if(!b){
+    return -1;
+  }
+  SpPhaser * first = b->phasers[0];
+  for(int k = 0;k<b->nmodels;k++){
+    SpPhaser * ph = b->phasers[k];
+    if(k > 0 && ph->pixel_flags == first->pixel_flags){
+      /* Shared flags already hold the support */
+      ph->spans_valid = 0;
+      continue;
+    }
+    int ret = sp_phaser_init_support(ph,support,flags,value);
+    if(ret){
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/* Arguments of the kernels which sweep over the whole batch */
+typedef struct{
+  SpPhaserBatch * b;
+  SpPhasingAlgorithmType type;
+  real beta;
+  SpPhasingConstraints constraints;
+  /* nparts per model, NULL when the metrics are not recorded */
+  PhaserMetricSums * sums;
+  int nparts;
+}PhaserBatchKernelArgs;
+
+static void phaser_batch_fourier_projection_kernel(void * p, int begin, int end, int part){
+  PhaserBatchKernelArgs * args = p;
+  const int size = args->b->phasers[0]->image_size;
+  /* [begin,end) can span several models */
+  while(begin < end){
+    int k = begin/size;
+    int stop = sp_min(end,(k+1)*size);
+    SpPhaser * ph = args->b->phasers[k];
+    PhaserMetricSums * sums = args->sums ? &args->sums[k*args->nparts+part] : NULL;
+    ph->kernels->fourier_projection[sums != NULL](ph,ph->g1->image->data,sums,begin-k*size,stop-k*size);
+    begin = stop;
+  }
+}
+
+static void phaser_batch_real_space_update_kernel(void * p, int begin, int end, int part){
+  PhaserBatchKernelArgs * args = p;
+  const int size = args->b->phasers[0]->image_size;
+  while(begin < end){
+    int k = begin/size;
+    int stop = sp_min(end,(k+1)*size);
+    PhaserKernelArgs model_args = {args->b->phasers[k],NULL,args->constraints,args->type,args->beta};
+    PhaserMetricSums * sums = args->sums ? &args->sums[k*args->nparts+part] : NULL;
+    model_args.ph->kernels->real_space_update[sums != NULL](&model_args,sums,begin-k*size,stop-k*size);
+    begin = stop;
+  }
+}
+
+/* Does iterations steps of ER, HIO or RAAR on all the models at once.
+   The pixel loops run on the threads of the first phaser. */
+static int phaser_batch_iterate_stacked(SpPhaserBatch * b, int iterations){
+  SpPhaser * first = b->phasers[0];
+  SpPhasingAlgorithm * alg = first->algorithm;
+  const int n = b->nmodels*first->image_size;
+  PhaserBatchKernelArgs args = {b,alg->type,0,0,NULL,phaser_nparts(first)};
+  /* The phasers swap their iterates on their own in sp_phaser_iterate() */
+  b->g0 = first->g0->image->data;
+  b->g1 = first->g1->image->data;
+  if(alg->type == SpER){
+    args.constraints = ((SpPhasingERParameters *)alg->params)->constraints;
+  }else if(alg->type == SpHIO){
+    args.constraints = ((SpPhasingHIOParameters *)alg->params)->constraints;
+  }else{
+    args.constraints = ((SpPhasingRAARParameters *)alg->params)->constraints;
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    phaser_check_fourier_projection(b->phasers[k],args.constraints);
+    phaser_select_kernels(b->phasers[k]);
+    phaser_update_spans(b->phasers[k]);
+  }
+  for(int i = 0;i<iterations;i++){
+    if(alg->type == SpHIO){
+      args.beta = sp_smap_interpolate(((SpPhasingHIOParameters *)alg->params)->beta,first->iteration);
+    }else if(alg->type == SpRAAR){
+      args.beta = sp_smap_interpolate(((SpPhasingRAARParameters *)alg->params)->beta,first->iteration);
+    }
+    args.sums = phaser_metrics_begin(first,b->nmodels);
+    Complex * swap = b->g0;
+    b->g0 = b->g1;
+    b->g1 = swap;
+    for(int k = 0;k<b->nmodels;k++){
+      SpPhaser * ph = b->phasers[k];
+      Image * tmp = ph->g0;
+      ph->g0 = ph->g1;
+      ph->g1 = tmp;
+    }
+    sp_fft_stack(b->g0,b->g1,first->nx,first->ny,first->nz,b->nmodels);
+    phaser_for(first,n,phaser_batch_fourier_projection_kernel,&args);
+    sp_ifft_stack(b->g1,b->gp,first->nx,first->ny,first->nz,b->nmodels);
+    phaser_for(first,n,phaser_batch_real_space_update_kernel,&args);
+    for(int k = 0;k<b->nmodels;k++){
+      b->phasers[k]->iteration++;
+      phaser_metrics_record(b->phasers[k],args.sums ? &args.sums[k*args.nparts] : NULL,args.nparts);
+    }
+    sp_phaser_workspace_reset(first);
+  }
+  return 0;
+}
 
+int sp_phaser_batch_iterate(SpPhaserBatch * b, int iterations){
+  if(!b){
+    return -1;
+  }
+  SpPhaser * first = b->phasers[0];
+  SpPhasingAlgorithmType type = first->algorithm ? first->algorithm->type : SpER;
+  if(!b->g0 || (type != SpER && type != SpHIO && type != SpRAAR)){
+    for(int k = 0;k<b->nmodels;k++){
+      int ret = sp_phaser_iterate(b->phasers[k],iterations);
+      if(ret){
+	return ret;
+      }
+    }
+    return 0;
+  }
+  for(int k = 0;k<b->nmodels;k++){
+    SpPhaser * ph = b->phasers[k];
+    if(!ph->algorithm){
+      return -2;
+    }
+    if((!ph->amplitudes && ph->phasing_objective == SpRecoverPhases)
+       ||
+       (!ph->phased_amplitudes && ph->phasing_objective == SpRecoverAmplitudes)){
+      return -4;
+    }
+    if(!ph->pixel_flags){
+      return -5;
     }
   }
-  return out;
+  int ret = 0;
+  if(phaser_batch_updates_support(b)){
+    /* same schedule as sp_phaser_iterate() */
+    SpSupportArray * sup = first->sup_algorithm;
+    while(iterations){
+      int to_support_update = sup->update_period-1-(first->iteration)%sup->update_period;
+      int to_iterate = sp_min(iterations,to_support_update);
+      ret = phaser_batch_iterate_stacked(b,to_iterate);
+      iterations -= to_iterate;
+      to_support_update -= to_iterate;
+      if(to_support_update == 0 && iterations > 0){
+	for(int k = 0;k<b->nmodels;k++){
+	  sp_support_array_update(sup,b->phasers[k]);
+	  sp_phaser_workspace_reset(b->phasers[k]);
+	  b->phasers[k]->iteration++;
+	}
+	iterations -= 1;
+      }
+    }
+  }else if(iterations){
+    ret = phaser_batch_iterate_stacked(b,iterations);
+  }
+  return ret;
 }
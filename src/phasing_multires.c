@@ -0,0 +1,236 @@
+#include <spimage.h>
+
+/* Coarse to fine phasing.
+
+   The levels below full size run on temporary phasers. Resampling is
+   done in Fourier space for the amplitudes and the model, keeping the
+   frequencies both sizes have in common, so the model of a level is the
+   low pass filtered model of the next one. */
+
+/* Size of an axis of n pixels at the given scale */
+static int multires_axis_size(int n, real scale){
+  int m = (int)(n*scale+0.5);
+  if(n == 1 || m < 1){
+    return 1;
+  }
+  return sp_min(m,n);
+}
+
+/* Index along an axis of size n of the frequency at index i of an axis
+   of size m, or -1 if n has no such frequency */
+static int multires_frequency_index(int i, int m, int n){
+  int f = (i < (m+1)/2) ? i : i-m;
+  if(f >= (n+1)/2 || f < -(n/2)){
+    return -1;
+  }
+  return f >= 0 ? f : f+n;
+}
+
+/* Calls fn(ctx,i,j) for every pixel i of a spectrum of size m with the
+   same frequency as the pixel j of a spectrum of size n */
+static void multires_for_common_frequencies(const int m[3], const int n[3],
+					    void (*fn)(void * ctx, int i, int j), void * ctx){
+  for(int z = 0;z<m[2];z++){
+    int nz = multires_frequency_index(z,m[2],n[2]);
+    if(nz < 0){
+      continue;
+    }
+    for(int y = 0;y<m[1];y++){
+      int ny = multires_frequency_index(y,m[1],n[1]);
+      if(ny < 0){
+	continue;
+      }
+      for(int x = 0;x<m[0];x++){
+	int nx = multires_frequency_index(x,m[0],n[0]);
+	if(nx < 0){
+	  continue;
+	}
+	fn(ctx,(z*m[1]+y)*m[0]+x,(nz*n[1]+ny)*n[0]+nx);
+      }
+    }
+  }
+}
+
+typedef struct{
+  Image * out;
+  /* the spectrum, or the amplitudes and the flags of ph */
+  const Image * in;
+  const sp_3matrix * values;
+  const SpPhaser * ph;
+  real scale;
+}MultiresCopy;
+
+static void multires_copy_spectrum(void * p, int i, int j){
+  MultiresCopy * c = p;
+  c->out->image->data[i] = sp_cscale(c->in->image->data[j],c->scale);
+}
+
+static void multires_copy_amplitudes(void * p, int i, int j){
+  MultiresCopy * c = p;
+  c->out->image->data[i] = sp_cinit(c->values->data[j]*c->scale,0);
+}
+
+static void multires_copy_measured(void * p, int i, int j){
+  MultiresCopy * c = p;
+  c->out->mask->data[i] = (c->ph->pixel_flags->data[j] & SpPixelMeasuredAmplitude) != 0;
+}
+
+/* The model a at size nx,ny,nz, with the same low frequencies */
+static Image * multires_resample_model(const Image * a, int nx, int ny, int nz){
+  const int m[3] = {nx,ny,nz};
+  const int n[3] = {sp_image_x(a),sp_image_y(a),sp_image_z(a)};
+  Image * f = sp_image_fft(a);
+  Image * g = sp_image_alloc(nx,ny,nz);
+  sp_image_fill(g,sp_cinit(0,0));
+  /* Keeps the values of the pixels, not the sum of the image */
+  MultiresCopy c = {g,f,NULL,NULL,1.0/sp_image_size(a)};
+  multires_for_common_frequencies(m,n,multires_copy_spectrum,&c);
+  g->phased = 1;
+  g->shifted = 1;
+  Image * ret = sp_image_ifft(g);
+  ret->phased = 1;
+  sp_image_free(f);
+  sp_image_free(g);
+  return ret;
+}
+
+/* The support s at size nx,ny,nz. A pixel is inside if it covers or is
+   covered by a pixel inside s, so shrinking never loses small parts. */
+static Image * multires_resample_support(const Image * s, int nx, int ny, int nz){
+  const int m[3] = {nx,ny,nz};
+  const int n[3] = {sp_image_x(s),sp_image_y(s),sp_image_z(s)};
+  Image * ret = sp_image_alloc(nx,ny,nz);
+  sp_image_fill(ret,sp_cinit(0,0));
+  for(int z = 0;z<n[2];z++){
+    for(int y = 0;y<n[1];y++){
+      for(int x = 0;x<n[0];x++){
+	if(sp_real(s->image->data[(z*n[1]+y)*n[0]+x])){
+	  int i = ((z*m[2]/n[2])*m[1]+y*m[1]/n[1])*m[0]+x*m[0]/n[0];
+	  ret->image->data[i] = sp_cinit(1,0);
+	}
+      }
+    }
+  }
+  for(int z = 0;z<m[2];z++){
+    for(int y = 0;y<m[1];y++){
+      for(int x = 0;x<m[0];x++){
+	int j = ((z*n[2]/m[2])*n[1]+y*n[1]/m[1])*n[0]+x*n[0]/m[0];
+	if(sp_real(s->image->data[j])){
+	  ret->image->data[(z*m[1]+y)*m[0]+x] = sp_cinit(1,0);
+	}
+      }
+    }
+  }
+  return ret;
+}
+
+/* The amplitudes of ph cropped to size m. They are scaled like the
+   spectrum of the model in multires_resample_model(). */
+static Image * multires_crop_amplitudes(SpPhaser * ph, const sp_3matrix * amplitudes, const int m[3]){
+  const int n[3] = {ph->nx,ph->ny,ph->nz};
+  Image * ret = sp_image_alloc(m[0],m[1],m[2]);
+  sp_image_fill(ret,sp_cinit(0,0));
+  MultiresCopy c = {ret,NULL,amplitudes,ph,(real)sp_image_size(ret)/ph->image_size};
+  multires_for_common_frequencies(m,n,multires_copy_amplitudes,&c);
+  multires_for_common_frequencies(m,n,multires_copy_measured,&c);
+  return ret;
+}
+
+/* Sets up a phaser for the level of size m, starting from model and
+   support */
+static SpPhaser * multires_level_phaser(SpPhaser * ph, const SpMultiresLevel * level, const int m[3],
+					const Image * model, const Image * support){
+  SpPhaser * coarse = sp_phaser_alloc();
+  if(sp_phaser_init(coarse,level->algorithm ? level->algorithm : ph->algorithm,level->sup_algorithm,ph->engine)){
+    sp_phaser_free(coarse);
+    return NULL;
+  }
+  sp_phaser_set_threads(coarse,ph->nthreads);
+  sp_phaser_set_fft_threads(coarse,ph->fft_nthreads);
+  if(ph->real_object){
+    sp_phaser_set_real_object(coarse,1);
+  }
+  Image * amplitudes = multires_crop_amplitudes(ph,ph->amplitudes,m);
+  sp_phaser_set_amplitudes(coarse,amplitudes);
+  sp_image_free(amplitudes);
+  if(ph->amplitudes_min && ph->amplitudes_max){
+    Image * amplitudes_min = multires_crop_amplitudes(ph,ph->amplitudes_min,m);
+    Image * amplitudes_max = multires_crop_amplitudes(ph,ph->amplitudes_max,m);
+    sp_phaser_set_amplitudes_margins(coarse,amplitudes_min,amplitudes_max);
+    sp_image_free(amplitudes_min);
+    sp_image_free(amplitudes_max);
+  }
+  Image * level_model = multires_resample_model(model,m[0],m[1],m[2]);
+  Image * level_support = multires_resample_support(support,m[0],m[1],m[2]);
+  sp_phaser_init_model(coarse,level_model,0);
+  sp_phaser_init_support(coarse,level_support,0,0);
+  sp_image_free(level_model);
+  sp_image_free(level_support);
+  return coarse;
+}
+
+int sp_phaser_iterate_multires(SpPhaser * ph, const SpMultiresLevel * levels, int nlevels){
+  if(!ph || !ph->algorithm || !ph->model || !ph->amplitudes || !ph->pixel_flags){
+    fprintf(stderr,"Error: The phaser must be initialized for multiresolution phasing\n");
+    return -1;
+  }
+  if(ph->phasing_objective != SpRecoverPhases){
+    fprintf(stderr,"Error: Multiresolution phasing needs the SpRecoverPhases objective\n");
+    return -1;
+  }
+  for(int l = 0;l<nlevels;l++){
+    if(!(levels[l].scale > 0 && levels[l].scale <= 1) || levels[l].iterations < 0 ||
+       (l > 0 && levels[l].scale < levels[l-1].scale)){
+      fprintf(stderr,"Error: Invalid multiresolution level %d\n",l);
+      return -1;
+    }
+  }
+  Image * model = sp_image_duplicate(sp_phaser_model(ph),SP_COPY_DATA);
+  Image * support = sp_image_duplicate(sp_phaser_support(ph),SP_COPY_DATA);
+  int ret = 0;
+  int l = 0;
+  for(;l<nlevels;l++){
+    const int m[3] = {multires_axis_size(ph->nx,levels[l].scale),multires_axis_size(ph->ny,levels[l].scale),
+		      multires_axis_size(ph->nz,levels[l].scale)};
+    if(m[0]*m[1]*m[2] == ph->image_size){
+      break;
+    }
+    SpPhaser * coarse = multires_level_phaser(ph,&levels[l],m,model,support);
+    if(!coarse){
+      ret = -1;
+      break;
+    }
+    ret = sp_phaser_iterate(coarse,levels[l].iterations);
+    if(ret == 0){
+      sp_image_free(model);
+      sp_image_free(support);
+      model = sp_image_duplicate(sp_phaser_model(coarse),SP_COPY_DATA);
+      support = sp_image_duplicate(sp_phaser_support(coarse),SP_COPY_DATA);
+    }
+    sp_phaser_free(coarse);
+    if(ret){
+      break;
+    }
+  }
+  if(ret == 0 && sp_image_size(model) != ph->image_size){
+    Image * full_model = multires_resample_model(model,ph->nx,ph->ny,ph->nz);
+    Image * full_support = multires_resample_support(support,ph->nx,ph->ny,ph->nz);
+    sp_phaser_set_model(ph,full_model);
+    sp_phaser_set_support(ph,full_support);
+    sp_image_free(full_model);
+    sp_image_free(full_support);
+  }
+  sp_image_free(model);
+  sp_image_free(support);
+  /* The full size levels */
+  SpPhasingAlgorithm * algorithm = ph->algorithm;
+  SpSupportArray * sup_algorithm = ph->sup_algorithm;
+  for(;l<nlevels && ret == 0;l++){
+    sp_phaser_set_phasing_algorithm(ph,levels[l].algorithm ? levels[l].algorithm : algorithm);
+    ph->sup_algorithm = levels[l].sup_algorithm;
+    ret = sp_phaser_iterate(ph,levels[l].iterations);
+  }
+  sp_phaser_set_phasing_algorithm(ph,algorithm);
+  ph->sup_algorithm = sup_algorithm;
+  return ret;
+}
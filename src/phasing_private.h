@@ -0,0 +1,19 @@
+#ifndef _PHASING_PRIVATE_H_
+#define _PHASING_PRIVATE_H_
+
+/* The phaser workspace is an arena of scratch memory owned by each
+   phaser. Buffers are handed out in order with
+   sp_phaser_workspace_alloc() and all released together by
+   sp_phaser_workspace_reset(). Requests which do not fit are served from
+   the heap, and the next reset grows the arena so that they fit from
+   then on. */
+
+/* Makes sure the arena holds at least size bytes. Only call it with
+   nothing allocated. */
+void sp_phaser_workspace_reserve(SpPhaser * ph, size_t size);
+/* Returns size bytes aligned for SIMD use, valid until the next reset */
+void * sp_phaser_workspace_alloc(SpPhaser * ph, size_t size);
+void sp_phaser_workspace_reset(SpPhaser * ph);
+void sp_phaser_workspace_free(SpPhaser * ph);
+
+#endif
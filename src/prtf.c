@@ -36,8 +36,8 @@ Image * sp_prtf_basic(Image ** list,int n){
 
 
 Image * sp_prtf_advanced(Image ** list,int n,int flags){
-  Image ** real_image = sp_malloc(sizeof(Image *)*n);
-  Image ** fourier_image = sp_malloc(sizeof(Image *)*n);
+  Image ** real_image;
+  Image ** fourier_image;
   /* We'll do the superposition and phase match in real space
      but the prtf in reciprocal space
   */
@@ -45,12 +45,14 @@ Image * sp_prtf_advanced(Image ** list,int n,int flags){
     return NULL;
   }
   if(flags & SpRealSpace){
+    real_image = sp_malloc(sizeof(Image *)*n);
     for(int i = 0;i<n;i++){
       real_image[i] = sp_image_duplicate(list[i],SP_COPY_ALL);
     }
   }else if(flags & SpFourierSpace){
-    for(int i = 0;i<n;i++){
-      real_image[i] = sp_image_ifft(list[i]);
+    real_image = sp_image_ifft_many(list,n);
+    if(!real_image){
+      return NULL;
     }
   }else{
     return NULL;
@@ -58,8 +60,16 @@ Image * sp_prtf_advanced(Image ** list,int n,int flags){
   for(int i = 1;i<n;i++){
     sp_image_superimpose_fractional(real_image[0],real_image[i],SpCorrectPhaseShift|SpEnantiomorph,4);
   }  
+  fourier_image = sp_image_fft_many(real_image,n);
+  if(!fourier_image){
+    /* images of different sizes */
+    for(int i = 0;i<n;i++){
+      sp_image_free(real_image[i]);
+    }
+    sp_free(real_image);
+    return NULL;
+  }
   for(int i = 0;i<n;i++){
-    fourier_image[i] = sp_image_fft(real_image[i]);
     sp_image_scale(fourier_image[i],1.0/sp_image_size(fourier_image[i]));
   }
   Image * ret = sp_prtf_basic(fourier_image,n);
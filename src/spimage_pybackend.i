@@ -19,6 +19,7 @@
 #include "../include/spimage/linear_alg.h"
 #include "../include/spimage/list.h"
 #include "../include/spimage/map.h"
+#include "../include/spimage/morphology.h"
 #include "../include/spimage/mem_util.h"
 #include "../include/spimage/phasing.h"
 #include "../include/spimage/prtf.h"
@@ -138,6 +139,7 @@
 %include "../include/spimage/linear_alg.h"
 %include "../include/spimage/list.h"
 %include "../include/spimage/map.h"
+%include "../include/spimage/morphology.h"
 %include "../include/spimage/mem_util.h"
 %include "../include/spimage/phasing.h"
 %include "../include/spimage/prtf.h"
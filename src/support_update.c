@@ -1,8 +1,14 @@
 #include <spimage.h>
+#include "phasing_private.h"
+#include "filter_cache_private.h"
+#include "image_filter_private.h"
 
 static real bezier_map_interpolation(sp_smap * map, real x);
 static void support_from_absolute_threshold(SpPhaser * ph, Image * blur, real abs_threshold);
-static int descend_complex_compare(const void * pa,const void * pb);
+static real support_select_descending(real * a, int n, int k);
+static real support_template_threshold(const SpSupportTemplateParameters * params, real * scratch, real area);
+static real * support_blurred_amplitudes(SpPhaser * ph, real radius);
+static void support_from_blurred_amplitudes(SpPhaser * ph, const real * blur, real abs_threshold);
 
 SpSupportAlgorithm * sp_support_threshold_alloc(sp_smap * blur_radius,sp_smap * threshold){
   SpSupportAlgorithm * ret = sp_malloc(sizeof(SpSupportAlgorithm));
@@ -64,11 +70,10 @@ SpSupportAlgorithm * sp_support_template_alloc(Image *initial_support, real blur
   }
   params->original_area /= (real)sp_image_size(initial_support);
   //params->blured = gaussian_blur_sensitive(initial_support,blur_radius);
-  params->sorted = sp_image_duplicate(params->blured,SP_COPY_DATA);
-  qsort(params->sorted->image->data,sp_c3matrix_size(params->sorted->image),sizeof(Complex),descend_complex_compare);
-
-  real max_threshold = sp_cabs(params->sorted->image->data[(int)(((real)sp_image_size(params->sorted))*sp_smap_max(params->area)*params->original_area)]);
-  real min_threshold = sp_cabs(params->sorted->image->data[(int)(((real)sp_image_size(params->sorted))*sp_smap_min(params->area)*params->original_area)]);
+  real * scratch = sp_malloc(sizeof(real)*sp_image_size(params->blured));
+  real max_threshold = support_template_threshold(params,scratch,sp_smap_max(params->area));
+  real min_threshold = support_template_threshold(params,scratch,sp_smap_min(params->area));
+  sp_free(scratch);
 
   if (max_threshold < 1e-4) {
     fprintf(stderr,"Dangerously large template area with this threshold!\n");
@@ -136,17 +141,12 @@ int sp_support_area_update_support(SpSupportAlgorithm *alg, SpPhaser * ph){
 int sp_support_area_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * ph){
   SpSupportAreaParameters * params = alg->params;
   real radius =  bezier_map_interpolation(params->blur_radius_map,ph->iteration);
-  Image * tmp = sp_image_duplicate(ph->g1,SP_COPY_DATA);
-  sp_image_dephase(tmp);
-  Image * blur = sp_gaussian_blur(tmp, radius);
+  real * blur = support_blurred_amplitudes(ph,radius);
   real area = bezier_map_interpolation(params->area,ph->iteration);
-  qsort(blur->image->data,sp_c3matrix_size(blur->image),sizeof(Complex),descend_complex_compare);
-  real abs_threshold = sp_cabs(blur->image->data[(int)(sp_image_size(blur)*area)]);
-  sp_image_free(blur);
-  blur = sp_gaussian_blur(tmp, radius);
-  sp_image_free(tmp);
-  support_from_absolute_threshold(ph,blur,abs_threshold);
-  sp_image_free(blur);
+  real * selected = sp_phaser_workspace_alloc(ph,sizeof(real)*ph->image_size);
+  memcpy(selected,blur,sizeof(real)*ph->image_size);
+  real abs_threshold = support_select_descending(selected,ph->image_size,ph->image_size*area);
+  support_from_blurred_amplitudes(ph,blur,abs_threshold);
   return 0;
 }
 
@@ -167,14 +167,16 @@ int sp_support_threshold_update_support(SpSupportAlgorithm *alg, SpPhaser *ph){
 int sp_support_threshold_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * ph){
   SpSupportThresholdParameters * params = alg->params;
   real radius =  bezier_map_interpolation(params->blur_radius_map,ph->iteration);
-  Image * tmp = sp_image_duplicate(ph->g1,SP_COPY_DATA);
-  sp_image_dephase(tmp);
-  Image * blur = sp_gaussian_blur(tmp, radius);  
-  sp_image_free(tmp);
+  real * blur = support_blurred_amplitudes(ph,radius);
   real rel_threshold = bezier_map_interpolation(params->threshold,ph->iteration);
-  real abs_threshold = sp_image_max(blur,NULL,NULL,NULL,NULL)*rel_threshold;  
-  support_from_absolute_threshold(ph,blur,abs_threshold);
-  sp_image_free(blur);
+  real max = 0;
+  for(int i = 0;i<ph->image_size;i++){
+    if(blur[i] > max){
+      max = blur[i];
+    }
+  }
+  real abs_threshold = max*rel_threshold;  
+  support_from_blurred_amplitudes(ph,blur,abs_threshold);
   return 0;
 }
 
@@ -195,10 +197,9 @@ int sp_support_template_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * p
   //real radius = params->blur_radius;
   //Image *blur = gaussian_blur(params->template,params->blur_radius);
   //Image *support = sp_image_duplicate(params->blured,SP_COPY_DATA);
-  real area = bezier_map_interpolation(params->area,ph->iteration);
   //qsort(blur->image->data,sp_c3matrix_size(blur->image),sizeof(Complex),descend_real_compare);
   //real abs_threshold = sp_cabs(blur->image->data[(int)(sp_image_size(blur)*area)]);area
-  real abs_threshold = sp_cabs(params->sorted->image->data[(int)(sp_image_size(params->sorted)*area*params->original_area)]);
+  real abs_threshold = sp_support_template_threshold(alg,ph);
   //sp_image_free(blur);
   //support_from_absolute_threshold(ph,support,abs_threshold);
   support_from_absolute_threshold(ph,params->blured,abs_threshold);
@@ -224,69 +225,9 @@ int sp_support_close_update_support(SpSupportAlgorithm *alg, SpPhaser * ph){
 
 int sp_support_close_update_support_cpu(SpSupportAlgorithm *alg, SpPhaser * ph){
   SpSupportCloseParameters *params = (SpSupportCloseParameters *)alg->params;
-  int pixels = params->size;
-  sp_i3matrix *tmp1 = sp_i3matrix_duplicate(ph->pixel_flags);
-  sp_i3matrix *tmp2 = sp_i3matrix_duplicate(ph->pixel_flags);
-  sp_i3matrix *foo;
-
-  for (int i = 0; i < pixels; i++) {
-    for (int x = 0; x < sp_i3matrix_x(ph->pixel_flags); x++) {
-      for (int y = 0; y < sp_i3matrix_y(ph->pixel_flags); y++) {
-	for (int z = 0; z < sp_i3matrix_z(ph->pixel_flags); z++) {
-	  if ((sp_i3matrix_get(tmp1,x,y,z) & SpPixelInsideSupport) ||
-	      ((x != 0 && sp_i3matrix_get(tmp1,x-1,y,z) & SpPixelInsideSupport) ||
-	       (x != sp_i3matrix_x(tmp1)-1 && sp_i3matrix_get(tmp1,x+1,y,z) & SpPixelInsideSupport) ||
-	       (y != 0 && sp_i3matrix_get(tmp1,x,y-1,z) & SpPixelInsideSupport) ||
-	       (y != sp_i3matrix_y(tmp1)-1 && sp_i3matrix_get(tmp1,x,y+1,z) & SpPixelInsideSupport) ||
-	       (z != 0 && sp_i3matrix_get(tmp1,x,y,z-1) & SpPixelInsideSupport) ||
-	       (z != sp_i3matrix_z(tmp1)-1 && sp_i3matrix_get(tmp1,x,y,z+1) & SpPixelInsideSupport))) {
-	    tmp2->data[z*sp_i3matrix_y(tmp2)*sp_i3matrix_x(tmp2) +
-		       y*sp_i3matrix_x(tmp2) + x] |= SpPixelInsideSupport;
-	  } else {
-	    tmp2->data[z*sp_i3matrix_y(tmp2)*sp_i3matrix_x(tmp2) +
-		       y*sp_i3matrix_x(tmp2) + x] &= ~SpPixelInsideSupport;
-	  }
-	}
-      }
-    }
-    foo = tmp1;
-    tmp1 = tmp2;
-    tmp2 = foo;
-  }
-
-  for (int i = 0; i < pixels; i++) {
-    for (int x = 0; x < sp_i3matrix_x(ph->pixel_flags); x++) {
-      for (int y = 0; y < sp_i3matrix_y(ph->pixel_flags); y++) {
-	for (int z = 0; z < sp_i3matrix_z(ph->pixel_flags); z++) {
-	  if (!(sp_i3matrix_get(tmp1,x,y,z) & SpPixelInsideSupport) ||
-	      ((x != 0 && !(sp_i3matrix_get(tmp1,x-1,y,z) & SpPixelInsideSupport)) ||
-	       (x != sp_i3matrix_x(tmp1)-1 && !(sp_i3matrix_get(tmp1,x+1,y,z) & SpPixelInsideSupport)) ||
-	       (y != 0 && !(sp_i3matrix_get(tmp1,x,y-1,z) & SpPixelInsideSupport)) ||
-	       (y != sp_i3matrix_y(tmp1)-1 && !(sp_i3matrix_get(tmp1,x,y+1,z) & SpPixelInsideSupport)) ||
-	       (z != 0 && !(sp_i3matrix_get(tmp1,x,y,z-1) & SpPixelInsideSupport)) ||
-	       (z != sp_i3matrix_z(tmp1)-1 && !(sp_i3matrix_get(tmp1,x,y,z+1) & SpPixelInsideSupport)))) {
-	    tmp2->data[z*sp_i3matrix_y(tmp2)*sp_i3matrix_x(tmp2) +
-		       y*sp_i3matrix_x(tmp2) + x] &= ~SpPixelInsideSupport;
-	  } else {
-	    tmp2->data[z*sp_i3matrix_y(tmp2)*sp_i3matrix_x(tmp2) +
-		       y*sp_i3matrix_x(tmp2) + x] |= SpPixelInsideSupport;
-	  }
-	}
-      }
-    }
-    foo = tmp1;
-    tmp1 = tmp2;
-    tmp2 = foo;
-  }
-
-  for (int i = 0; i < sp_i3matrix_size(ph->pixel_flags); i++) {
-    ph->pixel_flags->data[i] = tmp1->data[i];
-  }
-
-  sp_i3matrix_free(tmp1);
-  sp_i3matrix_free(tmp2);
-
-  return 0;
+  void * scratch = sp_phaser_workspace_alloc(ph,sp_morphology_scratch_size(ph->nx,ph->ny,ph->nz));
+  return sp_i3matrix_morphology(ph->pixel_flags,SpPixelInsideSupport,SpMorphologyClose,
+				SpMorphologyDiamond,params->size,scratch);
 }
 
 int sp_support_centre_image(SpSupportAlgorithm * alg, SpPhaser * ph){
@@ -303,6 +244,8 @@ int sp_support_centre_image(SpSupportAlgorithm * alg, SpPhaser * ph){
 }
 
 int sp_support_centre_image_cpu(SpSupportAlgorithm * alg, SpPhaser * ph){
+  /* brings ph->model up to date, in the low memory mode it is a view of g1 */
+  sp_phaser_model(ph);
   int image_x = sp_image_x(ph->model);
   int image_y = sp_image_y(ph->model);
   int image_z = sp_image_z(ph->model);
@@ -399,6 +342,72 @@ static void support_from_absolute_threshold(SpPhaser * ph, Image * blur, real ab
   }
 }
 
+/* Returns the absolute value of the model blurred by a gaussian of the
+   given radius, in a buffer of the phaser workspace. This gives the same
+   result as sp_gaussian_blur() on the dephased model. The kernels or
+   the transfer function are built in the workspace too rather than
+   taken from the filter cache, as the radius usually changes from one
+   update to the next and they are cheap to build. */
+static real * support_blurred_amplitudes(SpPhaser * ph, real radius){
+  const int nx = ph->nx;
+  const int ny = ph->ny;
+  const int nz = ph->nz;
+  const int size = ph->image_size;
+  /* The amplitudes are real but go through complex FFTs */
+  if(sp_gaussian_blur_spatial_is_faster(nx,ny,nz,radius,1,0)){
+    real * ret = sp_phaser_workspace_alloc(ph,sizeof(real)*size);
+    real * scratch = sp_phaser_workspace_alloc(ph,sizeof(real)*sp_gaussian_blur_spatial_scratch(1,nx,ny,nz,radius));
+    real * kernels = sp_phaser_workspace_alloc(ph,sizeof(real)*sp_gaussian_blur_kernels_size(nx,ny,nz,radius));
+    sp_gaussian_blur_kernels(nx,ny,nz,radius,kernels);
+    if(ph->real_object){
+      for(int i = 0;i<size;i++){
+	ret[i] = fabs(ph->r1[i]);
+      }
+    }else{
+      for(int i = 0;i<size;i++){
+	ret[i] = sp_cabs(ph->g1->image->data[i]);
+      }
+    }
+    sp_gaussian_blur_spatial(ret,1,nx,ny,nz,radius,kernels,scratch);
+    for(int i = 0;i<size;i++){
+      ret[i] = fabs(ret[i]);
+    }
+    return ret;
+  }
+  Complex * blur = sp_phaser_workspace_alloc(ph,sizeof(Complex)*size);
+  if(ph->real_object){
+    for(int i = 0;i<size;i++){
+      blur[i] = sp_cinit(fabs(ph->r1[i]),0);
+    }
+  }else{
+    for(int i = 0;i<size;i++){
+      blur[i] = sp_cinit(sp_cabs(ph->g1->image->data[i]),0);
+    }
+  }
+  sp_fft_stack(blur,blur,nx,ny,nz,1);
+  double * transfer = sp_phaser_workspace_alloc(ph,sizeof(double)*sp_filter_transfer_size(nx,ny,nz,0));
+  sp_filter_transfer_tables(FilterGaussianBlur,nx,ny,nz,0,radius,NULL,transfer);
+  sp_filter_transfer_apply(transfer,blur,nx,ny,nz,0);
+  sp_ifft_stack(blur,blur,nx,ny,nz,1);
+  /* The result is real. Pack it at the start of the same buffer, which
+     is safe going forward as element i is read before it's overwritten. */
+  real * ret = (real *)blur;
+  for(int i = 0;i<size;i++){
+    ret[i] = fabs(sp_real(blur[i]));
+  }
+  return ret;
+}
+
+static void support_from_blurred_amplitudes(SpPhaser * ph, const real * blur, real abs_threshold){
+  for(int i =0 ;i<ph->image_size;i++){
+    if(blur[i] > abs_threshold){
+      ph->pixel_flags->data[i] |= SpPixelInsideSupport;
+    }else{
+      ph->pixel_flags->data[i] &= ~SpPixelInsideSupport;
+    }
+  }
+}
+
 static real bezier_map_interpolation(sp_smap * map, real x){
   sp_list * keys = sp_smap_get_keys(map);
   sp_list * values = sp_smap_get_values(map);
@@ -440,17 +449,71 @@ static real bezier_map_interpolation(sp_smap * map, real x){
 }
 
 
-static int descend_complex_compare(const void * pa,const void * pb){
-  Complex a,b;
-  a = *((Complex *)pa);
-  b = *((Complex *)pb);
-  if(sp_cabs(a) < sp_cabs(b)){
-    return 1;
-  }else if(sp_cabs(a) == sp_cabs(b)){
-    return 0;
-  }else{
-    return -1;
+/* Returns the value at position k of a sorted in descending order, with
+   k clamped to [0,n). It partitions a in place around median of three
+   pivots, which takes O(n) on average instead of the O(n log n) of a full
+   sort. */
+static real support_select_descending(real * a, int n, int k){
+  int lo = 0;
+  int hi = n-1;
+  if(k < 0){
+    k = 0;
+  }
+  if(k > n-1){
+    k = n-1;
+  }
+  while(lo < hi){
+    int mid = lo+(hi-lo)/2;
+    real pivot = a[mid];
+    if((a[lo] > pivot) != (a[lo] > a[hi])){
+      pivot = a[lo];
+    }else if((a[hi] > pivot) != (a[hi] > a[lo])){
+      pivot = a[hi];
+    }
+    /* [lo,j] ends up >= pivot and [i,hi] <= pivot */
+    int i = lo;
+    int j = hi;
+    while(i <= j){
+      while(a[i] > pivot){
+	i++;
+      }
+      while(a[j] < pivot){
+	j--;
+      }
+      if(i <= j){
+	real t = a[i];
+	a[i] = a[j];
+	a[j] = t;
+	i++;
+	j--;
+      }
+    }
+    if(k <= j){
+      hi = j;
+    }else if(k >= i){
+      lo = i;
+    }else{
+      /* between j and i everything equals the pivot */
+      return a[k];
+    }
   }
+  return a[k];
+}
+
+/* scratch must hold as many reals as the template has pixels */
+static real support_template_threshold(const SpSupportTemplateParameters * params, real * scratch, real area){
+  int size = sp_image_size(params->blured);
+  for(int i = 0;i<size;i++){
+    scratch[i] = sp_cabs(params->blured->image->data[i]);
+  }
+  return support_select_descending(scratch,size,size*area*params->original_area);
+}
+
+real sp_support_template_threshold(SpSupportAlgorithm * alg, SpPhaser * ph){
+  SpSupportTemplateParameters * params = alg->params;
+  real area = bezier_map_interpolation(params->area,ph->iteration);
+  real * scratch = sp_phaser_workspace_alloc(ph,sizeof(real)*sp_image_size(params->blured));
+  return support_template_threshold(params,scratch,area);
 }
 
 /* Alloc an array with a certain size. After this the elemnets
@@ -490,5 +553,7 @@ int sp_support_array_update(SpSupportArray *array, SpPhaser *ph){
   for (int i = 0; i < array->size; i++) {
     ((int(*)(SpSupportAlgorithm *,SpPhaser *))array->algorithms[i]->function)(array->algorithms[i],ph);
   }
+  /* The support changed */
+  ph->spans_valid = 0;
   return 0;
 }
@@ -324,8 +324,7 @@ int sp_support_template_update_support_cuda(SpSupportAlgorithm *alg, SpPhaser *p
   cufftComplex *blured;
   cutilSafeCall(cudaMalloc((void**)&blured, sizeof(cufftComplex)*ph->image_size));
   cutilSafeCall(cudaMemcpy(blured,params->blured->image->data,sizeof(cufftComplex)*ph->image_size,cudaMemcpyHostToDevice)); //should this be device to host?
-  real area = bezier_map_interpolation(params->area,ph->iteration);
-  real abs_threshold = sp_cabs(params->sorted->image->data[(int)(sp_image_size(params->sorted)*area*params->original_area)]);
+  real abs_threshold = sp_support_template_threshold(alg,ph);
   support_from_absolute_threshold_cuda(ph,blured,abs_threshold);
   cutilSafeCall(cudaFree(blured));
   return 0;
@@ -0,0 +1,171 @@
+#define _XOPEN_SOURCE 500
+
+#include <stdlib.h>
+#include <stdio.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "spimage.h"
+#include "thread_pool_private.h"
+
+#if defined(_WIN32)
+
+struct SpThreadPool{
+  int nthreads;
+};
+
+SpThreadPool * sp_thread_pool_alloc(int nthreads){
+  SpThreadPool * pool = sp_malloc(sizeof(SpThreadPool));
+  pool->nthreads = 1;
+  return pool;
+}
+
+void sp_thread_pool_free(SpThreadPool * pool){
+  sp_free(pool);
+}
+
+void sp_thread_pool_for(SpThreadPool * pool, int n, SpThreadPoolFunction fn, void * ctx){
+  fn(ctx,0,n,0);
+}
+
+int sp_thread_pool_cpu_count(){
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+#else
+
+typedef struct{
+  SpThreadPool * pool;
+  int part;
+}ThreadPoolWorker;
+
+struct SpThreadPool{
+  int nthreads;
+  pthread_t * threads;
+  ThreadPoolWorker * workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  /* incremented for every loop so that workers know there's new work */
+  long generation;
+  /* number of workers still running the current loop */
+  int pending;
+  int quit;
+  int n;
+  SpThreadPoolFunction fn;
+  void * ctx;
+};
+
+static void thread_pool_run_part(SpThreadPool * pool, int n, SpThreadPoolFunction fn, void * ctx, int part){
+  int begin = (long long)n*part/pool->nthreads;
+  int end = (long long)n*(part+1)/pool->nthreads;
+  fn(ctx,begin,end,part);
+}
+
+static void * thread_pool_worker(void * p){
+  ThreadPoolWorker * w = p;
+  SpThreadPool * pool = w->pool;
+  long seen = 0;
+  pthread_mutex_lock(&pool->mutex);
+  while(1){
+    while(pool->generation == seen && !pool->quit){
+      pthread_cond_wait(&pool->start,&pool->mutex);
+    }
+    if(pool->quit){
+      break;
+    }
+    seen = pool->generation;
+    int n = pool->n;
+    SpThreadPoolFunction fn = pool->fn;
+    void * ctx = pool->ctx;
+    pthread_mutex_unlock(&pool->mutex);
+    thread_pool_run_part(pool,n,fn,ctx,w->part);
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending--;
+    if(pool->pending == 0){
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+SpThreadPool * sp_thread_pool_alloc(int nthreads){
+  SpThreadPool * pool = sp_malloc(sizeof(SpThreadPool));
+  if(nthreads < 1){
+    nthreads = 1;
+  }
+  pool->nthreads = nthreads;
+  pool->generation = 0;
+  pool->pending = 0;
+  pool->quit = 0;
+  pool->threads = sp_malloc(sizeof(pthread_t)*nthreads);
+  pool->workers = sp_malloc(sizeof(ThreadPoolWorker)*nthreads);
+  pthread_mutex_init(&pool->mutex,NULL);
+  pthread_cond_init(&pool->start,NULL);
+  pthread_cond_init(&pool->done,NULL);
+  /* The calling thread runs part 0 */
+  for(int i = 1;i<nthreads;i++){
+    pool->workers[i].pool = pool;
+    pool->workers[i].part = i;
+    if(pthread_create(&pool->threads[i],NULL,thread_pool_worker,&pool->workers[i])){
+      fprintf(stderr,"Error: Could not create thread. Using %d threads.\n",i);
+      pool->nthreads = i;
+      break;
+    }
+  }
+  return pool;
+}
+
+void sp_thread_pool_free(SpThreadPool * pool){
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for(int i = 1;i<pool->nthreads;i++){
+    pthread_join(pool->threads[i],NULL);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  sp_free(pool->threads);
+  sp_free(pool->workers);
+  sp_free(pool);
+}
+
+void sp_thread_pool_for(SpThreadPool * pool, int n, SpThreadPoolFunction fn, void * ctx){
+  if(pool->nthreads == 1){
+    fn(ctx,0,n,0);
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->n = n;
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->pending = pool->nthreads-1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  thread_pool_run_part(pool,n,fn,ctx,0);
+  pthread_mutex_lock(&pool->mutex);
+  while(pool->pending){
+    pthread_cond_wait(&pool->done,&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+int sp_thread_pool_cpu_count(){
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+#endif
+
+int sp_thread_pool_size(const SpThreadPool * pool){
+  return pool->nthreads;
+}
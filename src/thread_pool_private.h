@@ -0,0 +1,28 @@
+#ifndef _THREAD_POOL_PRIVATE_H_
+#define _THREAD_POOL_PRIVATE_H_
+
+/* A fixed set of worker threads which run loops with static partitioning.
+
+   sp_thread_pool_for(pool,n,fn,ctx) calls fn(ctx,begin,end,part) for
+   every part of [0,n), even empty ones, and returns once all of them
+   are done. Part p always covers [n*p/nparts,n*(p+1)/nparts), so
+   reductions which keep one partial result per part and add them up in
+   part order give the same result on every run with the same number of
+   threads. The calling thread runs part 0 itself. A pool must only be
+   used by one thread at a time. */
+
+typedef void (*SpThreadPoolFunction)(void * ctx, int begin, int end, int part);
+
+typedef struct SpThreadPool SpThreadPool;
+
+/* Returns a pool which splits loops in nthreads parts. On platforms
+   without pthreads the loops run serially, in a single part. */
+SpThreadPool * sp_thread_pool_alloc(int nthreads);
+void sp_thread_pool_free(SpThreadPool * pool);
+/* Number of parts loops are split in */
+int sp_thread_pool_size(const SpThreadPool * pool);
+void sp_thread_pool_for(SpThreadPool * pool, int n, SpThreadPoolFunction fn, void * ctx);
+/* Number of processors available, at least 1 */
+int sp_thread_pool_cpu_count();
+
+#endif
@@ -1099,6 +1099,258 @@ void test_sp_gaussian_blur_cuda_speed(CuTest * tc){
 }
 #endif
 
+void test_sp_filter_cache(CuTest * tc){
+  SpFilterCacheStats stats;
+  Image * a = sp_image_alloc(12,10,1);
+  for(int i = 0;i<sp_image_size(a);i++){
+    a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+  }
+  a->phased = 1;
+  real radius = 1.5;
+  /* Reference blur with the transfer function computed per pixel */
+  Image * ref = sp_image_fft(a);
+  for(int i = 0;i<sp_image_size(ref);i++){
+    real r = sp_image_dist(ref,i,SP_TO_TOP_LEFT)/sp_image_x(ref);
+    ref->image->data[i] = sp_cscale(ref->image->data[i],exp(-2*M_PI*M_PI*r*r*radius*radius)/sp_image_size(ref));
+  }
+  Image * expected = sp_image_ifft(ref);
+  sp_filter_cache_clear();
+  /* Always take the FFT path */
+  sp_gaussian_blur_set_fft_cost(0);
+  Image * b = sp_gaussian_blur(a,radius);
+  sp_filter_cache_stats(&stats);
+  CuAssertTrue(tc,stats.misses == 1);
+  CuAssertTrue(tc,stats.hits == 0);
+  CuAssertTrue(tc,stats.entries == 1);
+  /* One table per axis */
+  CuAssertTrue(tc,stats.bytes == sizeof(double)*(sp_image_x(a)+sp_image_y(a)+sp_image_z(a)));
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,expected->image->data[i],b->image->data[i],1e-5);
+  }
+  /* The same blur again reuses the transfer function */
+  Image * c = sp_gaussian_blur(a,radius);
+  sp_filter_cache_stats(&stats);
+  CuAssertTrue(tc,stats.misses == 1);
+  CuAssertTrue(tc,stats.hits == 1);
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,b->image->data[i],c->image->data[i],REAL_EPSILON);
+  }
+  sp_image_free(c);
+  /* A real image uses the half spectrum, which is a different entry */
+  Image * d = sp_image_duplicate(a,SP_COPY_ALL);
+  sp_image_dephase(d);
+  c = sp_gaussian_blur(d,radius);
+  sp_filter_cache_stats(&stats);
+  CuAssertTrue(tc,stats.misses == 2);
+  CuAssertTrue(tc,stats.entries == 2);
+  sp_image_free(c);
+  /* Without room the transfer functions are still right */
+  sp_filter_cache_set_capacity(0);
+  sp_filter_cache_stats(&stats);
+  CuAssertTrue(tc,stats.entries == 0);
+  CuAssertTrue(tc,stats.bytes == 0);
+  CuAssertTrue(tc,stats.evictions == 2);
+  c = sp_gaussian_blur(a,radius);
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,b->image->data[i],c->image->data[i],REAL_EPSILON);
+  }
+  sp_filter_cache_stats(&stats);
+  CuAssertTrue(tc,stats.entries == 0);
+  sp_image_free(c);
+  sp_filter_cache_set_capacity(1024*1024);
+  sp_gaussian_blur_set_fft_cost(-1);
+  /* The gaussian window is measured from the center of unshifted images */
+  for(int shifted = 0;shifted<2;shifted++){
+    d->shifted = shifted;
+    c = sp_gaussian_filter(d,3,0);
+    for(int i = 0;i<sp_image_size(d);i++){
+      real r = sp_image_dist(d,i,SP_TO_CENTER)/3;
+      CuAssertComplexEquals(tc,sp_cscale(d->image->data[i],exp(-7*r*r)),c->image->data[i],1e-6);
+    }
+    sp_image_free(c);
+  }
+  sp_image_free(a);
+  sp_image_free(b);
+  sp_image_free(d);
+  sp_image_free(ref);
+  sp_image_free(expected);
+  PRINT_DONE;
+}
+
+/* Returns the blur of a with the transfer function computed per pixel */
+static Image * gaussian_blur_reference(Image * a, real radius){
+  Image * ref = sp_image_fft(a);
+  for(int i = 0;i<sp_image_size(ref);i++){
+    real r = sp_image_dist(ref,i,SP_TO_TOP_LEFT)/sp_image_x(ref);
+    ref->image->data[i] = sp_cscale(ref->image->data[i],exp(-2*M_PI*M_PI*r*r*radius*radius)/sp_image_size(ref));
+  }
+  Image * expected = sp_image_ifft(ref);
+  sp_image_free(ref);
+  return expected;
+}
+
+void test_sp_gaussian_blur_spatial(CuTest * tc){
+  SpFilterCacheStats stats;
+  real radius = 1.5;
+  /* The kernels leave out 0.3% of the weight of the gaussian */
+  const real tolerance = 5e-3;
+  for(int phased = 0;phased<2;phased++){
+    Image * a = sp_image_alloc(1024,2-phased,1);
+    for(int i = 0;i<sp_image_size(a);i++){
+      a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,phased ? (float)rand()/RAND_MAX : 0);
+    }
+    a->phased = phased;
+    Image * expected = gaussian_blur_reference(a,radius);
+    /* Always take the spatial path */
+    sp_gaussian_blur_set_fft_cost(1e6);
+    CuAssertTrue(tc,sp_gaussian_blur_is_spatial(a,radius));
+    sp_filter_cache_clear();
+    Image * b = sp_gaussian_blur(a,radius);
+    /* Only the kernels were needed */
+    sp_filter_cache_stats(&stats);
+    CuAssertTrue(tc,stats.misses == 1);
+    CuAssertTrue(tc,stats.entries == 1);
+    CuAssertTrue(tc,b->phased == 1);
+    CuAssertTrue(tc,b->shifted == 0);
+    /* The input wraps around as with the FFT */
+    for(int i = 0;i<sp_image_size(a);i++){
+      CuAssertComplexEquals(tc,expected->image->data[i],b->image->data[i],tolerance);
+    }
+    /* The same blur again reuses the kernels */
+    Image * c = sp_gaussian_blur(a,radius);
+    sp_filter_cache_stats(&stats);
+    CuAssertTrue(tc,stats.misses == 1);
+    CuAssertTrue(tc,stats.hits == 1);
+    for(int i = 0;i<sp_image_size(a);i++){
+      CuAssertComplexEquals(tc,b->image->data[i],c->image->data[i],REAL_EPSILON);
+    }
+    sp_image_free(c);
+    /* Without a cost the FFTs are always used */
+    sp_gaussian_blur_set_fft_cost(0);
+    CuAssertTrue(tc,!sp_gaussian_blur_is_spatial(a,radius));
+    c = sp_gaussian_blur(a,radius);
+    sp_filter_cache_stats(&stats);
+    CuAssertTrue(tc,stats.misses == 2);
+    for(int i = 0;i<sp_image_size(a);i++){
+      CuAssertComplexEquals(tc,expected->image->data[i],c->image->data[i],1e-5);
+    }
+    sp_image_free(c);
+    sp_image_free(a);
+    sp_image_free(b);
+    sp_image_free(expected);
+  }
+  /* With the measured costs the blurs of the support updates of typical
+     2D and 3D volumes are done in real space */
+  sp_gaussian_blur_set_fft_cost(-1);
+  int sizes[2][3] = {{128,128,1},{64,64,64}};
+  for(int s = 0;s<2;s++){
+    int nx = sizes[s][0];
+    int ny = sizes[s][1];
+    int nz = sizes[s][2];
+    Image * a = sp_image_alloc(nx,ny,nz);
+    for(int i = 0;i<sp_image_size(a);i++){
+      a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,0);
+    }
+    /* Like the dephased model of a support update */
+    a->phased = 0;
+    for(radius = 2;radius<=3;radius++){
+      CuAssertTrue(tc,sp_gaussian_blur_is_spatial(a,radius));
+      sp_filter_cache_clear();
+      Image * b = sp_gaussian_blur(a,radius);
+      /* The cache holds kernels and not the much larger transfer tables */
+      sp_filter_cache_stats(&stats);
+      CuAssertTrue(tc,stats.entries == 1);
+      CuAssertTrue(tc,stats.bytes < sizeof(double)*(nx/2+1+ny+nz));
+      Image * expected = gaussian_blur_reference(a,radius);
+      for(int i = 0;i<sp_image_size(a);i++){
+	CuAssertComplexEquals(tc,expected->image->data[i],b->image->data[i],tolerance);
+      }
+      sp_image_free(expected);
+      sp_image_free(b);
+    }
+    sp_image_free(a);
+  }
+  PRINT_DONE;
+}
+
+void test_sp_morphology(CuTest * tc){
+  const int nx = 13;
+  const int ny = 11;
+  const int nz = 7;
+  const int size = nx*ny*nz;
+  const real radii[4] = {0,1,1.5,2.5};
+  sp_i3matrix * in = sp_i3matrix_alloc(nx,ny,nz);
+  sp_i3matrix * out = sp_i3matrix_alloc(nx,ny,nz);
+  for(int i = 0;i<size;i++){
+    /* bit 2 marks the set, bit 4 must be left alone */
+    in->data[i] = (rand() % 6 == 0 ? 2 : 0) | (rand() % 2 ? 4 : 0);
+  }
+  for(int element = SpMorphologyBall;element <= SpMorphologyDiamond;element++){
+    for(int r = 0;r<4;r++){
+      for(int op = SpMorphologyDilate;op <= SpMorphologyErode;op++){
+	memcpy(out->data,in->data,sizeof(int)*size);
+	CuAssertIntEquals(tc,0,sp_i3matrix_morphology(out,2,op,element,radii[r],NULL));
+	/* Compare with going through the whole structuring element */
+	for(int z = 0;z<nz;z++){
+	  for(int y = 0;y<ny;y++){
+	    for(int x = 0;x<nx;x++){
+	      int expected = (op == SpMorphologyErode);
+	      for(int i = 0;i<size;i++){
+		int dx = abs(i%nx-x);
+		int dy = abs((i/nx)%ny-y);
+		int dz = abs(i/(nx*ny)-z);
+		int inside;
+		if(element == SpMorphologyBall){
+		  inside = dx*dx+dy*dy+dz*dz <= radii[r]*radii[r];
+		}else if(element == SpMorphologyBox){
+		  inside = MAX(dx,MAX(dy,dz)) <= radii[r];
+		}else{
+		  inside = dx+dy+dz <= radii[r];
+		}
+		if(inside && op == SpMorphologyDilate && (in->data[i] & 2)){
+		  expected = 1;
+		}
+		if(inside && op == SpMorphologyErode && !(in->data[i] & 2)){
+		  expected = 0;
+		}
+	      }
+	      int i = (z*ny+y)*nx+x;
+	      CuAssertIntEquals(tc,expected,(out->data[i] & 2) != 0);
+	      CuAssertIntEquals(tc,in->data[i] & 4,out->data[i] & 4);
+	    }
+	  }
+	}
+      }
+    }
+  }
+  /* Closing is a dilation followed by an erosion */
+  sp_i3matrix * expected = sp_i3matrix_duplicate(in);
+  sp_i3matrix_morphology(expected,2,SpMorphologyDilate,SpMorphologyBall,2,NULL);
+  sp_i3matrix_morphology(expected,2,SpMorphologyErode,SpMorphologyBall,2,NULL);
+  memcpy(out->data,in->data,sizeof(int)*size);
+  sp_i3matrix_morphology(out,2,SpMorphologyClose,SpMorphologyBall,2,NULL);
+  for(int i = 0;i<size;i++){
+    CuAssertIntEquals(tc,expected->data[i],out->data[i]);
+  }
+  CuAssertTrue(tc,sp_i3matrix_morphology(out,2,SpMorphologyClose,SpMorphologyBall,-1,NULL) < 0);
+  /* Growing a mask by n pixels is a dilation by a diamond */
+  Image * a = sp_image_alloc(nx,ny,nz);
+  for(int i = 0;i<size;i++){
+    a->mask->data[i] = (in->data[i] & 2) != 0;
+  }
+  sp_image_grow_mask(a,2);
+  memcpy(out->data,in->data,sizeof(int)*size);
+  sp_i3matrix_morphology(out,2,SpMorphologyDilate,SpMorphologyDiamond,2,NULL);
+  for(int i = 0;i<size;i++){
+    CuAssertIntEquals(tc,(out->data[i] & 2) != 0,a->mask->data[i]);
+  }
+  sp_image_free(a);
+  sp_i3matrix_free(in);
+  sp_i3matrix_free(out);
+  sp_i3matrix_free(expected);
+  PRINT_DONE;
+}
+
 CuSuite* image_get_suite(void)
 {
   CuSuite* suite = CuSuiteNew();  
@@ -1122,6 +1374,9 @@ CuSuite* image_get_suite(void)
   SUITE_ADD_TEST(suite,test_sp_image_convolute_fractional);
   SUITE_ADD_TEST(suite,test_sp_image_superimpose_fractional);
   SUITE_ADD_TEST(suite,test_sp_image_phase_shift);
+  SUITE_ADD_TEST(suite,test_sp_filter_cache);
+  SUITE_ADD_TEST(suite,test_sp_gaussian_blur_spatial);
+  SUITE_ADD_TEST(suite,test_sp_morphology);
   if(sp_cuda_get_device_type() == SpCUDAHardwareDevice){
 #ifdef _USE_CUDA
     SUITE_ADD_TEST(suite,test_sp_gaussian_blur_cuda);
@@ -3,6 +3,9 @@
 #include <gsl/gsl_vector_float.h>
 #include <gsl/gsl_cblas.h>
 #include <gsl/gsl_blas.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 
 static Complex czero = {0,0};
@@ -1810,6 +1813,357 @@ void test_sp_image_fft(CuTest * tc){
 #endif
 }
 
+void test_sp_fft_plan_cache(CuTest * tc){
+  SpFFTPlanCacheStats stats;
+  Image * a = sp_image_alloc(16,8,4);
+  for(int i = 0;i<sp_image_size(a);i++){
+    a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+  }
+  a->phased = 1;
+  Image * b = sp_image_duplicate(a,SP_COPY_ALL);
+  sp_fft_plan_cache_clear();
+  Image * fa = sp_image_fft(a);
+  sp_fft_plan_cache_stats(&stats);
+  CuAssertTrue(tc,stats.misses == 1);
+  CuAssertTrue(tc,stats.hits == 0);
+  /* The input must not be touched by the planner */
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,a->image->data[i],b->image->data[i],REAL_EPSILON);
+  }
+  /* Same transform again must reuse the plan and give the same result */
+  Image * fa2 = sp_image_fft(a);
+  sp_fft_plan_cache_stats(&stats);
+  CuAssertTrue(tc,stats.misses == 1);
+  CuAssertTrue(tc,stats.hits == 1);
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,fa->image->data[i],fa2->image->data[i],REAL_EPSILON);
+  }
+  /* In place transforms use a different plan */
+  sp_image_fft_fast(b,b);
+  sp_fft_plan_cache_stats(&stats);
+  CuAssertTrue(tc,stats.misses == 2);
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,fa->image->data[i],b->image->data[i],sp_cabs(fa->image->data[i])*1e-5+1e-4);
+  }
+  /* Round trip */
+  sp_image_ifft_fast(b,b);
+  sp_image_scale(b,1.0/sp_image_size(b));
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,a->image->data[i],b->image->data[i],1e-5);
+  }
+  /* Eviction */
+  sp_fft_plan_cache_set_capacity(1);
+  sp_fft_plan_cache_stats(&stats);
+  CuAssertTrue(tc,stats.entries == 1);
+  CuAssertTrue(tc,stats.evictions == 2);
+  sp_image_free(fa2);
+  fa2 = sp_image_ifft(fa);
+  sp_fft_plan_cache_stats(&stats);
+  CuAssertTrue(tc,stats.entries == 1);
+  CuAssertTrue(tc,stats.evictions == 3);
+  sp_fft_plan_cache_set_capacity(16);
+  sp_image_free(a);
+  sp_image_free(b);
+  sp_image_free(fa);
+  sp_image_free(fa2);
+}
+
+#ifndef _WIN32
+typedef struct{
+  Image * in;
+  Image * out;
+  int nthreads;
+}FFTThreadArg;
+
+static void * fft_thread(void * p){
+  FFTThreadArg * arg = p;
+  for(int i = 0;i<20;i++){
+    sp_image_fft_fast_threads(arg->in,arg->out,arg->nthreads);
+  }
+  return NULL;
+}
+
+void test_sp_fft_concurrent(CuTest * tc){
+  /* Each thread uses its own number of FFT threads and some share sizes */
+  int nthreads = 4;
+  pthread_t threads[4];
+  FFTThreadArg args[4];
+  sp_fft_plan_cache_clear();
+  for(int t = 0;t<nthreads;t++){
+    args[t].in = sp_image_alloc(8+4*(t%2),8,2);
+    for(int i = 0;i<sp_image_size(args[t].in);i++){
+      args[t].in->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+    }
+    args[t].in->phased = 1;
+    args[t].out = sp_image_duplicate(args[t].in,SP_COPY_DETECTOR);
+    args[t].nthreads = t/2;
+    pthread_create(&threads[t],NULL,fft_thread,&args[t]);
+  }
+  for(int t = 0;t<nthreads;t++){
+    pthread_join(threads[t],NULL);
+  }
+  for(int t = 0;t<nthreads;t++){
+    Image * expected = sp_image_fft(args[t].in);
+    for(int i = 0;i<sp_image_size(expected);i++){
+      CuAssertComplexEquals(tc,expected->image->data[i],args[t].out->image->data[i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+    }
+    sp_image_free(expected);
+    sp_image_free(args[t].in);
+    sp_image_free(args[t].out);
+  }
+}
+#endif
+
+void test_sp_fft_backend(CuTest * tc){
+  /* Powers of 2, other small primes and a large prime */
+  int sizes[3][3] = {{16,8,4},{12,9,5},{1,30,17}};
+  SpFFTBackend old = sp_fft_backend();
+  CuAssertTrue(tc,sp_fft_set_backend(SpFFTBackendAuto+1) == -1);
+  CuAssertTrue(tc,strcmp(sp_fft_backend_name(SpFFTBackendBuiltin),"builtin") == 0);
+  if(!sp_fft_backend_name(SpFFTBackendFFTW3)){
+    /* Built without FFTW, the reference below is the builtin FFT */
+    CuAssertTrue(tc,sp_fft_set_backend(SpFFTBackendFFTW3) == -1);
+  }
+  for(int s = 0;s<3;s++){
+    Image * a = sp_image_alloc(sizes[s][0],sizes[s][1],sizes[s][2]);
+    for(int i = 0;i<sp_image_size(a);i++){
+      a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+    }
+    a->phased = 1;
+    sp_fft_set_backend(SpFFTBackendFFTW3);
+    Image * expected = sp_image_fft(a);
+    for(int backend = SpFFTBackendBuiltin;backend<=SpFFTBackendAuto;backend++){
+      sp_fft_set_backend(backend);
+      CuAssertIntEquals(tc,backend,sp_fft_backend());
+      Image * fa = sp_image_fft(a);
+      for(int i = 0;i<sp_image_size(a);i++){
+	CuAssertComplexEquals(tc,expected->image->data[i],fa->image->data[i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+      }
+      /* In place round trip */
+      sp_image_ifft_fast(fa,fa);
+      sp_image_scale(fa,1.0/sp_image_size(fa));
+      for(int i = 0;i<sp_image_size(a);i++){
+	CuAssertComplexEquals(tc,a->image->data[i],fa->image->data[i],1e-5);
+      }
+      sp_image_free(fa);
+    }
+    sp_image_free(a);
+    sp_image_free(expected);
+  }
+  sp_fft_set_backend(old);
+}
+
+void test_sp_fft_wisdom(CuTest * tc){
+  SpFFTPlannerRigor old = sp_fft_planner_rigor();
+  if(!sp_fft_backend_name(SpFFTBackendFFTW3)){
+    /* Built without FFTW there is no wisdom */
+    CuAssertIntEquals(tc,-1,sp_fft_export_wisdom("test_wisdom.txt"));
+    CuAssertIntEquals(tc,-1,sp_fft_import_wisdom("test_wisdom.txt"));
+    return;
+  }
+  Image * a = sp_image_alloc(8,8,1);
+  for(int i = 0;i<sp_image_size(a);i++){
+    a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+  }
+  a->phased = 1;
+  remove("test_wisdom.txt");
+  /* A missing wisdom file is not an error */
+  CuAssertIntEquals(tc,0,sp_fft_set_wisdom_file("test_wisdom.txt"));
+  sp_fft_set_planner_rigor(SpFFTEstimate);
+  CuAssertIntEquals(tc,SpFFTEstimate,sp_fft_planner_rigor());
+  Image * fa = sp_image_fft(a);
+  CuAssertIntEquals(tc,0,sp_finalize_fft());
+  FILE * fp = fopen("test_wisdom.txt","r");
+  CuAssertPtrNotNull(tc,fp);
+  fclose(fp);
+  CuAssertIntEquals(tc,0,sp_fft_import_wisdom("test_wisdom.txt"));
+  /* Plans which are not in the wisdom must still be created */
+  sp_fft_set_planner_rigor(SpFFTWisdomOnly);
+  Image * fa2 = sp_image_fft(a);
+  for(int i = 0;i<sp_image_size(a);i++){
+    CuAssertComplexEquals(tc,fa->image->data[i],fa2->image->data[i],sp_cabs(fa->image->data[i])*1e-5+1e-4);
+  }
+  sp_fft_set_wisdom_file(NULL);
+  sp_fft_set_planner_rigor(old);
+  remove("test_wisdom.txt");
+  sp_image_free(a);
+  sp_image_free(fa);
+  sp_image_free(fa2);
+}
+
+void test_sp_image_rfft(CuTest * tc){
+  int sizes[3][3] = {{16,8,1},{7,5,1},{6,5,3}};
+  for(int s = 0;s<3;s++){
+    Image * a = sp_image_alloc(sizes[s][0],sizes[s][1],sizes[s][2]);
+    for(int i = 0;i<sp_image_size(a);i++){
+      a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,0);
+    }
+    Image * fa = sp_image_fft(a);
+    Image * ra = sp_image_rfft(a);
+    CuAssertIntEquals(tc,sp_image_x(a)/2+1,sp_image_x(ra));
+    CuAssertIntEquals(tc,sp_image_y(a),sp_image_y(ra));
+    CuAssertIntEquals(tc,sp_image_z(a),sp_image_z(ra));
+    Image * ea = sp_image_rfft_expand(ra,sp_image_x(a));
+    for(int i = 0;i<sp_image_size(a);i++){
+      CuAssertComplexEquals(tc,fa->image->data[i],ea->image->data[i],sp_cabs(fa->image->data[i])*1e-5+1e-4);
+    }
+    Image * b = sp_image_irfft(ra,sp_image_x(a));
+    CuAssertTrue(tc,b != NULL);
+    CuAssertIntEquals(tc,0,b->phased);
+    sp_image_scale(b,1.0/sp_image_size(b));
+    for(int i = 0;i<sp_image_size(a);i++){
+      CuAssertComplexEquals(tc,a->image->data[i],b->image->data[i],1e-5);
+    }
+    /* Wrong sizes must be refused */
+    CuAssertTrue(tc,sp_image_irfft(ra,sp_image_x(a)+2) == NULL);
+    sp_image_free(a);
+    sp_image_free(fa);
+    sp_image_free(ra);
+    sp_image_free(ea);
+    sp_image_free(b);
+  }
+}
+
+void test_sp_image_fft_many(CuTest * tc){
+  /* More images than fit in a single batch */
+  int n = 20;
+  Image ** list = sp_malloc(sizeof(Image *)*n);
+  for(int j = 0;j<n;j++){
+    list[j] = sp_image_alloc(6,4,3);
+    for(int i = 0;i<sp_image_size(list[j]);i++){
+      list[j]->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+    }
+    list[j]->phased = 1;
+  }
+  Image ** ft = sp_image_fft_many(list,n);
+  Image ** back = sp_image_ifft_many(ft,n);
+  for(int j = 0;j<n;j++){
+    Image * expected = sp_image_fft(list[j]);
+    for(int i = 0;i<sp_image_size(expected);i++){
+      CuAssertComplexEquals(tc,expected->image->data[i],ft[j]->image->data[i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+    }
+    sp_image_scale(back[j],1.0/sp_image_size(back[j]));
+    for(int i = 0;i<sp_image_size(list[j]);i++){
+      CuAssertComplexEquals(tc,list[j]->image->data[i],back[j]->image->data[i],1e-5);
+    }
+    sp_image_free(expected);
+    sp_image_free(ft[j]);
+    sp_image_free(back[j]);
+    sp_image_free(list[j]);
+  }
+  sp_free(ft);
+  sp_free(back);
+  /* Mismatched sizes are rejected */
+  list[0] = sp_image_alloc(4,4,1);
+  list[1] = sp_image_alloc(4,2,1);
+  CuAssertTrue(tc,sp_image_fft_many(list,2) == NULL);
+  sp_image_free(list[0]);
+  sp_image_free(list[1]);
+  sp_free(list);
+}
+
+void test_sp_fft_stack(CuTest * tc){
+  int n = 5;
+  Image * a = sp_image_alloc(5,4,2);
+  int size = sp_image_size(a);
+  Complex * in = sp_malloc(sizeof(Complex)*size*n);
+  Complex * out = sp_malloc(sizeof(Complex)*size*n);
+  for(int i = 0;i<size*n;i++){
+    in[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+  }
+  /* Out of place leaves the input alone */
+  sp_fft_stack(in,out,sp_image_x(a),sp_image_y(a),sp_image_z(a),n);
+  for(int j = 0;j<n;j++){
+    memcpy(a->image->data,&in[j*size],sizeof(Complex)*size);
+    Image * expected = sp_image_fft(a);
+    for(int i = 0;i<size;i++){
+      CuAssertComplexEquals(tc,expected->image->data[i],out[j*size+i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+    }
+    sp_image_free(expected);
+  }
+  /* In place back to the input */
+  sp_ifft_stack(out,out,sp_image_x(a),sp_image_y(a),sp_image_z(a),n);
+  for(int i = 0;i<size*n;i++){
+    CuAssertComplexEquals(tc,in[i],sp_cscale(out[i],1.0/size),1e-5);
+  }
+  sp_free(in);
+  sp_free(out);
+  sp_image_free(a);
+}
+
+void test_sp_image_fft_centered(CuTest * tc){
+  /* Even sizes use the modulation, odd ones the fallback */
+  int sizes[3][3] = {{8,6,1},{6,4,10},{7,6,1}};
+  for(int s = 0;s<3;s++){
+    Image * a = sp_image_alloc(sizes[s][0],sizes[s][1],sizes[s][2]);
+    for(int i = 0;i<sp_image_size(a);i++){
+      a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+    }
+    a->phased = 1;
+    a->detector->image_center[0] = sp_image_x(a)/2;
+    a->detector->image_center[1] = sp_image_y(a)/2;
+    a->detector->image_center[2] = sp_image_z(a)/2;
+    Image * tmp = sp_image_shift(a);
+    Image * ft = sp_image_fft(tmp);
+    Image * expected = sp_image_shift(ft);
+    Image * fa = sp_image_fft_centered(a);
+    CuAssertIntEquals(tc,sp_image_size(expected),sp_image_size(fa));
+    CuAssertIntEquals(tc,0,fa->shifted);
+    for(int i = 0;i<sp_image_size(fa);i++){
+      CuAssertComplexEquals(tc,expected->image->data[i],fa->image->data[i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+    }
+    if(sp_image_size(fa) == sp_image_size(a)){
+      /* Round trip */
+      Image * b = sp_image_ifft_centered(fa);
+      sp_image_scale(b,1.0/sp_image_size(b));
+      for(int i = 0;i<sp_image_size(a);i++){
+	CuAssertComplexEquals(tc,a->image->data[i],b->image->data[i],1e-5);
+      }
+      sp_image_free(b);
+    }
+    sp_image_free(a);
+    sp_image_free(tmp);
+    sp_image_free(ft);
+    sp_image_free(expected);
+    sp_image_free(fa);
+  }
+}
+
+void test_sp_image_fft_padded(CuTest * tc){
+  int sizes[2][3] = {{5,4,1},{3,4,5}};
+  int padded[2][3] = {{16,12,1},{12,9,16}};
+  for(int s = 0;s<2;s++){
+    for(int shifted = 0;shifted<2;shifted++){
+      Image * a = sp_image_alloc(sizes[s][0],sizes[s][1],sizes[s][2]);
+      for(int i = 0;i<sp_image_size(a);i++){
+	a->image->data[i] = sp_cinit((float)rand()/RAND_MAX,(float)rand()/RAND_MAX);
+      }
+      a->phased = 1;
+      a->shifted = shifted;
+      Image * tmp = zero_pad_image(a,padded[s][0],padded[s][1],padded[s][2],0);
+      Image * expected = sp_image_fft(tmp);
+      Image * fa = sp_image_fft_padded(a,padded[s][0],padded[s][1],padded[s][2]);
+      CuAssertIntEquals(tc,sp_image_size(expected),sp_image_size(fa));
+      for(int i = 0;i<sp_image_size(fa);i++){
+	CuAssertComplexEquals(tc,expected->image->data[i],fa->image->data[i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+      }
+      sp_image_free(expected);
+      sp_image_free(fa);
+      if(shifted){
+	expected = sp_image_ifft(tmp);
+	fa = sp_image_ifft_padded(a,padded[s][0],padded[s][1],padded[s][2]);
+	for(int i = 0;i<sp_image_size(fa);i++){
+	  CuAssertComplexEquals(tc,expected->image->data[i],fa->image->data[i],sp_cabs(expected->image->data[i])*1e-5+1e-4);
+	}
+	sp_image_free(expected);
+	sp_image_free(fa);
+      }
+      sp_image_free(tmp);
+      sp_image_free(a);
+    }
+  }
+}
+
 CuSuite* linear_alg_get_suite(void)
 {
   CuSuite* suite = CuSuiteNew();
@@ -1917,6 +2271,17 @@ CuSuite* linear_alg_get_suite(void)
     SUITE_ADD_TEST(suite,test_sp_image_cuda_fft);
   }
   SUITE_ADD_TEST(suite,test_sp_image_fft);
+  SUITE_ADD_TEST(suite,test_sp_fft_plan_cache);
+#ifndef _WIN32
+  SUITE_ADD_TEST(suite,test_sp_fft_concurrent);
+#endif
+  SUITE_ADD_TEST(suite,test_sp_fft_backend);
+  SUITE_ADD_TEST(suite,test_sp_fft_wisdom);
+  SUITE_ADD_TEST(suite,test_sp_image_rfft);
+  SUITE_ADD_TEST(suite,test_sp_image_fft_many);
+  SUITE_ADD_TEST(suite,test_sp_fft_stack);
+  SUITE_ADD_TEST(suite,test_sp_image_fft_centered);
+  SUITE_ADD_TEST(suite,test_sp_image_fft_padded);
 
   return suite;
 }
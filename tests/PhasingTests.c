@@ -1,5 +1,6 @@
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_rng.h>
+#include <time.h>
 #include "AllTests.h"
 
 
@@ -427,6 +428,24 @@ static Image * create_test_image(int size, real oversampling,SpPhasingConstraint
   return a;  
 }
 
+/* The solution of a phasing test, its measured amplitudes in f and, when
+   support is not NULL, its support */
+static Image * phasing_test_problem(int size, real oversampling, SpPhasingConstraints c, Image ** f, Image ** support){
+  Image * solution = create_test_image(size,oversampling,c);
+  *f = sp_image_fft(solution);
+  sp_image_rephase(*f,SP_ZERO_PHASE);
+  for(int i = 0;i<sp_image_size(*f);i++){
+    (*f)->mask->data[i] = 1;
+  }
+  if(support){
+    *support = sp_image_duplicate(solution,SP_COPY_ALL);
+    for(int i = 0;i<sp_image_size(*support);i++){
+      (*support)->image->data[i] = sp_cinit(sp_cabs((*support)->image->data[i]) ? 1 : 0,0);
+    }
+  }
+  return solution;
+}
+
 void test_sp_phasing_hio_success_rate(CuTest * tc){
   /* Simple phasing example */
   int size = 4;
@@ -1311,6 +1330,725 @@ void test_sp_phasing_fourier_constraints(CuTest * tc){
   */
 }
 
+void test_sp_phasing_cpu_threaded(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * algs[4];
+  algs[0] = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  algs[1] = sp_phasing_raar_alloc(beta,0);
+  algs[2] = sp_phasing_diff_map_alloc(beta,INFINITY,INFINITY,SpRealObject);
+  algs[3] = sp_phasing_er_alloc(0);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(6,3,SpNoConstraints,&f,&support);
+  for(int a = 0;a<4;a++){
+    SpPhaser * ph_cpu = sp_phaser_alloc();
+    SpPhaser * ph_threaded = sp_phaser_alloc();
+    CuAssertTrue(tc,sp_phaser_init(ph_cpu,algs[a],NULL,SpEngineCPU) == 0);
+    CuAssertTrue(tc,sp_phaser_init(ph_threaded,algs[a],NULL,SpEngineCPUThreaded) == 0);
+    CuAssertIntEquals(tc,SpEngineCPUThreaded,ph_threaded->engine);
+    /* Does not divide the image size evenly */
+    sp_phaser_set_threads(ph_threaded,5);
+    sp_phaser_set_amplitudes(ph_cpu,f);
+    sp_phaser_set_amplitudes(ph_threaded,f);
+    CuAssertTrue(tc,sp_phaser_init_model(ph_cpu,NULL,SpModelRandomPhases) == 0); 
+    CuAssertTrue(tc,sp_phaser_init_model(ph_threaded,sp_phaser_model(ph_cpu),0) == 0); 
+    CuAssertTrue(tc,sp_phaser_init_support(ph_cpu,support,0,0) == 0); 
+    CuAssertTrue(tc,sp_phaser_init_support(ph_threaded,support,0,0) == 0); 
+    CuAssertTrue(tc,sp_phaser_iterate(ph_cpu,10) == 0);
+    CuAssertTrue(tc,sp_phaser_iterate(ph_threaded,10) == 0);
+    /* The per pixel work is the same, only split differently */
+    const Image * cpu_model = sp_phaser_model(ph_cpu);
+    const Image * threaded_model = sp_phaser_model(ph_threaded);
+    for(int i =0 ;i<ph_cpu->image_size;i++){
+      CuAssertComplexEquals(tc,cpu_model->image->data[i],threaded_model->image->data[i],REAL_EPSILON);
+    }
+    real ereal = sp_phaser_ereal(ph_threaded);
+    CuAssertDblEquals(tc,sp_phaser_ereal(ph_cpu),ereal,1e-5*ereal);
+    /* Reductions are deterministic */
+    CuAssertTrue(tc,ereal == sp_phaser_ereal(ph_threaded));
+    real efourier = sp_phaser_efourier(ph_threaded);
+    CuAssertDblEquals(tc,sp_phaser_efourier(ph_cpu),efourier,1e-5*efourier);
+    sp_phaser_free(ph_cpu);
+    sp_phaser_free(ph_threaded);
+  }
+  sp_image_free(f);
+  sp_image_free(solution);
+  sp_image_free(support);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_batch(CuTest * tc){
+  const int nmodels = 3;
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * algs[3];
+  algs[0] = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  algs[1] = sp_phasing_raar_alloc(beta,0);
+  algs[2] = sp_phasing_er_alloc(SpRealObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(6,3,SpNoConstraints,&f,&support);
+  for(int a = 0;a<3;a++){
+    SpPhaserBatch * b = sp_phaser_batch_alloc(nmodels);
+    CuAssertTrue(tc,sp_phaser_batch_init(b,algs[a],NULL,a == 1 ? SpEngineCPUThreaded : SpEngineCPU) == 0);
+    sp_phaser_batch_set_amplitudes(b,f);
+    CuAssertTrue(tc,sp_phaser_batch_init_model(b,NULL,SpModelRandomPhases) == 0); 
+    CuAssertTrue(tc,sp_phaser_batch_init_support(b,support,0,0) == 0); 
+    /* The same starting models iterated one by one */
+    SpPhaser * single[3];
+    for(int k = 0;k<nmodels;k++){
+      single[k] = sp_phaser_alloc();
+      CuAssertTrue(tc,sp_phaser_init(single[k],algs[a],NULL,SpEngineCPU) == 0);
+      sp_phaser_set_amplitudes(single[k],f);
+      CuAssertTrue(tc,sp_phaser_init_model(single[k],sp_phaser_model(sp_phaser_batch_phaser(b,k)),0) == 0); 
+      CuAssertTrue(tc,sp_phaser_init_support(single[k],support,0,0) == 0); 
+      CuAssertTrue(tc,sp_phaser_iterate(single[k],7) == 0);
+    }
+    CuAssertTrue(tc,sp_phaser_batch_iterate(b,7) == 0);
+    for(int k = 0;k<nmodels;k++){
+      SpPhaser * ph = sp_phaser_batch_phaser(b,k);
+      CuAssertIntEquals(tc,7,ph->iteration);
+      const Image * batch_model = sp_phaser_model(ph);
+      const Image * single_model = sp_phaser_model(single[k]);
+      for(int i =0 ;i<ph->image_size;i++){
+	CuAssertComplexEquals(tc,single_model->image->data[i],batch_model->image->data[i],1e-4*(1+sp_cabs(single_model->image->data[i])));
+      }
+      sp_phaser_free(single[k]);
+    }
+    sp_phaser_batch_free(b);
+  }
+  /* Real object phasers are iterated one by one */
+  SpPhaserBatch * b = sp_phaser_batch_alloc(nmodels);
+  CuAssertTrue(tc,sp_phaser_batch_init(b,algs[2],NULL,SpEngineCPU) == 0);
+  CuAssertTrue(tc,sp_phaser_set_real_object(sp_phaser_batch_phaser(b,1),1) == 0);
+  sp_phaser_batch_set_amplitudes(b,f);
+  CuAssertTrue(tc,sp_phaser_batch_init_model(b,NULL,SpModelRandomPhases) == 0);
+  CuAssertTrue(tc,sp_phaser_batch_init_support(b,support,0,0) == 0);
+  CuAssertTrue(tc,sp_phaser_batch_iterate(b,7) == 0);
+  for(int k = 0;k<nmodels;k++){
+    CuAssertIntEquals(tc,7,sp_phaser_batch_phaser(b,k)->iteration);
+  }
+  /* New amplitudes replace the ones the real object phaser had cached */
+  SpPhaser * real_ph = sp_phaser_batch_phaser(b,1);
+  real old_efourier = sp_phaser_efourier(real_ph);
+  Image * f2 = sp_image_duplicate(f,SP_COPY_ALL);
+  for(int i = 0;i<sp_image_size(f2);i++){
+    f2->image->data[i] = sp_cscale(f2->image->data[i],2);
+  }
+  SpPhaser * single = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(single,algs[2],NULL,SpEngineCPU) == 0);
+  CuAssertTrue(tc,sp_phaser_set_real_object(single,1) == 0);
+  sp_phaser_set_amplitudes(single,f2);
+  CuAssertTrue(tc,sp_phaser_init_model(single,sp_phaser_model(real_ph),0) == 0);
+  CuAssertTrue(tc,sp_phaser_init_support(single,support,0,0) == 0);
+  sp_phaser_batch_set_amplitudes(b,f2);
+  CuAssertTrue(tc,fabs(sp_phaser_efourier(real_ph)-old_efourier) > 1e-3);
+  CuAssertDblEquals(tc,sp_phaser_efourier(single),sp_phaser_efourier(real_ph),1e-4);
+  CuAssertTrue(tc,sp_phaser_batch_iterate(b,3) == 0);
+  CuAssertTrue(tc,sp_phaser_iterate(single,3) == 0);
+  const Image * batch_model = sp_phaser_model(real_ph);
+  const Image * single_model = sp_phaser_model(single);
+  for(int i = 0;i<sp_image_size(f);i++){
+    CuAssertComplexEquals(tc,single_model->image->data[i],batch_model->image->data[i],1e-4*(1+sp_cabs(single_model->image->data[i])));
+  }
+  sp_phaser_free(single);
+  sp_image_free(f2);
+  sp_phaser_batch_free(b);
+  sp_image_free(f);
+  sp_image_free(solution);
+  sp_image_free(support);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_workspace(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  /* A different radius on every support update */
+  sp_smap * blur_radius = sp_smap_create_from_pair(0,3);
+  sp_smap_insert(blur_radius,30,2);
+  sp_smap * threshold = sp_smap_create_from_pair(0,0.15);
+  sp_smap * area = sp_smap_create_from_pair(0,0.3);
+  SpPhasingAlgorithm * algs[2];
+  algs[0] = sp_phasing_diff_map_alloc(beta,INFINITY,INFINITY,SpRealObject);
+  algs[1] = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  SpSupportArray * sup_algs[2];
+  sup_algs[0] = sp_support_array_init(sp_support_area_alloc(blur_radius,area),3);
+  sup_algs[1] = sp_support_array_alloc(2,3);
+  sup_algs[1]->algorithms[0] = sp_support_threshold_alloc(blur_radius,threshold);
+  sup_algs[1]->algorithms[1] = sp_support_close_alloc(1);
+  Image * f;
+  Image * solution = phasing_test_problem(8,2,SpNoConstraints,&f,NULL);
+  for(int a = 0;a<2;a++){
+    SpPhaser * ph = sp_phaser_alloc();
+    CuAssertTrue(tc,sp_phaser_init(ph,algs[a],sup_algs[a],SpEngineCPU) == 0);
+    sp_phaser_set_amplitudes(ph,f);
+    CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomPhases) == 0); 
+    CuAssertTrue(tc,sp_phaser_init_support(ph,NULL,SpSupportFromPatterson,0.04) == 0); 
+    /* Every step, including the support updates, has run once */
+    CuAssertTrue(tc,sp_phaser_iterate(ph,6) == 0);
+    long long allocations = sp_phaser_heap_allocations(ph);
+    SpFilterCacheStats before;
+    SpFilterCacheStats after;
+    sp_filter_cache_stats(&before);
+    CuAssertTrue(tc,sp_phaser_iterate(ph,20) == 0);
+    CuAssertTrue(tc,sp_phaser_heap_allocations(ph) == allocations);
+    /* Nor does the support update build transfer functions in the cache */
+    sp_filter_cache_stats(&after);
+    CuAssertTrue(tc,after.misses == before.misses);
+    sp_phaser_free(ph);
+  }
+  sp_image_free(f);
+  sp_image_free(solution);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_fmodel_reuse(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * alg = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(6,3,SpNoConstraints,&f,&support);
+  SpPhaser * ph = sp_phaser_alloc();
+  SpPhaser * ref = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,alg,NULL,SpEngineCPU) == 0);
+  CuAssertTrue(tc,sp_phaser_init(ref,alg,NULL,SpEngineCPU) == 0);
+  sp_phaser_set_amplitudes(ph,f);
+  sp_phaser_set_amplitudes(ref,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomPhases) == 0); 
+  CuAssertTrue(tc,sp_phaser_init_model(ref,sp_phaser_model(ph),0) == 0); 
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0); 
+  CuAssertTrue(tc,sp_phaser_init_support(ref,support,0,0) == 0); 
+  sp_phaser_fmodel(ph);
+  for(int it = 0;it<10;it++){
+    SpFFTPlanCacheStats before;
+    SpFFTPlanCacheStats after;
+    sp_fft_plan_cache_stats(&before);
+    CuAssertTrue(tc,sp_phaser_iterate(ph,1) == 0);
+    sp_phaser_fmodel(ph);
+    real efourier = sp_phaser_efourier(ph);
+    CuAssertTrue(tc,sp_phaser_efourier(ph) == efourier);
+    sp_fft_plan_cache_stats(&after);
+    /* The forward transform is shared between the iteration and fmodel */
+    CuAssertTrue(tc,(after.hits+after.misses)-(before.hits+before.misses) == 2);
+  }
+  CuAssertTrue(tc,sp_phaser_iterate(ref,10) == 0);
+  const Image * model = sp_phaser_model(ph);
+  const Image * ref_model = sp_phaser_model(ref);
+  for(int i =0 ;i<ph->image_size;i++){
+    CuAssertComplexEquals(tc,ref_model->image->data[i],model->image->data[i],REAL_EPSILON);
+  }
+  Image * fmodel = sp_image_fft(model);
+  for(int i =0 ;i<ph->image_size;i++){
+    CuAssertComplexEquals(tc,fmodel->image->data[i],sp_phaser_fmodel(ph)->image->data[i],REAL_EPSILON);
+  }
+  sp_image_free(fmodel);
+  sp_phaser_free(ph);
+  sp_phaser_free(ref);
+  sp_image_free(f);
+  sp_image_free(solution);
+  sp_image_free(support);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_metrics(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * alg = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(6,3,SpNoConstraints,&f,&support);
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,alg,NULL,SpEngineCPU) == 0);
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomPhases) == 0); 
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0); 
+  SpPhaserMetrics m[8];
+  CuAssertIntEquals(tc,0,sp_phaser_metrics(ph,m,8));
+  sp_phaser_set_metrics_capacity(ph,4);
+  CuAssertTrue(tc,sp_phaser_iterate(ph,6) == 0);
+  /* Only the last 4 are kept */
+  CuAssertIntEquals(tc,4,sp_phaser_metrics(ph,m,8));
+  for(int i = 0;i<4;i++){
+    CuAssertIntEquals(tc,3+i,m[i].iteration);
+  }
+  /* Resizing keeps the most recent records */
+  sp_phaser_set_metrics_capacity(ph,8);
+  CuAssertIntEquals(tc,4,sp_phaser_metrics(ph,m,8));
+  CuAssertIntEquals(tc,6,m[3].iteration);
+  sp_phaser_set_metrics_capacity(ph,2);
+  CuAssertIntEquals(tc,2,sp_phaser_metrics(ph,m,8));
+  CuAssertIntEquals(tc,5,m[0].iteration);
+  CuAssertIntEquals(tc,6,m[1].iteration);
+  for(int it = 0;it<3;it++){
+    real efourier = sp_phaser_efourier(ph);
+    CuAssertTrue(tc,sp_phaser_iterate(ph,1) == 0);
+    CuAssertIntEquals(tc,1,sp_phaser_metrics(ph,m,1));
+    CuAssertIntEquals(tc,ph->iteration,m[0].iteration);
+    CuAssertDblEquals(tc,efourier,m[0].efourier,1e-4*efourier);
+    real ereal = sp_phaser_ereal(ph);
+    CuAssertDblEquals(tc,ereal,m[0].ereal,1e-4*ereal);
+    const Image * s = sp_phaser_support(ph);
+    int support_size = 0;
+    for(int i = 0;i<sp_image_size(s);i++){
+      support_size += (sp_real(s->image->data[i]) != 0);
+    }
+    CuAssertIntEquals(tc,support_size,m[0].support_size);
+    Image * change = sp_phaser_model_change(ph);
+    real change_norm = sqrt(sp_image_integrate2(change)/sp_image_integrate2(sp_phaser_model(ph)));
+    CuAssertDblEquals(tc,change_norm,m[0].model_change,1e-4*change_norm);
+  }
+  sp_phaser_free(ph);
+  sp_image_free(f);
+  sp_image_free(solution);
+  sp_image_free(support);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_iterate_until(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * alg = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(6,3,SpNoConstraints,&f,&support);
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,alg,NULL,SpEngineCPU) == 0);
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomPhases) == 0); 
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0); 
+  SpPhaserStopPolicy policy = {0};
+  CuAssertTrue(tc,sp_phaser_iterate_until(ph,&policy) < 0);
+  /* Not a multiple of the check period */
+  policy.max_iterations = 23;
+  policy.check_period = 5;
+  CuAssertIntEquals(tc,SpStopMaxIterations,sp_phaser_iterate_until(ph,&policy));
+  CuAssertIntEquals(tc,23,ph->iteration);
+  /* The known support makes the Fourier error converge */
+  policy.max_iterations = 5000;
+  policy.plateau_metric = SpPlateauFourierError;
+  policy.plateau_window = 10;
+  policy.plateau_tolerance = 1e-3;
+  CuAssertIntEquals(tc,SpStopPlateau,sp_phaser_iterate_until(ph,&policy));
+  CuAssertTrue(tc,ph->iteration < 23+5000);
+  SpPhaserMetrics m[11];
+  CuAssertIntEquals(tc,11,sp_phaser_metrics(ph,m,11));
+  CuAssertTrue(tc,m[0].efourier-m[10].efourier <= 1e-3*m[0].efourier);
+  /* An unreachable tolerance leaves only the time budget */
+  policy.max_iterations = 0;
+  policy.max_seconds = 0.2;
+  policy.plateau_tolerance = -1;
+  long long start = sp_gettime();
+  CuAssertIntEquals(tc,SpStopTimeBudget,sp_phaser_iterate_until(ph,&policy));
+  CuAssertTrue(tc,sp_gettime()-start >= 200000);
+  sp_phaser_free(ph);
+  sp_image_free(f);
+  sp_image_free(solution);
+  sp_image_free(support);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_real_object(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * algs[3];
+  algs[0] = sp_phasing_hio_alloc(beta,SpPositiveRealObject);
+  algs[1] = sp_phasing_raar_alloc(beta,SpRealObject);
+  algs[2] = sp_phasing_er_alloc(SpPositiveRealObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(6,3,SpPositiveRealObject,&f,&support);
+  Image * start = sp_image_duplicate(solution,SP_COPY_ALL);
+  for(int i = 0;i<sp_image_size(start);i++){
+    start->image->data[i] = sp_cinit(p_drand48(),0);
+  }
+  for(int a = 0;a<3;a++){
+    SpPhaser * ph[3];
+    for(int k = 0;k<3;k++){
+      ph[k] = sp_phaser_alloc();
+      CuAssertTrue(tc,sp_phaser_init(ph[k],algs[a],NULL,k == 2 ? SpEngineCPUThreaded : SpEngineCPU) == 0);
+      sp_phaser_set_threads(ph[k],3);
+      if(k > 0){
+	CuAssertIntEquals(tc,0,sp_phaser_set_real_object(ph[k],1));
+      }
+      sp_phaser_set_amplitudes(ph[k],f);
+      sp_phaser_set_metrics_capacity(ph[k],1);
+      CuAssertTrue(tc,sp_phaser_init_model(ph[k],start,0) == 0);
+      CuAssertTrue(tc,sp_phaser_init_support(ph[k],support,0,0) == 0);
+      CuAssertTrue(tc,sp_phaser_iterate(ph[k],10) == 0);
+    }
+    CuAssertIntEquals(tc,-1,sp_phaser_set_real_object(ph[1],0));
+    /* The amplitudes of a real object are Friedel symmetric, so the
+       complex iterations keep a real model too */
+    const Image * model = sp_phaser_model(ph[0]);
+    real max = 0;
+    for(int i = 0;i<sp_image_size(model);i++){
+      max = sp_max(max,sp_cabs(model->image->data[i]));
+    }
+    for(int k = 1;k<3;k++){
+      const Image * real_model = sp_phaser_model(ph[k]);
+      for(int i = 0;i<ph[0]->image_size;i++){
+	CuAssertDblEquals(tc,sp_real(model->image->data[i]),sp_real(real_model->image->data[i]),1e-4*max);
+	CuAssertTrue(tc,sp_imag(real_model->image->data[i]) == 0);
+      }
+      SpPhaserMetrics m;
+      CuAssertIntEquals(tc,1,sp_phaser_metrics(ph[k],&m,1));
+      real ereal = sp_phaser_ereal(ph[k]);
+      CuAssertDblEquals(tc,ereal,m.ereal,1e-4*ereal);
+      real efourier = sp_phaser_efourier(ph[0]);
+      CuAssertDblEquals(tc,efourier,sp_phaser_efourier(ph[k]),1e-3*efourier);
+    }
+    for(int k = 0;k<3;k++){
+      sp_phaser_free(ph[k]);
+    }
+  }
+  /* Only ER, HIO and RAAR are supported */
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,sp_phasing_diff_map_alloc(beta,INFINITY,INFINITY,SpRealObject),NULL,SpEngineCPU) == 0);
+  CuAssertIntEquals(tc,0,sp_phaser_set_real_object(ph,1));
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,start,0) == 0);
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0);
+  CuAssertTrue(tc,sp_phaser_iterate(ph,1) < 0);
+  sp_phaser_free(ph);
+  sp_image_free(start);
+  sp_image_free(f);
+  sp_image_free(solution);
+  sp_image_free(support);
+  PRINT_DONE;
+}
+
+/* Checks that the spans of ph hold exactly the pixels with flag set */
+static void check_pixel_spans(CuTest * tc, const SpPixelSpans * spans, const sp_i3matrix * flags, int flag){
+  int k = 0;
+  for(int i = 0;i<sp_i3matrix_size(flags);i++){
+    while(k < spans->nspans && spans->bounds[2*k+1] <= i){
+      k++;
+    }
+    int inside = k < spans->nspans && spans->bounds[2*k] <= i;
+    CuAssertIntEquals(tc,(flags->data[i] & flag) != 0,inside);
+  }
+  for(int k = 1;k<spans->nspans;k++){
+    /* Maximal runs never touch */
+    CuAssertTrue(tc,spans->bounds[2*k] > spans->bounds[2*k-1]);
+  }
+}
+
+void test_sp_phasing_pixel_spans(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  sp_smap * blur_radius = sp_smap_create_from_pair(0,2);
+  sp_smap * threshold = sp_smap_create_from_pair(0,0.15);
+  SpPhasingAlgorithm * alg = sp_phasing_hio_alloc(beta,SpPositiveComplexObject);
+  SpSupportArray * sup_alg = sp_support_array_init(sp_support_threshold_alloc(blur_radius,threshold),3);
+  Image * f;
+  Image * solution = phasing_test_problem(8,2,SpNoConstraints,&f,NULL);
+  for(int i = 0;i<sp_image_size(f);i++){
+    /* A beamstop and a few dead pixels */
+    f->mask->data[i] = (sp_image_dist(f,i,SP_TO_CORNER) >= 2 && i % 7);
+  }
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,alg,sup_alg,SpEngineCPUThreaded) == 0);
+  sp_phaser_set_threads(ph,3);
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomPhases) == 0); 
+  CuAssertTrue(tc,sp_phaser_init_support(ph,NULL,SpSupportFromPatterson,0.04) == 0); 
+  CuAssertTrue(tc,sp_phaser_iterate(ph,1) == 0);
+  check_pixel_spans(tc,&ph->support_spans,ph->pixel_flags,SpPixelInsideSupport);
+  check_pixel_spans(tc,&ph->measured_spans,ph->pixel_flags,SpPixelMeasuredAmplitude);
+  const Image * support = sp_phaser_support(ph);
+  int initial_size = sp_image_integrate2(support);
+  /* Goes through a few support updates */
+  CuAssertTrue(tc,sp_phaser_iterate(ph,10) == 0);
+  check_pixel_spans(tc,&ph->support_spans,ph->pixel_flags,SpPixelInsideSupport);
+  check_pixel_spans(tc,&ph->measured_spans,ph->pixel_flags,SpPixelMeasuredAmplitude);
+  support = sp_phaser_support(ph);
+  CuAssertTrue(tc,sp_image_integrate2(support) != initial_size);
+  sp_phaser_free(ph);
+  sp_image_free(f);
+  sp_image_free(solution);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_specialized_kernels(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * hio = sp_phasing_hio_alloc(beta,SpNoConstraints);
+  SpPhasingAlgorithm * er = sp_phasing_er_alloc(SpPositiveRealObject|SpPositivityFlipping);
+  Image * f;
+  Image * solution = phasing_test_problem(8,2,SpPositiveRealObject,&f,NULL);
+  for(int i = 0;i<sp_image_size(f);i++){
+    f->mask->data[i] = (i % 5 != 0);
+  }
+  Image * start = sp_image_duplicate(solution,SP_COPY_ALL);
+  for(int i = 0;i<sp_image_size(start);i++){
+    start->image->data[i] = sp_cinit(p_drand48()-0.5,p_drand48()-0.5);
+  }
+  SpPhaser * ph[2];
+  for(int k = 0;k<2;k++){
+    ph[k] = sp_phaser_alloc();
+    /* The first phaser switches algorithm after sp_phaser_init() */
+    CuAssertTrue(tc,sp_phaser_init(ph[k],k == 0 ? hio : er,NULL,SpEngineCPU) == 0);
+    sp_phaser_set_amplitudes(ph[k],f);
+    CuAssertTrue(tc,sp_phaser_init_model(ph[k],start,0) == 0);
+    CuAssertTrue(tc,sp_phaser_init_support(ph[k],NULL,SpSupportFromPatterson,0.04) == 0);
+  }
+  CuAssertTrue(tc,sp_phaser_set_phasing_algorithm(ph[0],er) == 0);
+  for(int k = 0;k<2;k++){
+    CuAssertTrue(tc,sp_phaser_iterate(ph[k],5) == 0);
+  }
+  const Image * model[2] = {sp_phaser_model(ph[0]),sp_phaser_model(ph[1])};
+  for(int i = 0;i<sp_image_size(model[0]);i++){
+    CuAssertTrue(tc,sp_cabs(sp_csub(model[0]->image->data[i],model[1]->image->data[i])) == 0);
+    /* Positivity with flipping */
+    CuAssertTrue(tc,sp_real(model[0]->image->data[i]) >= 0);
+    CuAssertTrue(tc,sp_imag(model[0]->image->data[i]) == 0);
+  }
+  /* Changing the constraints in place is picked up by the next iteration */
+  ((SpPhasingERParameters *)er->params)->constraints = SpNoConstraints;
+  CuAssertTrue(tc,sp_phaser_init_model(ph[0],start,0) == 0);
+  CuAssertTrue(tc,sp_phaser_iterate(ph[0],1) == 0);
+  model[0] = sp_phaser_model(ph[0]);
+  int complex_pixels = 0;
+  for(int i = 0;i<sp_image_size(model[0]);i++){
+    complex_pixels += (sp_imag(model[0]->image->data[i]) != 0);
+  }
+  CuAssertTrue(tc,complex_pixels > 0);
+  for(int k = 0;k<2;k++){
+    sp_phaser_free(ph[k]);
+  }
+  sp_image_free(start);
+  sp_image_free(f);
+  sp_image_free(solution);
+  PRINT_DONE;
+}
+
+/* Returns the Fourier error after iterations of alg from start */
+static real phasing_efourier_after(CuTest * tc, SpPhasingAlgorithm * alg, const Image * f, const Image * support,
+				   const Image * start, int iterations, Image * model){
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,alg,NULL,SpEngineCPU) == 0);
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,start,0) == 0);
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0);
+  CuAssertTrue(tc,sp_phaser_iterate(ph,iterations) == 0);
+  if(model){
+    sp_image_memcpy(model,sp_phaser_model(ph));
+  }
+  real efourier = sp_phaser_efourier(ph);
+  sp_phaser_free(ph);
+  return efourier;
+}
+
+void test_sp_phasing_rrr_and_accelerated_er(CuTest * tc){
+  sp_smap * one = sp_smap_create_from_pair(0,1);
+  sp_smap * zero = sp_smap_create_from_pair(0,0);
+  sp_smap * momentum = sp_smap_create_from_pair(0,0.9);
+  /* Without constraints RRR with beta 1 is HIO with beta 1, and
+     accelerated ER without momentum is ER */
+  SpPhasingAlgorithm * algs[2][2] = {{sp_phasing_rrr_alloc(one,0),sp_phasing_hio_alloc(one,0)},
+				     {sp_phasing_accelerated_er_alloc(zero,SpPositiveRealObject),sp_phasing_er_alloc(SpPositiveRealObject)}};
+  SpPhasingAlgorithm * er = algs[1][1];
+  SpPhasingAlgorithm * accelerated_er = sp_phasing_accelerated_er_alloc(momentum,SpPositiveRealObject);
+  /* Sum of the log of the Fourier errors of accelerated ER and ER */
+  real log_efourier[2] = {0,0};
+  /* The same problems on every run */
+  sp_srand(1);
+  for(int run = 0;run<10;run++){
+    Image * f;
+    Image * support;
+    Image * solution = phasing_test_problem(8,2,SpPositiveRealObject,&f,&support);
+    Image * start = sp_image_duplicate(solution,SP_COPY_ALL);
+    for(int i = 0;i<sp_image_size(start);i++){
+      start->image->data[i] = sp_cinit(p_drand48(),p_drand48());
+    }
+    if(run == 0){
+      Image * model[2] = {sp_image_duplicate(start,SP_COPY_ALL),sp_image_duplicate(start,SP_COPY_ALL)};
+      for(int a = 0;a<2;a++){
+	for(int k = 0;k<2;k++){
+	  phasing_efourier_after(tc,algs[a][k],f,support,start,20,model[k]);
+	}
+	real max = 0;
+	for(int i = 0;i<sp_image_size(model[1]);i++){
+	  max = sp_max(max,sp_cabs(model[1]->image->data[i]));
+	}
+	/* Only the rounding differs */
+	for(int i = 0;i<sp_image_size(model[0]);i++){
+	  CuAssertComplexEquals(tc,model[1]->image->data[i],model[0]->image->data[i],1e-3*max);
+	}
+      }
+      sp_image_free(model[0]);
+      sp_image_free(model[1]);
+    }
+    log_efourier[0] += log(phasing_efourier_after(tc,accelerated_er,f,support,start,50,NULL));
+    log_efourier[1] += log(phasing_efourier_after(tc,er,f,support,start,50,NULL));
+    sp_image_free(start);
+    sp_image_free(support);
+    sp_image_free(f);
+    sp_image_free(solution);
+  }
+  /* The momentum gets further with the same number of FFTs */
+  CuAssertTrue(tc,log_efourier[0] < log_efourier[1]);
+  sp_srand(time(NULL));
+  PRINT_DONE;
+}
+
+void test_sp_phasing_multires(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * hio = sp_phasing_hio_alloc(beta,SpPositiveRealObject);
+  SpPhasingAlgorithm * er = sp_phasing_er_alloc(SpPositiveRealObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(8,4,SpPositiveRealObject,&f,&support);
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,hio,NULL,SpEngineCPU) == 0);
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomPhases) == 0);
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0);
+  SpMultiresLevel invalid[2] = {{1,10,NULL,NULL},{0.5,10,NULL,NULL}};
+  CuAssertIntEquals(tc,-1,sp_phaser_iterate_multires(ph,invalid,2));
+  /* Without iterations the model is just low pass filtered */
+  Image * start = sp_image_fft(sp_phaser_model(ph));
+  SpMultiresLevel passthrough = {0.5,0,NULL,NULL};
+  CuAssertIntEquals(tc,0,sp_phaser_iterate_multires(ph,&passthrough,1));
+  CuAssertIntEquals(tc,0,ph->iteration);
+  Image * filtered = sp_image_fft(sp_phaser_model(ph));
+  real max = 0;
+  for(int i = 0;i<sp_image_size(start);i++){
+    max = sp_max(max,sp_cabs(start->image->data[i]));
+  }
+  for(int y = 0;y<sp_image_y(start);y++){
+    for(int x = 0;x<sp_image_x(start);x++){
+      int i = y*sp_image_x(start)+x;
+      int fx = x < 16 ? x : x-32;
+      int fy = y < 16 ? y : y-32;
+      Complex expected = sp_cinit(0,0);
+      if(fx >= -8 && fx < 8 && fy >= -8 && fy < 8){
+	expected = start->image->data[i];
+      }
+      CuAssertComplexEquals(tc,expected,filtered->image->data[i],1e-4*max);
+    }
+  }
+  /* The support can only grow */
+  const Image * new_support = sp_phaser_support(ph);
+  for(int i = 0;i<sp_image_size(support);i++){
+    CuAssertTrue(tc,!sp_real(support->image->data[i]) || sp_real(new_support->image->data[i]));
+  }
+  real efourier = sp_phaser_efourier(ph);
+  SpMultiresLevel levels[3] = {{0.25,50,NULL,NULL},{0.5,50,NULL,NULL},{1,20,er,NULL}};
+  CuAssertIntEquals(tc,0,sp_phaser_iterate_multires(ph,levels,3));
+  /* Only the full size iterations count, and the algorithm is restored */
+  CuAssertIntEquals(tc,20,ph->iteration);
+  CuAssertTrue(tc,ph->algorithm == hio);
+  CuAssertTrue(tc,sp_phaser_efourier(ph) < efourier);
+  sp_phaser_free(ph);
+  sp_image_free(start);
+  sp_image_free(filtered);
+  sp_image_free(support);
+  sp_image_free(f);
+  sp_image_free(solution);
+  PRINT_DONE;
+}
+
+void test_sp_phasing_low_memory(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * alg = sp_phasing_hio_alloc(beta,SpPositiveRealObject);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(8,4,SpPositiveRealObject,&f,&support);
+  SpPhaser * ph[2];
+  for(int k = 0;k<2;k++){
+    ph[k] = sp_phaser_alloc();
+    CuAssertTrue(tc,sp_phaser_init(ph[k],alg,NULL,SpEngineCPU) == 0);
+    CuAssertIntEquals(tc,0,sp_phaser_set_low_memory(ph[k],k));
+    sp_phaser_set_amplitudes(ph[k],f);
+    CuAssertTrue(tc,sp_phaser_init_support(ph[k],support,0,0) == 0);
+  }
+  CuAssertTrue(tc,sp_phaser_init_model(ph[0],NULL,SpModelRandomPhases) == 0);
+  Image * start = sp_image_duplicate(sp_phaser_model(ph[0]),SP_COPY_ALL);
+  /* Initializing twice frees the shared mask and the views */
+  CuAssertTrue(tc,sp_phaser_init_model(ph[1],NULL,SpModelRandomPhases) == 0);
+  CuAssertTrue(tc,sp_phaser_init_model(ph[1],start,0) == 0);
+  CuAssertIntEquals(tc,-1,sp_phaser_set_low_memory(ph[1],0));
+  for(int k = 0;k<2;k++){
+    CuAssertIntEquals(tc,0,sp_phaser_iterate(ph[k],20));
+  }
+  real max = 0;
+  for(int i = 0;i<sp_image_size(start);i++){
+    max = sp_max(max,sp_cabs(sp_phaser_model(ph[0])->image->data[i]));
+  }
+  const Image * a[2][4];
+  for(int k = 0;k<2;k++){
+    a[k][0] = sp_phaser_model(ph[k]);
+    a[k][1] = sp_phaser_old_model(ph[k]);
+    a[k][2] = sp_phaser_model_before_projection(ph[k]);
+    a[k][3] = sp_phaser_model_change(ph[k]);
+  }
+  for(int j = 0;j<4;j++){
+    for(int i = 0;i<sp_image_size(start);i++){
+      CuAssertComplexEquals(tc,a[0][j]->image->data[i],a[1][j]->image->data[i],1e-6*max);
+    }
+  }
+  CuAssertDblEquals(tc,sp_phaser_efourier(ph[0]),sp_phaser_efourier(ph[1]),1e-6*sp_phaser_efourier(ph[0]));
+  /* The masks set by the getters don't change each other or the one
+     of the iterates */
+  for(int i = 0;i<sp_image_size(f);i++){
+    a[1][0]->mask->data[i] = 0;
+  }
+  const Image * s = sp_phaser_model_with_support(ph[1]);
+  const Image * fs = sp_phaser_fmodel_with_mask(ph[1]);
+  s = sp_phaser_model_with_support(ph[1]);
+  const Image * fmodel = sp_phaser_fmodel(ph[1]);
+  for(int i = 0;i<sp_image_size(support);i++){
+    CuAssertIntEquals(tc,sp_real(support->image->data[i]) ? 1 : 0,s->mask->data[i]);
+    CuAssertIntEquals(tc,1,fs->mask->data[i]);
+    CuAssertIntEquals(tc,0,a[1][0]->mask->data[i]);
+    CuAssertComplexEquals(tc,a[1][0]->image->data[i],s->image->data[i],0);
+    CuAssertComplexEquals(tc,fmodel->image->data[i],fs->image->data[i],0);
+  }
+  CuAssertTrue(tc,sp_phaser_memory_usage(ph[1]) < sp_phaser_memory_usage(ph[0]));
+  for(int k = 0;k<2;k++){
+    sp_phaser_free(ph[k]);
+  }
+  sp_image_free(start);
+  sp_image_free(support);
+  sp_image_free(f);
+  sp_image_free(solution);
+  PRINT_DONE;
+}
+
+void test_sp_support_area_selection(CuTest * tc){
+  sp_smap * beta = sp_smap_create_from_pair(0,0.8);
+  SpPhasingAlgorithm * alg = sp_phasing_hio_alloc(beta,SpNoConstraints);
+  Image * f;
+  Image * support;
+  Image * solution = phasing_test_problem(8,4,SpNoConstraints,&f,&support);
+  SpPhaser * ph = sp_phaser_alloc();
+  CuAssertTrue(tc,sp_phaser_init(ph,alg,NULL,SpEngineCPU) == 0);
+  sp_phaser_set_amplitudes(ph,f);
+  CuAssertTrue(tc,sp_phaser_init_model(ph,NULL,SpModelRandomValues) == 0);
+  CuAssertTrue(tc,sp_phaser_init_support(ph,support,0,0) == 0);
+  real areas[4] = {0,0.1,0.5,1};
+  for(int j = 0;j<4;j++){
+    SpSupportAlgorithm * area = sp_support_area_alloc(sp_smap_create_from_pair(0,2),sp_smap_create_from_pair(0,areas[j]));
+    CuAssertIntEquals(tc,0,sp_support_area_update_support(area,ph));
+    int inside = 0;
+    for(int i = 0;i<ph->image_size;i++){
+      inside += (ph->pixel_flags->data[i] & SpPixelInsideSupport) != 0;
+    }
+    /* The random model blurs to distinct values, so exactly area of them
+       are above the threshold. The last one is the threshold itself. */
+    CuAssertIntEquals(tc,sp_min((int)(ph->image_size*areas[j]),ph->image_size-1),inside);
+  }
+  /* With ties in the template at most area of the pixels get in */
+  SpSupportAlgorithm * template = sp_support_template_alloc(support,2,sp_smap_create_from_pair(0,0.5));
+  SpSupportTemplateParameters * params = template->params;
+  CuAssertIntEquals(tc,0,sp_support_template_update_support(template,ph));
+  int inside = 0;
+  for(int i = 0;i<ph->image_size;i++){
+    inside += (ph->pixel_flags->data[i] & SpPixelInsideSupport) != 0;
+  }
+  CuAssertTrue(tc,inside > 0);
+  CuAssertTrue(tc,inside <= (int)(ph->image_size*0.5*params->original_area));
+  sp_phaser_free(ph);
+  sp_image_free(support);
+  sp_image_free(f);
+  sp_image_free(solution);
+  PRINT_DONE;
+}
+
 CuSuite* phasing_get_suite(void)
 {
   CuSuite* suite = CuSuiteNew();
@@ -1339,5 +2077,18 @@ CuSuite* phasing_get_suite(void)
   SUITE_ADD_TEST(suite,test_sp_phasing_diff_map_success_rate);
   SUITE_ADD_TEST(suite,test_sp_phasing_diff_map_noisy_success_rate);  
   SUITE_ADD_TEST(suite, test_sp_phasing_fourier_constraints);
+  SUITE_ADD_TEST(suite, test_sp_phasing_cpu_threaded);
+  SUITE_ADD_TEST(suite, test_sp_phasing_batch);
+  SUITE_ADD_TEST(suite, test_sp_phasing_workspace);
+  SUITE_ADD_TEST(suite, test_sp_phasing_fmodel_reuse);
+  SUITE_ADD_TEST(suite, test_sp_phasing_metrics);
+  SUITE_ADD_TEST(suite, test_sp_phasing_iterate_until);
+  SUITE_ADD_TEST(suite, test_sp_phasing_real_object);
+  SUITE_ADD_TEST(suite, test_sp_phasing_pixel_spans);
+  SUITE_ADD_TEST(suite, test_sp_phasing_specialized_kernels);
+  SUITE_ADD_TEST(suite, test_sp_phasing_rrr_and_accelerated_er);
+  SUITE_ADD_TEST(suite, test_sp_phasing_multires);
+  SUITE_ADD_TEST(suite, test_sp_phasing_low_memory);
+  SUITE_ADD_TEST(suite, test_sp_support_area_selection);
   return suite;
 }